@@ -15,6 +15,8 @@
  *******************************************************************************/
 #include "MQTTClient.h"
 
+#include <string.h>
+
 static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessage) {
     md->topicName = aTopicName;
     md->message = aMessage;
@@ -26,14 +28,194 @@ static int getNextPacketId(MQTTClient *c) {
 }
 
 
+static int findInflight(MQTTClient* c, unsigned short id)
+{
+    int i;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; i++)
+        if (c->inflight[i].id != 0 && c->inflight[i].id == id)
+            return i;
+    return -1;
+}
+
+
+/* packet ids still awaiting an ack must not be reused after a wrap around */
+static int getNextFreeId(MQTTClient *c) {
+    int id;
+    do
+        id = getNextPacketId(c);
+    while (findInflight(c, id) >= 0);
+    return id;
+}
+
+
+/* 
+ * Adapt the window to the acknowledgement round trip time: shrink it while
+ * the smoothed rtt is well above the best one seen (acks are queueing up
+ * somewhere), grow it again after a full window was acked without that.
+ */
+static void adaptInflightWindow(MQTTClient* c, int rtt)
+{
+    if (rtt < 0)
+        rtt = 0;
+
+    if (c->rtt_ms < 0)
+        c->rtt_ms = rtt;
+    else
+        c->rtt_ms = (7 * c->rtt_ms + rtt) / 8;
+
+    if (c->min_rtt_ms < 0 || rtt < c->min_rtt_ms)
+        c->min_rtt_ms = rtt;
+
+    if (++c->inflight_acked < c->inflight_window)
+        return;
+    c->inflight_acked = 0;
+
+    if (c->rtt_ms > 2 * c->min_rtt_ms + 10)
+    {
+        if (c->inflight_window > 1)
+            c->inflight_window--;
+    }
+    else if (c->inflight_window < c->inflight_max)
+    {
+        c->inflight_window++;
+    }
+}
+
+
+static int isRequest(MQTTInflight* inflight)
+{
+    return inflight->wait_type == SUBACK || inflight->wait_type == UNSUBACK;
+}
+
+
+static void completeInflight(MQTTClient* c, int i, int rc)
+{
+    void* context = c->inflight[i].context;
+    int request = isRequest(&c->inflight[i]);
+
+    c->ack_rtt_ms = -1;
+    if (rc == MQTT_SUCCESS && !request)
+    {
+        c->ack_rtt_ms = c->command_timeout_ms - platform_timer_left(&c->inflight[i].timer);
+        adaptInflightWindow(c, c->ack_rtt_ms);
+        c->stats.acks++;
+    }
+
+    c->inflight[i].id = 0;
+    c->inflight[i].context = 0;
+    c->inflight_count--;
+
+    if (context && request && c->requestHandler)
+        c->requestHandler(context, rc, c->requestHandlerData);
+    else if (context && !request && c->publishHandler)
+        c->publishHandler(context, rc, c->publishHandlerData);
+}
+
+
+static void abortInflight(MQTTClient* c)
+{
+    int i;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; i++)
+        if (c->inflight[i].id != 0)
+            completeInflight(c, i, MQTT_CONNECTION_LOST);
+}
+
+
+static int check_inflight(MQTTClient* c)
+{
+    int i, rc = MQTT_SUCCESS;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; i++)
+    {
+        if (c->inflight[i].id != 0 && platform_timer_isexpired(&c->inflight[i].timer))
+        {
+            platform_printf("no ack for packet %d within %d ms\n", c->inflight[i].id, c->command_timeout_ms);
+            c->stats.ack_timeouts++;
+            completeInflight(c, i, MQTT_CONNECTION_LOST);
+            c->inflight_window = 1;
+            rc = MQTT_CONNECTION_LOST;
+        }
+    }
+
+    return rc;
+}
+
+
+/* writes the packets held in txbuf */
+static int txFlush(MQTTClient* c, Timer* timer)
+{
+    int rc = MQTT_SUCCESS,
+        sent = 0;
+
+    while (sent < c->tx_len && !platform_timer_isexpired(timer))
+    {
+        rc = platform_network_write(c->ipstack, &c->txbuf[sent], c->tx_len - sent, platform_timer_left(timer));
+        if (rc < 0)  // there was an error writing the data
+            break;
+        sent += rc;
+    }
+
+    if (sent == c->tx_len)
+    {
+        if (sent)
+            platform_timer_countdown(&c->ping_timer, c->keepAliveInterval*1000); // record the fact that we have successfully sent the packets
+        rc = MQTT_SUCCESS;
+    }
+    else
+    {
+        rc = MQTT_CONNECTION_LOST;
+    }
+    c->tx_len = 0;
+    return rc;
+}
+
+
+/*
+ * Holds a packet in txbuf while corking. Returns 1 if it was taken, 0 if
+ * it has to be written right away, after everything held before it,
+ * or a negative value on error.
+ */
+static int txCork(MQTTClient* c, const platform_iovec_t* iov, int iovcnt, int length, Timer* timer)
+{
+    int rc, i;
+    int type = iov[0].base[0] >> 4;
+
+    if (!c->cork_ms || length > MQTT_TX_BUFFER_SIZE || type < PUBLISH || type > PUBCOMP)
+        return c->tx_len ? txFlush(c, timer) : 0;
+
+    if (c->tx_len + length > MQTT_TX_BUFFER_SIZE && (rc = txFlush(c, timer)) != MQTT_SUCCESS)
+        return rc;
+
+    if (!c->tx_len)
+        platform_timer_countdown(&c->tx_timer, c->cork_ms);
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].len == 0)
+            continue;
+        memcpy(&c->txbuf[c->tx_len], iov[i].base, iov[i].len);
+        c->tx_len += iov[i].len;
+    }
+    c->stats.bytes_out += length;
+
+    if (platform_timer_isexpired(&c->tx_timer) && (rc = txFlush(c, timer)) != MQTT_SUCCESS)
+        return rc;
+
+    return 1;
+}
+
+
 static int sendPacket(MQTTClient* c, int length, Timer* timer)
 {
     int rc = MQTT_FAILURE, 
         sent = 0;
+    platform_iovec_t iov = {c->buf, length};
+
+    if ((rc = txCork(c, &iov, 1, length, timer)) != 0)
+        return rc > 0 ? MQTT_SUCCESS : rc;
 
     while (sent < length && !platform_timer_isexpired(timer))
     {
-        rc = platform_network_write(c->ipstack, &c->buf[sent], length, platform_timer_left(timer));
+        rc = platform_network_write(c->ipstack, &c->buf[sent], length - sent, platform_timer_left(timer));
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -42,6 +224,53 @@ static int sendPacket(MQTTClient* c, int length, Timer* timer)
     if (sent == length)
     {
         platform_timer_countdown(&c->ping_timer, c->keepAliveInterval*1000); // record the fact that we have successfully sent the packet
+        c->stats.bytes_out += length;
+        rc = MQTT_SUCCESS;
+    }
+    else
+    {
+        rc = MQTT_CONNECTION_LOST;
+    }
+    return rc;
+}
+
+
+/* iov is consumed, entries are advanced in place on partial writes */
+static int sendPacketv(MQTTClient* c, platform_iovec_t* iov, int iovcnt, Timer* timer)
+{
+    int rc = MQTT_FAILURE;
+    int i, length = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        length += iov[i].len;
+
+    if ((rc = txCork(c, iov, iovcnt, length, timer)) != 0)
+        return rc > 0 ? MQTT_SUCCESS : rc;
+    rc = MQTT_FAILURE;
+
+    while (iovcnt > 0 && !platform_timer_isexpired(timer))
+    {
+        rc = platform_network_writev(c->ipstack, iov, iovcnt, platform_timer_left(timer));
+        if (rc < 0)  // there was an error writing the data
+            break;
+
+        while (iovcnt > 0 && rc >= iov->len)
+        {
+            rc -= iov->len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->base += rc;
+            iov->len -= rc;
+        }
+    }
+
+    if (iovcnt == 0)
+    {
+        platform_timer_countdown(&c->ping_timer, c->keepAliveInterval*1000); // record the fact that we have successfully sent the packet
+        c->stats.bytes_out += length;
         rc = MQTT_SUCCESS;
     }
     else
@@ -67,9 +296,36 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
     c->messageHandler = 0;
     c->messageHandlerData = 0;
 	c->next_packetid = 1;
+    c->publishHandler = 0;
+    c->publishHandlerData = 0;
+    c->requestHandler = 0;
+    c->requestHandlerData = 0;
+    c->inflight_count = 0;
+    c->inflight_max = MAX_INFLIGHT_MESSAGES;
+    c->inflight_window = MAX_INFLIGHT_MESSAGES;
+    c->inflight_acked = 0;
+    c->rtt_ms = -1;
+    c->min_rtt_ms = -1;
+    c->ack_rtt_ms = -1;
+    memset(&c->stats, 0, sizeof(c->stats));
+    c->rx_start = 0;
+    c->rx_end = 0;
+    c->rx_skip = 0;
+    c->rx_packet_len = 0;
+    c->tx_len = 0;
+    c->cork_ms = 0;
+
+    int i;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; i++)
+    {
+        c->inflight[i].id = 0;
+        c->inflight[i].context = 0;
+        platform_timer_init(&c->inflight[i].timer);
+    }
 
     platform_timer_init(&c->ping_timer);
     platform_timer_init(&c->pingresp_timer);
+    platform_timer_init(&c->tx_timer);
 	platform_mutex_init(&c->mutex);
 }
 
@@ -77,78 +333,162 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
 void MQTTClientDeinit(MQTTClient *c)
 {
     if (!c) return;
+    int i;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; i++)
+        platform_timer_deinit(&c->inflight[i].timer);
     platform_timer_deinit(&c->ping_timer);
     platform_timer_deinit(&c->pingresp_timer);
+    platform_timer_deinit(&c->tx_timer);
     platform_mutex_deinit(&c->mutex);
 }
 
 
-static int readRemainingLength(MQTTClient* c, int* value, int timeout)
+/*
+ * Returns the length of the packet at the start of the receive buffer,
+ * 0 if its fixed header is not complete yet or -1 if it is malformed
+ */
+static int rxPacketLength(MQTTClient* c)
 {
-    unsigned char i;
     int multiplier = 1;
-    int len = 0;
-    int rc;
+    int rem_len = 0;
+    int i;
     const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
 
-    *value = 0;
-    do
+    for (i = 1; i <= MAX_NO_OF_REMAINING_LENGTH_BYTES; i++)
     {
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES) {
-            len = 0; /* bad data */
-            goto exit;
-        }
+        if (c->rx_start + i >= c->rx_end)
+            return 0;
 
-        rc = platform_network_read(c->ipstack, &i, 1, timeout);
-        if (rc != 1) {
-            len = 0;
-            goto exit;
-        }
-
-        *value += (i & 127) * multiplier;
+        unsigned char byte = c->rxbuf[c->rx_start + i];
+        rem_len += (byte & 127) * multiplier;
         multiplier *= 128;
 
-    } while ((i & 128) != 0);
+        if ((byte & 128) == 0)
+            return 1 + i + rem_len;
+    }
 
-exit:
-    return len;
+    return -1; /* bad data */
+}
+
+
+static void rxConsume(MQTTClient* c, int len)
+{
+    c->rx_start += len;
+    if (c->rx_start == c->rx_end)
+        c->rx_start = c->rx_end = 0;
+}
+
+
+/* 
+ * Reads as much as the network has into the free end of the receive
+ * buffer. Returns like platform_network_read_some.
+ */
+static int rxFill(MQTTClient* c, Timer* timer)
+{
+    int rc;
+
+    if (c->rx_start > 0)
+    {
+        memmove(c->rxbuf, c->rxbuf + c->rx_start, c->rx_end - c->rx_start);
+        c->rx_end -= c->rx_start;
+        c->rx_start = 0;
+    }
+
+    rc = platform_network_read_some(c->ipstack, c->rxbuf + c->rx_end, MQTT_RX_BUFFER_SIZE - c->rx_end, platform_timer_left(timer));
+    if (rc > 0)
+        c->rx_end += rc;
+
+    return rc;
 }
 
 
+/* 
+ * Reads the next packet into readbuf, waiting for the network no longer
+ * than timer allows. A packet that has not fully arrived is kept, in
+ * rxbuf or readbuf, and completed by the next call.
+ */
 static int readPacket(MQTTClient* c, Timer* timer)
 {
-    int rc = MQTT_FAILURE;
+    int rc = MQTT_WOULD_BLOCK;
     MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
+    int len;
+    int buffered;
+    int read_bytes;
+
+    while (1)
+    {
+        buffered = c->rx_end - c->rx_start;
 
-    /* 1. read the header byte.  This has the packet type in it */
-	int read_bytes = platform_network_read(c->ipstack, c->readbuf, 1, platform_timer_left(timer));
+        if (c->rx_skip > 0)
+        {
+            /* the rest of a packet too big for readbuf */
+            int skip = buffered < c->rx_skip ? buffered : c->rx_skip;
+            rxConsume(c, skip);
+            c->rx_skip -= skip;
+            if (c->rx_skip > 0 && (read_bytes = rxFill(c, timer)) <= 0)
+                goto wait;
+            continue;
+        }
 
-    if (read_bytes != 1) {
-        if (read_bytes == 0)
+        if (c->rx_packet_len > 0)
+        {
+            /* a packet bigger than rxbuf is read straight into readbuf */
+            if (c->rx_packet_got == c->rx_packet_len)
+            {
+                len = c->rx_packet_len;
+                c->rx_packet_len = 0;
+                break;
+            }
+            read_bytes = platform_network_read_some(c->ipstack, c->readbuf + c->rx_packet_got, 
+                    c->rx_packet_len - c->rx_packet_got, platform_timer_left(timer));
+            if (read_bytes <= 0)
+                goto wait;
+            c->rx_packet_got += read_bytes;
+            continue;
+        }
+
+        len = rxPacketLength(c);
+        if (len < 0) {
             rc = MQTT_CONNECTION_LOST;
-        goto exit;
-    }
+            goto exit;
+        }
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    read_bytes = readRemainingLength(c, &rem_len, platform_timer_left(timer));
-    if (read_bytes == 0) {
-        rc = MQTT_CONNECTION_LOST;
-        goto exit;
-    }
+        if (len > (int)c->readbuf_size) {
+            /* now that large messages can be published, skip inbound ones that don't fit to stay in sync with the stream */
+            c->rx_skip = len;
+            c->stats.bytes_in += len;
+            platform_printf("dropped a packet too big for the read buffer\n");
+            rc = MQTT_BUFFER_OVERFLOW;
+            goto exit;
+        }
+
+        if (len > 0 && len <= buffered) {
+            memcpy(c->readbuf, c->rxbuf + c->rx_start, len);
+            rxConsume(c, len);
+            break;
+        }
 
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
+        if (len > MQTT_RX_BUFFER_SIZE) {
+            memcpy(c->readbuf, c->rxbuf + c->rx_start, buffered);
+            rxConsume(c, buffered);
+            c->rx_packet_len = len;
+            c->rx_packet_got = buffered;
+            continue;
+        }
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (platform_network_read(c->ipstack, c->readbuf + len, rem_len, platform_timer_left(timer)) != rem_len)) {
-        rc = MQTT_CONNECTION_LOST;
-        goto exit;
+        if ((read_bytes = rxFill(c, timer)) <= 0)
+            goto wait;
     }
 
+    c->stats.bytes_in += len;
     header.byte = c->readbuf[0];
     rc = header.bits.type;
+    goto exit;
+
+wait:
+    /* the platform reads 0 on errors, a negative read only means nothing arrived in time */
+    if (read_bytes == 0)
+        rc = MQTT_CONNECTION_LOST;
 exit:
     return rc;
 }
@@ -244,6 +584,25 @@ exit:
 }
 
 
+static int check_keepalive(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS;
+
+    if (keepalive(c) == MQTT_CONNECTION_LOST)
+        return MQTT_CONNECTION_LOST;
+
+    if (c->ping_outstanding && platform_timer_isexpired(&c->pingresp_timer))
+    {
+        c->ping_outstanding = 0;
+		platform_printf("ping response was not received within keepalive timeout of %d\n", 
+                c->keepAliveInterval);
+        rc = MQTT_CONNECTION_LOST;
+    }
+
+    return rc;
+}
+
+
 int cycle(MQTTClient* c, Timer* timer)
 {
     Timer t;
@@ -261,9 +620,50 @@ int cycle(MQTTClient* c, Timer* timer)
     switch (packet_type)
     {
         case CONNACK:
-        case PUBACK:
+            break;
         case SUBACK:
+        case UNSUBACK:
+        {
+            /* answers to MQTTSubscribeMany and the blocking calls are read by their waitfor */
+            unsigned short mypacketid;
+            int count = 0, granted[MAX_SUBSCRIBE_BATCH + 1]; /* a SUBACK for MQTTSubscribeMany holds a batch */
+            int grantedQoS = -1;
+            int i, ok;
+            if (packet_type == SUBACK)
+            {
+                ok = MQTTDeserialize_suback(&mypacketid, MAX_SUBSCRIBE_BATCH, &count, granted, c->readbuf, c->readbuf_size) == 1;
+                if (ok && count > 0)
+                    grantedQoS = granted[0];
+            }
+            else
+                ok = MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1;
+            if (ok && (i = findInflight(c, mypacketid)) >= 0 && c->inflight[i].wait_type == packet_type)
+            {
+                if (packet_type == UNSUBACK)
+                    completeInflight(c, i, MQTT_SUCCESS);
+                else if ((grantedQoS & 0xFF) == 0x80) /* readChar sign extends 0x80 */
+                    completeInflight(c, i, MQTT_SUBSCRIPTION_FAILED);
+                else
+                    completeInflight(c, i, grantedQoS);
+            }
             break;
+        }
+        case PUBACK:
+        case PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            int i;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            {
+                platform_printf("failed to deserialize ACK\n");
+                rc = MQTT_FAILURE;
+                goto exit;
+            }
+            if ((i = findInflight(c, mypacketid)) >= 0 && c->inflight[i].wait_type == packet_type)
+                completeInflight(c, i, MQTT_SUCCESS);
+            break;
+        }
         case PUBLISH:
         {
             MQTTString topicName;
@@ -273,6 +673,7 @@ int cycle(MQTTClient* c, Timer* timer)
                (unsigned char**)&msg.payload, &msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
                 goto exit;
             msg.qos = (enum QoS)intQoS;
+            c->stats.messages_in++;
             deliverMessage(c, &topicName, &msg);
             if (msg.qos != QOS0)
             {
@@ -305,29 +706,19 @@ int cycle(MQTTClient* c, Timer* timer)
                 rc = MQTT_FAILURE; // there was a problem
             if (rc == MQTT_FAILURE)
                 goto exit; // there was a problem
+            int i = findInflight(c, mypacketid);
+            if (i >= 0)
+                c->inflight[i].wait_type = PUBCOMP;
             break;
         }
-        case PUBCOMP:
-            break;
         case PINGRESP:
             c->ping_outstanding = 0;
             platform_printf("received ping response\n");
             break;
     }
 
-    if (keepalive(c) == MQTT_CONNECTION_LOST)
-    {
-        rc = MQTT_CONNECTION_LOST;
-        goto exit;
-    }
-
-    if (c->ping_outstanding && platform_timer_isexpired(&c->pingresp_timer))
-    {
-        c->ping_outstanding = 0;
-		platform_printf("ping response was not received within keepalive timeout of %d\n", 
-                c->keepAliveInterval);
-        rc = MQTT_CONNECTION_LOST;
-    }
+    if ((rc = check_keepalive(c)) == MQTT_SUCCESS)
+        rc = check_inflight(c);
 
 exit:
 	if (rc == MQTT_SUCCESS)
@@ -364,10 +755,95 @@ int MQTTYield(MQTTClient* c, int timeout_ms)
 }
 
 
+int MQTTProcess(MQTTClient* c, int readable)
+{
+    int rc = MQTT_SUCCESS;
+    Timer timer;
+
+    platform_mutex_lock(&c->mutex);
+
+    if (!c->isconnected)
+        goto exit;
+
+    if (readable)
+    {
+        /* take what has arrived, the rest of a partial packet is read by a later call */
+        platform_timer_init(&timer);
+        platform_timer_countdown(&timer, 0);
+        rc = cycle(c, &timer);
+    }
+    else if ((rc = check_keepalive(c)) == MQTT_SUCCESS)
+    {
+        rc = check_inflight(c);
+    }
+
+exit:
+    platform_mutex_unlock(&c->mutex);
+
+    return rc;
+}
+
+
+int MQTTPendingInput(MQTTClient* c)
+{
+    int len;
+    int ret = 0;
+
+    platform_mutex_lock(&c->mutex);
+
+    len = rxPacketLength(c);
+    if (!c->isconnected || c->rx_packet_len > 0)
+        ret = 0;
+    else if (c->rx_skip > 0)
+        ret = c->rx_end > c->rx_start;
+    else if (len != 0)
+        ret = len < 0 || len > MQTT_RX_BUFFER_SIZE || len > (int)c->readbuf_size || len <= c->rx_end - c->rx_start;
+
+    platform_mutex_unlock(&c->mutex);
+
+    return ret;
+}
+
+
+int MQTTNextDeadline(MQTTClient* c)
+{
+    int left = -1;
+    int i;
+
+    platform_mutex_lock(&c->mutex);
+
+    if (c->isconnected && c->keepAliveInterval > 0)
+    {
+        if (c->ping_outstanding)
+            left = platform_timer_left(&c->pingresp_timer);
+        else
+            left = platform_timer_left(&c->ping_timer);
+    }
+
+    for (i = 0; c->isconnected && i < MAX_INFLIGHT_MESSAGES; i++)
+    {
+        if (c->inflight[i].id != 0)
+        {
+            int ack_left = platform_timer_left(&c->inflight[i].timer);
+            if (left < 0 || ack_left < left)
+                left = ack_left;
+        }
+    }
+
+    platform_mutex_unlock(&c->mutex);
+
+    return left;
+}
+
+
 int waitfor(MQTTClient* c, int packet_type, Timer* timer)
 {
     int rc = MQTT_FAILURE;
 
+    /* the packet answered by packet_type may still be held by corking */
+    if (c->tx_len && txFlush(c, timer) != MQTT_SUCCESS)
+        return MQTT_CONNECTION_LOST;
+
     do
     {
         if (platform_timer_isexpired(timer))
@@ -404,6 +880,10 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
         options = &default_options; /* set default options if none were supplied */
     
     c->ping_outstanding = 0;
+    c->sessionPresent = 0;
+    c->rx_start = c->rx_end = 0;
+    c->rx_skip = c->rx_packet_len = 0;
+    c->tx_len = 0;
     c->keepAliveInterval = options->keepAliveInterval;
     platform_timer_countdown(&c->ping_timer, c->keepAliveInterval*1000);
 
@@ -418,7 +898,10 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
         unsigned char connack_rc = 255;
         unsigned char sessionPresent = 0;
         if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+        {
             rc = connack_rc;
+            c->sessionPresent = rc == MQTT_SUCCESS && sessionPresent;
+        }
         else
             rc = MQTT_FAILURE;
     }
@@ -455,6 +938,7 @@ int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos)
     int rc = MQTT_FAILURE;  
     Timer timer;
     int len = 0;
+    unsigned short id;
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicFilter;
     
@@ -466,26 +950,26 @@ int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos)
     platform_timer_init(&timer);
     platform_timer_countdown(&timer, c->command_timeout_ms);
     
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
+    id = getNextFreeId(c);
+    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, id, 1, &topic, (int*)&qos);
     if (len <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
         goto exit;             // there was a problem
+    c->stats.subscribes++;
 
-    if (waitfor(c, SUBACK, &timer) == SUBACK)      // wait for suback 
+    rc = MQTT_CONNECTION_LOST;
+    while (waitfor(c, SUBACK, &timer) == SUBACK)      // wait for suback 
     {
-        int count = 0, grantedQoS = -1;
+        int count = 0, granted[MAX_SUBSCRIBE_BATCH + 1]; // SUBACKs of other requests may hold a batch
         unsigned short mypacketid;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1) {
-            rc = grantedQoS; // 0, 1, 2 or 0x80 
+        if (MQTTDeserialize_suback(&mypacketid, MAX_SUBSCRIBE_BATCH, &count, granted, c->readbuf, c->readbuf_size) == 1 && mypacketid == id) {
+            rc = count > 0 ? granted[0] & 0xFF : MQTT_FAILURE; // 0, 1, 2 or 0x80, readChar sign extends 0x80
             if (rc == 0x80)  //special value defined in mqtt spec
                 rc = MQTT_SUBSCRIPTION_FAILED;
+            break;
         }
     }
-    else 
-    {
-		rc = MQTT_CONNECTION_LOST;
-	}
         
 exit:
 	platform_mutex_unlock(&c->mutex);
@@ -493,6 +977,103 @@ exit:
 }
 
 
+int MQTTSubscribeMany(MQTTClient* c, int count, const char* const topicFilters[], const enum QoS qos[], int grantedQoS[])
+{
+    int rc = MQTT_FAILURE;
+    Timer timer;
+    struct
+    {
+        unsigned short id;
+        int first;
+        int count;
+    } batches[MAX_SUBSCRIBE_PIPELINE];
+    int outstanding = 0;
+    int next = 0;
+    int i;
+
+	platform_mutex_lock(&c->mutex);
+
+	if (!c->isconnected)
+		goto exit;
+
+    platform_timer_init(&timer);
+    platform_timer_countdown(&timer, c->command_timeout_ms);
+
+    rc = MQTT_SUCCESS;
+    while (next < count || outstanding > 0)
+    {
+        /* keep up to MAX_SUBSCRIBE_PIPELINE packets on the wire */
+        while (next < count && outstanding < MAX_SUBSCRIBE_PIPELINE)
+        {
+            MQTTString topics[MAX_SUBSCRIBE_BATCH];
+            int requested[MAX_SUBSCRIBE_BATCH];
+            int n = 0, rem_len = 2, len;
+
+            while (next + n < count && n < MAX_SUBSCRIBE_BATCH)
+            {
+                topics[n].cstring = (char*)topicFilters[next + n];
+                topics[n].lenstring.len = 0;
+                topics[n].lenstring.data = 0;
+                int topic_len = 2 + MQTTstrlen(topics[n]) + 1;
+                if (n > 0 && MQTTPacket_len(rem_len + topic_len) > c->buf_size)
+                    break;
+                requested[n] = qos[next + n];
+                rem_len += topic_len;
+                n++;
+            }
+
+            batches[outstanding].id = getNextFreeId(c);
+            batches[outstanding].first = next;
+            batches[outstanding].count = n;
+
+            len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, batches[outstanding].id, n, topics, requested);
+            if (len <= 0)
+            {
+                rc = MQTT_BUFFER_OVERFLOW;
+                goto exit;
+            }
+            if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS)
+                goto exit;
+            c->stats.subscribes += n;
+
+            outstanding++;
+            next += n;
+        }
+
+        if (waitfor(c, SUBACK, &timer) != SUBACK)
+        {
+            rc = MQTT_CONNECTION_LOST;
+            goto exit;
+        }
+
+        int granted[MAX_SUBSCRIBE_BATCH + 1]; /* MQTTDeserialize_suback may store maxcount + 1 entries */
+        int granted_count = 0;
+        unsigned short mypacketid;
+        if (MQTTDeserialize_suback(&mypacketid, MAX_SUBSCRIBE_BATCH, &granted_count, granted, c->readbuf, c->readbuf_size) != 1)
+        {
+            rc = MQTT_FAILURE;
+            goto exit;
+        }
+
+        for (i = 0; i < outstanding && batches[i].id != mypacketid; i++)
+            ;
+        if (i == outstanding)
+            continue; /* not one of ours */
+
+        int j;
+        for (j = 0; j < batches[i].count; j++)
+            grantedQoS[batches[i].first + j] = (j < granted_count) ? (granted[j] & 0xFF) : 0x80; /* readChar sign extends 0x80 */
+
+        batches[i] = batches[--outstanding];
+        platform_timer_countdown(&timer, c->command_timeout_ms);
+    }
+
+exit:
+	platform_mutex_unlock(&c->mutex);
+    return rc;
+}
+
+
 int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
 {   
     int rc = MQTT_FAILURE;
@@ -500,6 +1081,7 @@ int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicFilter;
     int len = 0;
+    unsigned short id;
 
 	platform_mutex_lock(&c->mutex);
 	if (!c->isconnected)
@@ -508,21 +1090,22 @@ int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
     platform_timer_init(&timer);
     platform_timer_countdown(&timer, c->command_timeout_ms);
     
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
+    id = getNextFreeId(c);
+    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, id, 1, &topic)) <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
         goto exit; // there was a problem
     
-    if (waitfor(c, UNSUBACK, &timer) == UNSUBACK)
+    rc = MQTT_CONNECTION_LOST;
+    while (waitfor(c, UNSUBACK, &timer) == UNSUBACK)
     {
-        unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
+        unsigned short mypacketid;
+        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1 && mypacketid == id)
+        {
             rc = 0; 
+            break;
+        }
     }
-    else 
-    {
-        rc = MQTT_CONNECTION_LOST;
-	}
     
 exit:
 	platform_mutex_unlock(&c->mutex);
@@ -530,64 +1113,217 @@ exit:
 }
 
 
-int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+/* 
+ * Sends a SUBSCRIBE or UNSUBSCRIBE packet and records it as inflight, the
+ * matching ack is handled by cycle like the acks of publishes are
+ */
+static int sendRequest(MQTTClient* c, int wait_type, const char* topicFilter, enum QoS qos, void* context)
 {
     int rc = MQTT_FAILURE;
-    Timer timer;   
+    Timer timer;
     MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicName;
-    int len = 0;
+    unsigned short id;
+    int len, i;
+
+    topic.cstring = (char *)topicFilter;
 
 	platform_mutex_lock(&c->mutex);
+
 	if (!c->isconnected)
 		goto exit;
 
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES && c->inflight[i].id != 0; i++)
+        ;
+    if (i == MAX_INFLIGHT_MESSAGES)
+    {
+        rc = MQTT_INFLIGHT_FULL;
+        goto exit;
+    }
+
+    id = getNextFreeId(c);
+    if (wait_type == SUBACK)
+        len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, id, 1, &topic, (int*)&qos);
+    else
+        len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, id, 1, &topic);
+    if (len <= 0)
+        goto exit;
+
     platform_timer_init(&timer);
     platform_timer_countdown(&timer, c->command_timeout_ms);
+    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS)
+        goto exit;
+    if (wait_type == SUBACK)
+        c->stats.subscribes++;
+
+    c->inflight[i].id = id;
+    c->inflight[i].wait_type = wait_type;
+    c->inflight[i].context = context;
+    platform_timer_countdown(&c->inflight[i].timer, c->command_timeout_ms);
+    c->inflight_count++;
+
+exit:
+	platform_mutex_unlock(&c->mutex);
+    return rc;
+}
+
+
+int MQTTSubscribeAsync(MQTTClient* c, const char* topicFilter, enum QoS qos, void* context)
+{
+    return sendRequest(c, SUBACK, topicFilter, qos, context);
+}
+
+
+int MQTTUnsubscribeAsync(MQTTClient* c, const char* topicFilter, void* context)
+{
+    return sendRequest(c, UNSUBACK, topicFilter, QOS0, context);
+}
+
+
+/* 
+ * Must be called with the mutex held, the topic is given either as an MQTT string (encodedTopic)
+ * or as a C string. On success *slot is the inflight slot or -1 for QoS0.
+ */
+static int sendPublish(MQTTClient* c, const unsigned char* encodedTopic, const char* topicName, MQTTMessage* message, void* context, int* slot)
+{
+    int rc = MQTT_FAILURE;
+    Timer timer;   
+    platform_iovec_t iov[5];
+    unsigned char* ptr;
+    int topic_len;
+    int len = 0;
+    int i = -1;
+
+    if (encodedTopic)
+        topic_len = (encodedTopic[0] << 8) | encodedTopic[1];
+    else
+        topic_len = strlen(topicName);
 
     if (message->qos == QOS1 || message->qos == QOS2)
-        message->id = getNextPacketId(c);
+    {
+        for (i = 0; i < MAX_INFLIGHT_MESSAGES && c->inflight[i].id != 0; i++)
+            ;
+        if (i == MAX_INFLIGHT_MESSAGES)
+            return MQTT_INFLIGHT_FULL;
+        message->id = getNextFreeId(c);
+    }
+
+    platform_timer_init(&timer);
+    platform_timer_countdown(&timer, c->command_timeout_ms);
     
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id, 
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
+    /* only the headers go through buf, topic and payload are written from the caller's memory */
+    len = MQTTSerialize_publishHeader(c->buf, c->buf_size, 0, message->qos, message->retained, 
+              topic_len, message->payloadlen);
+    if (len <= 0 || len + 4 > c->buf_size)
         goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+
+    iov[0].base = c->buf;
+    iov[0].len = len;
+    ptr = c->buf + len;
+    if (encodedTopic)
+    {
+        iov[1].base = encodedTopic;
+        iov[1].len = 2 + topic_len;
+        iov[2].len = 0;
+    }
+    else
+    {
+        iov[1].base = ptr;
+        iov[1].len = 2;
+        writeInt(&ptr, topic_len);
+        iov[2].base = (const unsigned char*)topicName;
+        iov[2].len = topic_len;
+    }
+    iov[3].base = ptr;
+    iov[3].len = 0;
+    if (message->qos > QOS0)
     {
+        writeInt(&ptr, message->id);
+        iov[3].len = 2;
+    }
+    iov[4].base = (const unsigned char*)message->payload;
+    iov[4].len = message->payloadlen;
+
+    if ((rc = sendPacketv(c, iov, 5, &timer)) != MQTT_SUCCESS) // send the publish packet
         goto exit; // there was a problem
+    c->stats.publishes++;
+
+    if (i >= 0)
+    {
+        c->inflight[i].id = message->id;
+        c->inflight[i].wait_type = (message->qos == QOS1) ? PUBACK : PUBCOMP;
+        c->inflight[i].context = context;
+        platform_timer_countdown(&c->inflight[i].timer, c->command_timeout_ms);
+        c->inflight_count++;
     }
+    *slot = i;
 
-    if (message->qos == QOS1)
+exit:
+    platform_timer_deinit(&timer);
+    return rc;
+}
+
+
+static int publishAsync(MQTTClient* c, const unsigned char* encodedTopic, const char* topicName, MQTTMessage* message, void* context)
+{
+    int rc = MQTT_FAILURE;
+    int slot;
+
+	platform_mutex_lock(&c->mutex);
+	if (!c->isconnected)
+		goto exit;
+
+    if (message->qos != QOS0 && c->inflight_count >= c->inflight_window)
     {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-            {
-                platform_printf("failed to deserialize ACK\n");
-                rc = MQTT_FAILURE;
-            }
-        }
-        else
-        {
-            rc = MQTT_CONNECTION_LOST;
-        }
+        rc = MQTT_INFLIGHT_FULL;
+        goto exit;
     }
-    else if (message->qos == QOS2)
+
+    rc = sendPublish(c, encodedTopic, topicName, message, context, &slot);
+
+exit:
+	platform_mutex_unlock(&c->mutex);
+    return rc;
+}
+
+
+int MQTTPublishAsync(MQTTClient* c, const char* topicName, MQTTMessage* message, void* context)
+{
+    return publishAsync(c, 0, topicName, message, context);
+}
+
+
+int MQTTPublishEncodedAsync(MQTTClient* c, const unsigned char* encodedTopic, MQTTMessage* message, void* context)
+{
+    return publishAsync(c, encodedTopic, 0, message, context);
+}
+
+
+int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    int rc = MQTT_FAILURE;
+    int slot = -1;
+    unsigned short id;
+
+	platform_mutex_lock(&c->mutex);
+	if (!c->isconnected)
+		goto exit;
+
+    if ((rc = sendPublish(c, 0, topicName, message, 0, &slot)) != MQTT_SUCCESS || slot < 0)
+        goto exit;
+
+    /* acks for other inflight messages may arrive first, wait until our slot is released */
+    id = message->id;
+    while (c->inflight[slot].id == id)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-        }
-        else 
-        {
-            rc = MQTT_CONNECTION_LOST;
-		}
+        rc = cycle(c, &c->inflight[slot].timer);
+        if (rc == MQTT_CONNECTION_LOST)
+            break;
     }
+
+    if (c->inflight[slot].id == id)
+        completeInflight(c, slot, MQTT_CONNECTION_LOST);
+    else if (rc != MQTT_CONNECTION_LOST)
+        rc = MQTT_SUCCESS;
     
 exit:
 	platform_mutex_unlock(&c->mutex);
@@ -595,6 +1331,68 @@ exit:
 }
 
 
+int MQTTInflightAvailable(MQTTClient* c)
+{
+    int available;
+
+	platform_mutex_lock(&c->mutex);
+    available = c->inflight_window - c->inflight_count;
+	platform_mutex_unlock(&c->mutex);
+
+    return available > 0 ? available : 0;
+}
+
+
+int MQTTSetInflightWindow(MQTTClient* c, int window)
+{
+    if (window < 1 || window > MAX_INFLIGHT_MESSAGES)
+        return MQTT_FAILURE;
+
+    platform_mutex_lock(&c->mutex);
+    c->inflight_max = window;
+    c->inflight_window = window;
+    c->inflight_acked = 0;
+    platform_mutex_unlock(&c->mutex);
+
+    return MQTT_SUCCESS;
+}
+
+
+void MQTTSetCorking(MQTTClient* c, int ms)
+{
+	platform_mutex_lock(&c->mutex);
+    c->cork_ms = ms > 0 ? ms : 0;
+	platform_mutex_unlock(&c->mutex);
+}
+
+
+int MQTTFlush(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS;
+    Timer timer;
+
+	platform_mutex_lock(&c->mutex);
+    if (c->tx_len)
+    {
+        platform_timer_init(&timer);
+        platform_timer_countdown(&timer, c->command_timeout_ms);
+        rc = txFlush(c, &timer);
+        platform_timer_deinit(&timer);
+    }
+	platform_mutex_unlock(&c->mutex);
+
+    return rc;
+}
+
+
+void MQTTAbortInflight(MQTTClient* c)
+{
+	platform_mutex_lock(&c->mutex);
+    abortInflight(c);
+	platform_mutex_unlock(&c->mutex);
+}
+
+
 int MQTTDisconnect(MQTTClient* c)
 {  
     int rc = MQTT_FAILURE;
@@ -605,6 +1403,14 @@ int MQTTDisconnect(MQTTClient* c)
     platform_timer_init(&timer);
     platform_timer_countdown(&timer, c->command_timeout_ms);
 
+    /* give outstanding publishes a chance to be acknowledged */
+    while (c->isconnected && c->inflight_count > 0 && !platform_timer_isexpired(&timer))
+    {
+        if (cycle(c, &timer) == MQTT_CONNECTION_LOST)
+            break;
+    }
+    abortInflight(c);
+
 	len = MQTTSerialize_disconnect(c->buf, c->buf_size);
     if (len > 0)
         rc = sendPacket(c, len, &timer);            // send the disconnect packet
@@ -27,6 +27,26 @@
 
 #define MAX_PACKET_ID 65535 /* according to the MQTT specification - do not change! */
 
+#if !defined(MAX_SUBSCRIBE_BATCH)
+#define MAX_SUBSCRIBE_BATCH 32 /* topic filters per SUBSCRIBE packet sent by MQTTSubscribeMany */
+#endif
+
+#if !defined(MAX_SUBSCRIBE_PIPELINE)
+#define MAX_SUBSCRIBE_PIPELINE 4 /* SUBSCRIBE packets sent ahead of their SUBACKs */
+#endif
+
+#if !defined(MAX_INFLIGHT_MESSAGES)
+#define MAX_INFLIGHT_MESSAGES 16 /* upper limit of QoS1/QoS2 publishes awaiting acknowledgement */
+#endif
+
+#if !defined(MQTT_RX_BUFFER_SIZE)
+#define MQTT_RX_BUFFER_SIZE 512 /* inbound bytes read ahead, a burst of small packets takes a single read */
+#endif
+
+#if !defined(MQTT_TX_BUFFER_SIZE)
+#define MQTT_TX_BUFFER_SIZE 1024 /* outbound publishes and acks held back by MQTTSetCorking */
+#endif
+
 enum QoS { QOS0, QOS1, QOS2 };
 
 typedef struct MQTTMessage
@@ -45,6 +65,26 @@ typedef struct MessageData
     MQTTString* topicName;
 } MessageData;
 
+/* running totals, only updated with the client mutex held, wrap around */
+typedef struct MQTTStats
+{
+    unsigned int bytes_in;
+    unsigned int bytes_out;
+    unsigned int publishes;     /* PUBLISH packets sent */
+    unsigned int acks;          /* QoS1/QoS2 publishes acknowledged */
+    unsigned int ack_timeouts;  /* publishes not acknowledged within command_timeout_ms */
+    unsigned int subscribes;    /* topic filters sent in SUBSCRIBE packets */
+    unsigned int messages_in;   /* PUBLISH packets received */
+} MQTTStats;
+
+typedef struct MQTTInflight
+{
+    unsigned short id;          /* packet id, 0 if the slot is free */
+    unsigned char wait_type;    /* PUBACK, PUBREC or PUBCOMP for publishes, SUBACK or UNSUBACK for requests */
+    Timer timer;                /* acknowledgement deadline, also used to measure round trip time */
+    void* context;
+} MQTTInflight;
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
@@ -56,11 +96,41 @@ typedef struct MQTTClient
     unsigned int keepAliveInterval;
     char ping_outstanding;
     int isconnected;
+    int sessionPresent;     /* the broker kept the session of the last connection */
 
     void (*messageHandler) (MessageData*, void*);
     void* messageHandlerData;
 
+    /* called with the context passed to MQTTPublishAsync once a publish is acknowledged or failed */
+    void (*publishHandler) (void* context, int rc, void* handlerData);
+    void* publishHandlerData;
+
+    /* called with the context passed to MQTTSubscribeAsync or MQTTUnsubscribeAsync once it completed */
+    void (*requestHandler) (void* context, int rc, void* handlerData);
+    void* requestHandlerData;
+
+    MQTTInflight inflight[MAX_INFLIGHT_MESSAGES];
+    int inflight_count;
+    int inflight_max;       /* configured window */
+    int inflight_window;    /* current window, adapts to the measured round trip time */
+    int inflight_acked;
+    int rtt_ms;             /* smoothed acknowledgement round trip time */
+    int min_rtt_ms;
+    int ack_rtt_ms;         /* round trip time of the publish publishHandler is called for */
+
+    MQTTStats stats;
+
     Network* ipstack;
+    unsigned char rxbuf[MQTT_RX_BUFFER_SIZE];
+    int rx_start;           /* first byte in rxbuf not yet taken by readPacket */
+    int rx_end;
+    int rx_skip;            /* bytes of a packet too big for readbuf still to be dropped */
+    int rx_packet_len;      /* length of a packet bigger than rxbuf being read into readbuf */
+    int rx_packet_got;
+    unsigned char txbuf[MQTT_TX_BUFFER_SIZE];
+    int tx_len;
+    int cork_ms;            /* longest time a packet is held in txbuf, 0 to write every packet at once */
+    Timer tx_timer;         /* started by the first packet put into an empty txbuf */
     Timer ping_timer;
     Timer pingresp_timer;
 	Mutex mutex;
@@ -99,6 +169,80 @@ int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
  */
 int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+/** MQTT Publish Async - send an MQTT publish packet without waiting for the acks
+ *  QoS1/QoS2 messages take an inflight slot until acknowledged, then publishHandler
+ *  is called with the context. Acks may arrive in any order. QoS0 messages are complete 
+ *  as soon as this function returns.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send
+ *  @param context - user supplied pointer passed to publishHandler
+ *  @return success code, MQTT_INFLIGHT_FULL if no inflight slot is available
+ */
+int MQTTPublishAsync(MQTTClient* client, const char*, MQTTMessage*, void* context);
+
+/** MQTT Publish Encoded Async - same as MQTTPublishAsync with a topic that is already serialized
+ *  @param client - the client object to use
+ *  @param encodedTopic - the topic as an MQTT string: two byte big endian length followed by the name
+ *  @param message - the message to send
+ *  @param context - user supplied pointer passed to publishHandler
+ *  @return success code, MQTT_INFLIGHT_FULL if no inflight slot is available
+ */
+int MQTTPublishEncodedAsync(MQTTClient* client, const unsigned char* encodedTopic, MQTTMessage*, void* context);
+
+/** MQTT Subscribe Async - send an MQTT subscribe packet without waiting for the suback
+ *  The request takes an inflight slot until the suback arrives, then requestHandler is called
+ *  with the context and the granted QoS, MQTT_SUBSCRIPTION_FAILED or MQTT_CONNECTION_LOST.
+ *  @param client - the client object to use
+ *  @param topicFilter - the topic filter to subscribe to
+ *  @param context - user supplied pointer passed to requestHandler
+ *  @return success code, MQTT_INFLIGHT_FULL if no inflight slot is available
+ */
+int MQTTSubscribeAsync(MQTTClient* client, const char* topicFilter, enum QoS, void* context);
+
+/** MQTT Unsubscribe Async - send an MQTT unsubscribe packet without waiting for the unsuback
+ *  Completes like MQTTSubscribeAsync, requestHandler is called with MQTT_SUCCESS or MQTT_CONNECTION_LOST.
+ *  @param client - the client object to use
+ *  @param topicFilter - the topic filter to unsubscribe from
+ *  @param context - user supplied pointer passed to requestHandler
+ *  @return success code, MQTT_INFLIGHT_FULL if no inflight slot is available
+ */
+int MQTTUnsubscribeAsync(MQTTClient* client, const char* topicFilter, void* context);
+
+/** MQTT Inflight Available - number of publishes that can be sent without exceeding the window
+ *  @param client - the client object to use
+ *  @return number of free inflight slots
+ */
+int MQTTInflightAvailable(MQTTClient* client);
+
+/** MQTT Set Inflight Window - set the maximum number of unacknowledged QoS1/QoS2 publishes
+ *  The effective window adapts between 1 and this value depending on the measured round trip time.
+ *  @param client - the client object to use
+ *  @param window - 1 to MAX_INFLIGHT_MESSAGES
+ *  @return success code
+ */
+int MQTTSetInflightWindow(MQTTClient* client, int window);
+
+/** MQTT Set Corking - hold PUBLISH, PUBACK, PUBREC, PUBREL and PUBCOMP packets in a send buffer
+ *  They are written together once the buffer is full, the first of them was held for ms, another
+ *  packet is sent or MQTTFlush is called. Meant to be used by a single thread calling MQTTFlush
+ *  before it waits for the network.
+ *  @param client - the client object to use
+ *  @param ms - longest time a packet is held, 0 (default) writes every packet at once
+ */
+void MQTTSetCorking(MQTTClient* client, int ms);
+
+/** MQTT Flush - write the packets held by corking
+ *  @param client - the client object to use
+ *  @return success code
+ */
+int MQTTFlush(MQTTClient* client);
+
+/** MQTT Abort Inflight - complete all unacknowledged publishes with MQTT_CONNECTION_LOST
+ *  @param client - the client object to use
+ */
+void MQTTAbortInflight(MQTTClient* client);
+
 /** MQTT Subscribe - send an MQTT subscribe packet and wait for suback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to subscribe to
@@ -108,6 +252,18 @@ int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
  */
 int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum QoS);
 
+/** MQTT Subscribe Many - subscribe to a number of topic filters using as few round trips as possible
+ *  Filters are packed into SUBSCRIBE packets up to the size of the send buffer and MAX_SUBSCRIBE_BATCH,
+ *  several packets are sent before waiting for their SUBACKs.
+ *  @param client - the client object to use
+ *  @param count - number of topic filters
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qos - the requested QoS for each topic filter
+ *  @param grantedQoS - filled with the granted QoS or 0x80 for each topic filter that was refused
+ *  @return success code once every filter got a SUBACK entry
+ */
+int MQTTSubscribeMany(MQTTClient* client, int count, const char* const topicFilters[], const enum QoS qos[], int grantedQoS[]);
+
 /** MQTT Subscribe - send an MQTT unsubscribe packet and wait for unsuback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to unsubscribe from
@@ -128,6 +284,28 @@ int MQTTDisconnect(MQTTClient* client);
  */
 int MQTTYield(MQTTClient* client, int time);
 
+/** MQTT Process - handle a single incoming packet and keepalive, without waiting for data
+ *  Meant to be called when the network is readable or the keepalive deadline expired.
+ *  A packet that has not fully arrived yet is kept and completed by a later call.
+ *  @param client - the client object to use
+ *  @param readable - non zero if the network has data to read
+ *  @return success code, MQTT_WOULD_BLOCK if no complete packet could be read
+ */
+int MQTTProcess(MQTTClient* client, int readable);
+
+/** MQTT Next Deadline - time until the next keepalive or acknowledgement deadline
+ *  @param client - the client object to use
+ *  @return time in milliseconds, or -1 if there is no deadline
+ */
+int MQTTNextDeadline(MQTTClient* client);
+
+/** MQTT Pending Input - whether a complete packet was already read from the network
+ *  Such a packet does not make the network readable, call MQTTProcess without waiting.
+ *  @param client - the client object to use
+ *  @return non zero if MQTTProcess can be called with readable set
+ */
+int MQTTPendingInput(MQTTClient* client);
+
 int MQTTisConnected(MQTTClient* client);
 
 
@@ -98,22 +98,21 @@ int MQTTPacket_len(int rem_len)
 }
 
 
-static unsigned char* bufptr;
-
-int bufchar(unsigned char* c, int count)
-{
-	int i;
-
-	for (i = 0; i < count; ++i)
-		*c = *bufptr++;
-	return count;
-}
-
-
+/* decodes in place, clients running on different threads must not share a read pointer */
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value)
 {
-	bufptr = buf;
-	return MQTTPacket_decode(bufchar, value);
+	int multiplier = 1;
+	int len = 0;
+
+	*value = 0;
+	do
+	{
+		if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+			break;	/* bad data */
+		*value += (*buf & 127) * multiplier;
+		multiplier *= 128;
+	} while ((*buf++ & 128) != 0);
+	return len;
 }
 
 
@@ -91,6 +91,53 @@ exit:
 }
 
 
+/**
+  * Serializes the fixed header of a publish packet, for sending topic and payload from their own buffers.
+  * The packet is made of the returned header, the topic name as an MQTT string (two byte length
+  * followed by the name), for QoS 1 and 2 the packet identifier and then the payload.
+  * @param buf the buffer into which the fixed header will be serialized
+  * @param buflen the length in bytes of the supplied buffer, 5 bytes are always enough
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param topiclen integer - the length of the topic name
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		int topiclen, int payloadlen)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 2 + topiclen + payloadlen;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (qos > 0)
+		rem_len += 2; /* packetid */
+
+	if (MQTTPacket_len(rem_len) - rem_len > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	rc = ptr - buf;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 
 /**
   * Serializes the ack packet into the supplied buffer.
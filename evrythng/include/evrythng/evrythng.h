@@ -29,6 +29,9 @@
 
 typedef enum _evrythng_return_t 
 {
+    EVRYTHNG_SUPERSEDED          = -18,
+    EVRYTHNG_RATE_LIMITED        = -17,
+    EVRYTHNG_QUEUE_FULL          = -16,
     EVRYTHNG_CLIENT_ID_REJECTED  = -15,
     EVRYTHNG_AUTH_FAILED         = -14,
     EVRYTHNG_NOT_SUBSCRIBED      = -13,
@@ -56,6 +59,29 @@ typedef enum
 } evrythng_log_level_t;
 
 
+/** @brief Least important level of log messages built into the library.
+ *
+ *  Define EVRYTHNG_LOG_LEVEL when compiling the library to remove less
+ *  important log messages from the code: 1 keeps errors and warnings,
+ *  0 only errors and -1 removes logging altogether. EvrythngSetLogLevel()
+ *  can lower the level further at run time.
+ */
+#if !defined(EVRYTHNG_LOG_LEVEL)
+#define EVRYTHNG_LOG_LEVEL 2
+#endif
+
+
+/** @brief Classes of published messages which can be rate limited, see EvrythngSetRateLimit().
+ */
+typedef enum 
+{
+    EVRYTHNG_RATE_ALL        = 0,   /**< all messages of a handle */
+    EVRYTHNG_RATE_PROPERTIES = 1, 
+    EVRYTHNG_RATE_ACTIONS    = 2, 
+    EVRYTHNG_RATE_LOCATIONS  = 3, 
+} evrythng_rate_class_t;
+
+
 /** @brief Log callback prototype.
  */
 typedef void (*evrythng_log_callback)(evrythng_log_level_t level, const char* fmt, va_list vl); 
@@ -66,6 +92,16 @@ typedef void (*evrythng_log_callback)(evrythng_log_level_t level, const char* fm
 typedef struct evrythng_ctx_t* evrythng_handle_t;
 
 
+/** @brief Prepared publish handle, see EvrythngPreparePublish().
+ */
+typedef struct evrythng_pub_ctx_t* evrythng_pub_handle_t;
+
+
+/** @brief Shared event loop threads, see EvrythngInitEngine().
+ */
+typedef struct evrythng_engine_ctx_t* evrythng_engine_handle_t;
+
+
 /** @brief Callback prototype.
  */
 typedef void (*evrythng_callback)(); 
@@ -80,6 +116,111 @@ typedef void (*evrythng_callback)();
 typedef void sub_callback(const char* str_json, size_t length);
 
 
+/** @brief Description of a single subscription for EvrythngSubscribeMany().
+ *
+ *  entity is "thngs", "products" or "actions". entity_id is the thng or
+ *  product ID and data_type one of "properties", "actions" or "location",
+ *  both are null pointers for "actions". data_name is the property or action
+ *  name, "all" for all actions, or a null pointer for all properties or the 
+ *  location.
+ *
+ *  result receives the outcome for this subscription.
+ */
+typedef struct evrythng_subscription_t
+{
+    const char*         entity;
+    const char*         entity_id;
+    const char*         data_type;
+    const char*         data_name;
+    int                 pub_states;
+    sub_callback*       callback;
+    evrythng_return_t   result;
+} evrythng_subscription_t;
+
+
+/** @brief Token identifying an asynchronous request.
+ */
+typedef int evrythng_token_t;
+
+
+/** @brief Callback prototype used for asynchronous publish functions,
+ *  	   which is called when the request completes.
+ *
+ *  result holds the code the blocking function would have returned, or
+ *  EVRYTHNG_SUPERSEDED if a later update replaced it before it was sent,
+ *  see EvrythngSetCoalescing(). latency_ms is the time elapsed between the
+ *  call and the acknowledgement from the Evrythng cloud.
+ */
+typedef void pub_callback(evrythng_token_t token, evrythng_return_t result, int latency_ms);
+
+
+/** @brief Number of buckets of an evrythng_histogram_t.
+ */
+#define EVRYTHNG_HISTOGRAM_BUCKETS 64
+
+
+/** @brief Distribution of durations in milliseconds.
+ *
+ *  Buckets 0 to 3 count the values 0 to 3, each following power of two
+ *  is split into four buckets of equal width, so a value is known to
+ *  within 25%. The last bucket also counts all larger values. Use
+ *  EvrythngHistogramPercentile() to read it.
+ */
+typedef struct evrythng_histogram_t
+{
+    unsigned int count;     /**< number of values recorded */
+    unsigned int max;       /**< largest value recorded */
+    unsigned int buckets[EVRYTHNG_HISTOGRAM_BUCKETS];
+} evrythng_histogram_t;
+
+
+/** @brief Snapshot of the activity of a handle, see EvrythngGetStats().
+ *
+ *  Counters start at 0 when the handle is initialized and wrap around.
+ */
+typedef struct evrythng_stats_t
+{
+    unsigned int publishes;     /**< messages sent, stored ones and retries included */
+    unsigned int acks;          /**< messages acknowledged by the cloud */
+    unsigned int subscribes;    /**< subscriptions requested, restored ones included */
+    unsigned int messages_in;   /**< messages received */
+    unsigned int bytes_in;
+    unsigned int bytes_out;
+    unsigned int reconnects;    /**< connections restored after they were lost */
+    unsigned int timeouts;      /**< messages not acknowledged in time or expired before they were sent */
+    unsigned int dropped;       /**< received messages dropped because a callback worker was too far behind */
+
+    int queue_depth;            /**< requests waiting to be sent */
+    int stored;                 /**< messages in the offline store */
+    int inflight;               /**< messages waiting for an acknowledgement */
+    int subscriptions;          /**< active subscriptions */
+
+    evrythng_histogram_t publish_latency;       /**< time from sending a message to its acknowledgement */
+    evrythng_histogram_t callback_duration;     /**< time spent in subscription callbacks */
+} evrythng_stats_t;
+
+
+/** @brief Events of the connection passed to EvrythngProcess().
+ */
+typedef enum 
+{
+    EVRYTHNG_POLL_READ  = 1,
+    EVRYTHNG_POLL_WRITE = 2,
+} evrythng_poll_events_t;
+
+
+/** @brief What the event loop of the application watches for a handle in 
+ *         poll mode, see EvrythngGetPollState().
+ */
+typedef struct evrythng_poll_t
+{
+    int fd;             /**< socket of the connection, -1 while not connected */
+    int events;         /**< evrythng_poll_events_t to watch fd for */
+    int wakeup_fd;      /**< readable when another thread queued work for the handle, -1 if the platform has none */
+    int timeout_ms;     /**< call EvrythngProcess() after this long at the latest, -1 for no limit */
+} evrythng_poll_t;
+
+
 /** @brief Initialize context.
  *
  * Use this function to initialize context which contains Evrythng client configuration
@@ -105,6 +246,40 @@ evrythng_return_t EvrythngInitHandle(evrythng_handle_t* handle);
 void EvrythngDestroyHandle(evrythng_handle_t handle);
 
 
+/** @brief Start an engine which drives many handles with a few threads.
+ *
+ * Every handle normally has an internal thread of its own. Handles added
+ * to an engine with EvrythngSetEngine are driven by the loop threads of 
+ * the engine instead. Each handle is bound to one of the loops, which
+ * waits for the connections of all its handles at once, so thousands of
+ * connections need no more threads than there are loops. Connecting,
+ * which waits for the cloud, is left to a few connect workers of the
+ * engine, two for every loop, so the loops go on meanwhile. Callbacks of
+ * a handle are called in the context of its loop thread or of a connect
+ * worker and delay the other handles of that thread.
+ *
+ * @param[in] engine  A pointer to engine handle.
+ * @param[in] threads Number of loop threads, from 0 to 256. 0 starts one
+ *                    for every processor.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if engine is a null pointer or threads is out of range \n
+ *            \b EVRYTHNG_MEMORY_ERROR if the threads could not be started \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngInitEngine(evrythng_engine_handle_t* engine, int threads);
+
+
+/** @brief Stop an engine.
+ *
+ * All handles added to the engine must have been destroyed before.
+ *
+ * @param[in] engine An engine handle.
+ *
+ * @return void
+ */
+void EvrythngDestroyEngine(evrythng_engine_handle_t engine);
+
+
 /** @brief Set URL to connect to.
  *
  * Use this function to set URL to internal context, tcp://<ip>:<port> for 
@@ -165,6 +340,151 @@ evrythng_return_t EvrythngSetClientId(evrythng_handle_t handle, const char* clie
 evrythng_return_t EvrythngSetQos(evrythng_handle_t handle, int qos);
 
 
+/** @brief Set the maximum number of unacknowledged publishes.
+ *
+ * With QoS 1 or 2 up to this many publish messages are sent without
+ * waiting for the acknowledgement of the previous ones. The number
+ * actually in flight is lowered automatically while the acknowledgement
+ * round trip time grows and raised back up to this value once it recovers.
+ * If the window was not setup a default value of 8 will be used.
+ *
+ * @param[in] handle A context handle.
+ * @param[in] window A window size from 1 to MAX_INFLIGHT_MESSAGES (16).
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or window is out of range \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetInflightWindow(evrythng_handle_t handle, int window);
+
+
+/** @brief Keep outgoing messages in persistent storage while offline.
+ *
+ * Once a store is set, publish calls made while the connection is down
+ * do not fail with EVRYTHNG_NOT_CONNECTED, the messages are appended
+ * to the store instead and published in order once the connection is
+ * restored. So are messages published while earlier ones are still
+ * waiting in the store and asynchronous publishes that find the queue
+ * full. Stored messages survive a restart of the application and are
+ * only removed after the cloud has acknowledged them, so a message may
+ * be delivered twice but is not lost. Completion callbacks are not
+ * called for stored messages and their token is 0.
+ * Storage is written in batches, at least once per second.
+ * Must be called before EvrythngConnect.
+ *
+ * @param[in] handle A context handle.
+ * @param[in] path   Name of the storage, passed to platform_store_map.
+ * @param[in] size   Size of the storage in bytes.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle or path is a null pointer or size is too small \n
+ *            \b EVRYTHNG_FAILURE      if already connected or the storage can't be mapped \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetOfflineStore(evrythng_handle_t handle, const char* path, size_t size);
+
+
+/** @brief Limit the rate at which stored messages are sent.
+ *
+ * Messages kept in the offline store while the connection was down are
+ * sent at no more than this many per second after it is restored, so
+ * a long backlog does not hold back new messages or flood the cloud.
+ * A value of 0, the default, sends them as fast as the inflight window
+ * allows.
+ *
+ * @param[in] handle       A context handle.
+ * @param[in] msgs_per_sec Maximum number of stored messages per second, 0 for no limit.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or msgs_per_sec is negative \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetOfflineDrainRate(evrythng_handle_t handle, int msgs_per_sec);
+
+
+/** @brief Keep only the latest value of property updates waiting to be sent.
+ *
+ * When enabled, a single property update published while an earlier
+ * update of the same property is still waiting to be sent replaces it
+ * instead of being added after it. This applies to updates waiting in
+ * the queue of asynchronous publishes and in the offline store, so a
+ * backlog holds at most one update per property. A replaced asynchronous
+ * update hands its place over to the new one, which gets a token of its
+ * own, and its callback is called with EVRYTHNG_SUPERSEDED. Actions,
+ * locations and updates of several properties at once are never replaced.
+ * Coalescing is disabled by default.
+ *
+ * @param[in] handle A context handle.
+ * @param[in] enable Non zero to enable coalescing, 0 to disable it.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetCoalescing(evrythng_handle_t handle, int enable);
+
+
+/** @brief Send single property updates together in batches.
+ *
+ * When enabled, updates published with EvrythngPubThngProperty,
+ * EvrythngPubProductProperty and their Async counterparts are not sent
+ * at once. They are collected per thng or product and sent as a single
+ * update of several properties, as EvrythngPubThngProperties would do,
+ * once window_ms has passed since the first of them or max_count of
+ * them have been collected. The property value must be a JSON array of
+ * objects, a "key" member naming the property is added to each one.
+ * Updates which are not in this form are sent on their own.
+ * Collected updates return EVRYTHNG_SUCCESS as soon as they are taken,
+ * an asynchronous one gets token 0 and its callback is not called.
+ * Collected updates are sent on EvrythngDisconnect and when
+ * aggregation is disabled.
+ *
+ * @param[in] handle    A context handle.
+ * @param[in] window_ms How long to collect updates, 0 to disable aggregation.
+ * @param[in] max_count Maximum number of updates in a batch, 0 for no limit.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or a value is negative \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetAggregation(evrythng_handle_t handle, int window_ms, int max_count);
+
+
+/** @brief Limit the rate of published messages.
+ *
+ * Each class of messages has a token bucket which holds up to burst
+ * tokens and is refilled with msgs_per_sec tokens per second. Every
+ * message takes a token from the bucket of its class and one from the
+ * bucket of EVRYTHNG_RATE_ALL. A publish which finds a bucket empty waits
+ * for a token as long as allowed by EvrythngSetRateLimitWait, asynchronous
+ * publishes never wait, and fails with EVRYTHNG_RATE_LIMITED if none
+ * comes in time. Messages from the offline store wait in the store
+ * instead, batches of aggregated updates are always sent and take their
+ * tokens in advance from the following messages.
+ * No limit is set by default.
+ *
+ * @param[in] handle       A context handle.
+ * @param[in] rate_class   The class of messages to limit.
+ * @param[in] msgs_per_sec Number of messages per second, 0 to remove the limit.
+ * @param[in] burst        Number of messages which can be sent at once, 0 for msgs_per_sec.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer, rate_class is unknown or a value is negative \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetRateLimit(evrythng_handle_t handle, evrythng_rate_class_t rate_class, int msgs_per_sec, int burst);
+
+
+/** @brief Set how long a publish may wait for the rate limit.
+ *
+ * A publish which exceeds the limit set with EvrythngSetRateLimit is
+ * delayed until it may be sent, as long as that is within max_wait_ms.
+ * Otherwise it fails at once with EVRYTHNG_RATE_LIMITED. The default of 0
+ * never waits.
+ *
+ * @param[in] handle      A context handle.
+ * @param[in] max_wait_ms Maximum delay in milliseconds.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or max_wait_ms is negative \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetRateLimitWait(evrythng_handle_t handle, int max_wait_ms);
+
+
 /** @brief Set log callback
  *
  * Use this function to set log callback to internal context 
@@ -181,6 +501,43 @@ evrythng_return_t EvrythngSetQos(evrythng_handle_t handle, int qos);
 evrythng_return_t EvrythngSetLogCallback(evrythng_handle_t handle, evrythng_log_callback callback);
 
 
+/** @brief Set the least important level of messages to log.
+ *
+ * Messages of a less important level are dropped before they are 
+ * formatted, so they cost no more than a comparison. If it was not
+ * setup all messages are logged.
+ *
+ * @param[in] handle A context handle.
+ * @param[in] level  EVRYTHNG_LOG_ERROR, EVRYTHNG_LOG_WARNING or EVRYTHNG_LOG_DEBUG.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or level is out of range \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetLogLevel(evrythng_handle_t handle, evrythng_log_level_t level);
+
+
+/** @brief Call the log callback from a thread of its own.
+ *
+ * By default the log callback is called by the thread which logs,
+ * often the internal thread, which has to wait for it. With a log queue
+ * messages are formatted into a queue of lines instead, and a separate
+ * thread passes them to the callback as "%s" with the line as the only
+ * argument. Lines longer than 159 characters are cut. If the queue is
+ * full messages are dropped, which is reported in a warning once there
+ * is room again. The thread uses the priority and stack size of the
+ * internal thread. Must be called before EvrythngConnect.
+ *
+ * @param[in] handle A context handle.
+ * @param[in] lines  Number of lines the queue can hold.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or lines is less than 1 \n
+ *            \b EVRYTHNG_FAILURE      if already connected or a log queue is set already \n
+ *            \b EVRYTHNG_MEMORY_ERROR if the queue or thread can't be created \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetLogQueue(evrythng_handle_t handle, int lines);
+
+
 /** @brief Set callback on connection lost/restored
  *
  * Use this function to set callback that will be called on connection lost.
@@ -224,6 +581,95 @@ evrythng_return_t EvrythngSetThreadPriority(evrythng_handle_t handle, int priori
 evrythng_return_t EvrythngSetThreadStacksize(evrythng_handle_t handle, int stacksize);
 
 
+/** @brief Keep the session on the broker between connections.
+ *
+ * By default the broker forgets the subscriptions of the client when it
+ * disconnects, so they are all made again after every reconnect. With a
+ * persistent session the broker keeps them, and after a reconnect they
+ * are only made again if the broker reports that it lost the session.
+ * Messages sent to the subscriptions with QoS 1 or 2 while the client
+ * was away are delivered once it is back. The session is bound to the
+ * client id, so a fixed one should be set with EvrythngSetClientId.
+ * A persistent session connects with MQTT 3.1.1 instead of 3.1, and
+ * EvrythngDisconnect leaves the subscriptions in place. Must be called
+ * before EvrythngConnect.
+ *
+ * @param[in] handle  A context handle.
+ * @param[in] enable  1 to keep the session, 0 (default) to start a clean one.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer \n
+ *            \b EVRYTHNG_FAILURE      if already connected \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetPersistentSession(evrythng_handle_t handle, int enable);
+
+
+/** @brief Run subscription callbacks on worker threads.
+ *
+ * By default subscription callbacks are called in the context of the
+ * internal thread, so a slow callback delays keepalives, acknowledgements
+ * and the messages of every other subscription. With workers set every
+ * received message is copied and handed to one of them instead. Messages
+ * of the same topic are always handled by the same worker, one after
+ * another and in the order they arrived, while messages of different
+ * topics can be handled at the same time. A worker which falls too far
+ * behind makes the internal thread wait for it. A loop thread of an
+ * engine, see EvrythngSetEngine, drives other handles too and doesn't
+ * wait: it drops the message and counts it in the dropped statistic.
+ * Workers use the priority and stack size of the internal thread. A value of 0 (default) disables
+ * the workers. Must be called before EvrythngConnect.
+ *
+ * @param[in] handle  A context handle.
+ * @param[in] workers Number of worker threads, from 0 to 16.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer or workers is out of range \n
+ *            \b EVRYTHNG_FAILURE      if already connected \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetCallbackWorkers(evrythng_handle_t handle, int workers);
+
+
+/** @brief Let the application drive the handle from its own event loop.
+ *
+ * By default EvrythngConnect starts an internal thread which does all the
+ * communication with the cloud. In poll mode no thread is started.
+ * Instead the application watches the descriptors returned by
+ * EvrythngGetPollState and calls EvrythngProcess when one of them is
+ * ready or the timeout has passed. Callbacks are then called in the
+ * context of EvrythngProcess. Blocking api calls still work, they do the
+ * work of the internal thread themselves until their request is done.
+ * Must be called before EvrythngConnect.
+ *
+ * @param[in] handle  A context handle.
+ * @param[in] enable  1 for poll mode, 0 (default) for the internal thread.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer \n
+ *            \b EVRYTHNG_FAILURE      if already connected \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetPollMode(evrythng_handle_t handle, int enable);
+
+
+/** @brief Let an engine drive the handle.
+ *
+ * No internal thread is started for the handle. EvrythngConnect adds it
+ * to the loop thread of the engine with the fewest handles, and a connect
+ * worker of the engine makes a single attempt to connect. Reconnects after
+ * a lost connection are made by the connect workers too. Blocking api calls wait for the loop thread as
+ * they would wait for the internal thread. Must be called before 
+ * EvrythngConnect.
+ *
+ * @param[in] handle  A context handle.
+ * @param[in] engine  An engine started with EvrythngInitEngine, a null
+ *                    pointer (default) for the internal thread.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer \n
+ *            \b EVRYTHNG_FAILURE      if already connected \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngSetEngine(evrythng_handle_t handle, evrythng_engine_handle_t engine);
+
+
 /** @brief Connect to Evrythng cloud.
  *
  * Use this function to connect to the Evrythng cloud.
@@ -259,6 +705,70 @@ evrythng_return_t EvrythngConnect(evrythng_handle_t handle);
 evrythng_return_t EvrythngDisconnect(evrythng_handle_t handle);
 
 
+/** @brief Get what to wait for before calling EvrythngProcess() in poll mode.
+ *
+ * The socket changes when the connection is restored and the timeout
+ * after every call of EvrythngProcess, so the state should be read again
+ * after each of them. The library writes with a timeout instead of 
+ * waiting for the socket to become writable, so at present events only
+ * asks for EVRYTHNG_POLL_READ.
+ *
+ * @param[in]  handle A context handle.
+ * @param[out] state  Receives the descriptors and the timeout.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle or state is a null pointer \n
+ *            \b EVRYTHNG_FAILURE      if the handle is not in poll mode or added to an engine \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngGetPollState(evrythng_handle_t handle, evrythng_poll_t* state);
+
+
+/** @brief Do the work of the handle which is due, without waiting.
+ *
+ * Reads what has arrived, sends queued messages, keeps the connection
+ * alive and restores it when it was lost. Call it when fd or wakeup_fd 
+ * of EvrythngGetPollState is ready, including errors and hangups, or 
+ * when its timeout has passed. A lost connection is restored one attempt 
+ * per call, which may block for the time it takes to connect.
+ *
+ * @param[in] handle A context handle.
+ * @param[in] events The evrythng_poll_events_t fd is ready for, 0 for none.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle is a null pointer \n
+ *            \b EVRYTHNG_FAILURE      if the handle is not in poll mode, added to an engine or EvrythngConnect was not called \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngProcess(evrythng_handle_t handle, int events);
+
+
+/** @brief Get counters and measurements of a handle.
+ *
+ * Use this function to monitor the library. Statistics are always
+ * collected, without locking, so the fields of a snapshot taken while
+ * messages are being sent or received may be slightly out of step with
+ * each other.
+ *
+ * @param[in]  handle A context handle.
+ * @param[out] stats  Receives the statistics.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS     if handle or stats is a null pointer \n
+ *            \b EVRYTHNG_SUCCESS      on success \n
+ */
+evrythng_return_t EvrythngGetStats(evrythng_handle_t handle, evrythng_stats_t* stats);
+
+
+/** @brief Get a percentile of a histogram.
+ *
+ * @param[in] histogram A histogram from evrythng_stats_t.
+ * @param[in] percent   The percentile, from 0 to 100.
+ *
+ * @return    The upper bound in milliseconds of the bucket the percentile 
+ *            falls into, at most the largest value recorded, 0 if the 
+ *            histogram is empty or an argument is invalid.
+ */
+int EvrythngHistogramPercentile(const evrythng_histogram_t* histogram, int percent);
+
+
 /** @brief Publish a single property to a given thing.
  *
  * This function attempts to publish a single property to a given thing.
@@ -272,6 +782,7 @@ evrythng_return_t EvrythngDisconnect(evrythng_handle_t handle);
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -282,6 +793,85 @@ evrythng_return_t EvrythngPubThngProperty(
         const char* property_json);
 
 
+/** @brief Prepare repeated publishing of a single property of the thing.
+ *
+ * The topic is formatted and serialized once, publishing through the
+ * returned handle then only has to send the value. Use this for properties
+ * which are updated frequently. Release the handle with EvrythngReleasePublish().
+ *  
+ * @param[in]  handle        A context handle.
+ * @param[in]  thng_id       A thing ID.
+ * @param[in]  property_name The name of the property. 
+ * @param[out] pub           Receives the prepared publish handle. 
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_SUCCESS on success \n
+ */
+evrythng_return_t EvrythngPreparePublish(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* property_name, 
+        evrythng_pub_handle_t* pub);
+
+
+/** @brief Publish a value through a prepared publish handle.
+ *
+ * Same as the publish function the handle was prepared for, except that the 
+ * length of the JSON string is given by the caller and it doesn't need to be
+ * null terminated.
+ *  
+ * @param[in] pub           A prepared publish handle.
+ * @param[in] property_json A JSON string which contains property value. 
+ * @param[in] length        The length of property_json. 
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or length is 0 \n
+ *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
+ *            \b EVRYTHNG_SUCCESS on success \n
+ */
+evrythng_return_t EvrythngPublishPrepared(
+        evrythng_pub_handle_t pub, 
+        const char* property_json,
+        size_t length);
+
+
+/** @brief Asynchronously publish a value through a prepared publish handle.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPublishPrepared() for details. The value is copied, so 
+ * it can be released right after the call, the same goes for the prepared handle.
+ *  
+ * @param[in] pub           A prepared publish handle.
+ * @param[in] property_json A JSON string which contains property value. 
+ * @param[in] length        The length of property_json. 
+ * @param[in] callback      A pointer to a completion callback, may be a null pointer.
+ * @param[in] token         Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or length is 0 \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPublishPreparedAsync(
+        evrythng_pub_handle_t pub, 
+        const char* property_json,
+        size_t length,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Release a prepared publish handle.
+ *
+ * @param[in] pub A prepared publish handle.
+ */
+void EvrythngReleasePublish(evrythng_pub_handle_t pub);
+
+
 /** @brief Subscribe to a single property of the thing.
  *
  * This function attempts to subscribe to a single property of the thing.
@@ -308,6 +898,29 @@ evrythng_return_t EvrythngSubThngProperty(
         sub_callback *callback);
 
 
+/** @brief Subscribe to a number of topics at once.
+ *
+ * This function subscribes to all the given topics using as few round
+ * trips to the cloud as possible, which is much faster than subscribing
+ * to them one by one. The outcome for each topic is stored in its result field.
+ *  
+ * @param[in] handle A context handle.
+ * @param[in] subs   An array of subscriptions. 
+ * @param[in] count  The number of subscriptions in the array. 
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_SUBSCRIPTION_ERROR if at least one of the subscriptions failed \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
+ *            \b EVRYTHNG_SUCCESS if all subscriptions succeeded \n
+ */
+evrythng_return_t EvrythngSubscribeMany(
+        evrythng_handle_t handle, 
+        evrythng_subscription_t* subs, 
+        int count);
+
+
 /** @brief Unsubscribe a client from a single property of the thing.
  *
  * This function unsubscribes a client from a single property of the thing. 
@@ -385,6 +998,7 @@ evrythng_return_t EvrythngUnsubThngProperties(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -497,6 +1111,7 @@ evrythng_return_t EvrythngUnsubThngActions(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -519,6 +1134,7 @@ evrythng_return_t EvrythngPubThngAction(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -583,6 +1199,7 @@ evrythng_return_t EvrythngUnsubThngLocation(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -696,6 +1313,7 @@ evrythng_return_t EvrythngUnsubProductProperties(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -718,6 +1336,7 @@ evrythng_return_t EvrythngPubProductProperty(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -830,6 +1449,7 @@ evrythng_return_t EvrythngUnsubProductActions(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -852,6 +1472,7 @@ evrythng_return_t EvrythngPubProductAction(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -955,6 +1576,7 @@ evrythng_return_t EvrythngUnsubActions(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -975,6 +1597,7 @@ evrythng_return_t EvrythngPubAction(
  *            \b EVRYTHNG_PUBLISH_ERROR if an error occured trying to publish a message \n
  *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
  *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
  *            \b EVRYTHNG_TIMEOUT timeout waiting for server response \n
  *            \b EVRYTHNG_SUCCESS on success \n
  */
@@ -983,4 +1606,318 @@ evrythng_return_t EvrythngPubActions(
         const char* actions_json);
 
 
+/** @brief Asynchronously publish a single property to a given thing.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubThngProperty() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle        A context handle.
+ * @param[in] thng_id A     A thing ID.
+ * @param[in] property_name The name of the property.
+ * @param[in] property_json A JSON string which contains property value. 
+ * @param[in] callback      A pointer to a completion callback, may be a null pointer.
+ * @param[in] token         Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubThngPropertyAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* property_name, 
+        const char* property_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a few properties to a given thing.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubThngProperties() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle          A context handle.
+ * @param[in] thng_id         A thing ID.
+ * @param[in] properties_json A JSON string which contains properties values. 
+ * @param[in] callback        A pointer to a completion callback, may be a null pointer.
+ * @param[in] token           Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubThngPropertiesAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* properties_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a single action to a given thing.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubThngAction() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle      A context handle.
+ * @param[in] thng_id     A thing ID.
+ * @param[in] action_name The name of an action.
+ * @param[in] action_json A JSON string which contains an action. 
+ * @param[in] callback    A pointer to a completion callback, may be a null pointer.
+ * @param[in] token       Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubThngActionAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* action_name, 
+        const char* action_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a few actions to a given thing.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubThngActions() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle       A context handle.
+ * @param[in] thng_id      A thing ID.
+ * @param[in] actions_json A JSON string which contains actions. 
+ * @param[in] callback     A pointer to a completion callback, may be a null pointer.
+ * @param[in] token        Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubThngActionsAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* actions_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a location to a given thing.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubThngLocation() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle        A context handle.
+ * @param[in] thng_id       A thing ID.
+ * @param[in] location_json A JSON string which contains location. 
+ * @param[in] callback      A pointer to a completion callback, may be a null pointer.
+ * @param[in] token         Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubThngLocationAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* location_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a single property to a given product.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubProductProperty() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle        A context handle.
+ * @param[in] product_id    A product ID.
+ * @param[in] property_name The name of the property.
+ * @param[in] property_json A JSON string which contains property value. 
+ * @param[in] callback      A pointer to a completion callback, may be a null pointer.
+ * @param[in] token         Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubProductPropertyAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* property_name, 
+        const char* property_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a few properties to a given product.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubProductProperties() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle          A context handle.
+ * @param[in] product_id      A product ID.
+ * @param[in] properties_json A JSON string which contains properties values. 
+ * @param[in] callback        A pointer to a completion callback, may be a null pointer.
+ * @param[in] token           Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubProductPropertiesAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* properties_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a single action to a given product.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubProductAction() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle      A context handle.
+ * @param[in] product_id  A product ID.
+ * @param[in] action_name The name of an action.
+ * @param[in] action_json A JSON string which contains an action. 
+ * @param[in] callback    A pointer to a completion callback, may be a null pointer.
+ * @param[in] token       Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubProductActionAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* action_name, 
+        const char* action_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a few actions to a given product.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubProductActions() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle       A context handle.
+ * @param[in] product_id   A product ID.
+ * @param[in] actions_json A JSON string which contains actions. 
+ * @param[in] callback     A pointer to a completion callback, may be a null pointer.
+ * @param[in] token        Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubProductActionsAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* actions_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a single action.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubAction() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle      A context handle.
+ * @param[in] action_name The name of an action.
+ * @param[in] action_json A JSON string which contains an action. 
+ * @param[in] callback    A pointer to a completion callback, may be a null pointer.
+ * @param[in] token       Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubActionAsync(
+        evrythng_handle_t handle, 
+        const char* action_name, 
+        const char* action_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
+/** @brief Asynchronously publish a few actions.
+ *
+ * This function queues the message and returns without waiting for the
+ * cloud acknowledgement, see EvrythngPubActions() for details. Strings are copied, so 
+ * they can be released right after the call. The callback is called in the
+ * context of the internal library thread once the request completes.
+ *
+ * @param[in] handle       A context handle.
+ * @param[in] actions_json A JSON string which contains actions. 
+ * @param[in] callback     A pointer to a completion callback, may be a null pointer.
+ * @param[in] token        Receives the request token, may be a null pointer.
+ *
+ * @return    \b EVRYTHNG_BAD_ARGS if one the arguments is a null pointer or a too long string \n
+ *            \b EVRYTHNG_MEMORY_ERROR if memory allocation error occured \n
+ *            \b EVRYTHNG_NOT_CONNECTED if internal context is not in connected state \n
+ *            \b EVRYTHNG_RATE_LIMITED if the rate limit set with EvrythngSetRateLimit was exceeded \n
+ *            \b EVRYTHNG_QUEUE_FULL if too many requests are pending \n
+ *            \b EVRYTHNG_SUCCESS if the message was queued \n
+ */
+evrythng_return_t EvrythngPubActionsAsync(
+        evrythng_handle_t handle, 
+        const char* actions_json,
+        pub_callback *callback,
+        evrythng_token_t* token);
+
+
 #endif //_EVRYTHNG_H
@@ -11,6 +11,8 @@
 /* all failure return codes must be negative */
 enum returnCode 
 { 
+    MQTT_WOULD_BLOCK = -6,
+    MQTT_INFLIGHT_FULL = -5,
     MQTT_SUBSCRIPTION_FAILED = -4,
     MQTT_CONNECTION_LOST = -3, 
     MQTT_BUFFER_OVERFLOW = -2, 
@@ -18,6 +20,13 @@ enum returnCode
     MQTT_SUCCESS = 0 
 };
 
+/* one buffer of a vectored write */
+typedef struct platform_iovec_t
+{
+    const unsigned char* base;
+    int len;
+} platform_iovec_t;
+
 void platform_timer_init(Timer*);
 void platform_timer_deinit(Timer*);
 char platform_timer_isexpired(Timer*);
@@ -26,21 +35,113 @@ int  platform_timer_left(Timer*);
 
 void platform_network_init(Network*);
 void platform_network_securedinit(Network*, const char* ca_buf, size_t ca_size);
+/* 
+ * A trust store parsed once from ca_size bytes of certificates, shared by
+ * any number of secured networks until it is destroyed. Returns a null
+ * pointer on error or if the platform cannot share one, in which case
+ * platform_network_securedinit() is used with the raw certificates.
+ */
+typedef struct platform_trust_store_t platform_trust_store_t;
+platform_trust_store_t* platform_trust_store_create(const char* ca_buf, size_t ca_size);
+void platform_trust_store_destroy(platform_trust_store_t*);
+/* Like platform_network_securedinit(), verifying the server against a shared trust store */
+void platform_network_securedinit_shared(Network*, platform_trust_store_t*);
+/* 
+ * Returns 0 once connected, PLATFORM_TLS_REJECTED if the TLS handshake
+ * itself failed, e.g. the server refused a resumed session or did not
+ * verify, and another negative value if the server could not be reached.
+ */
+#define PLATFORM_TLS_REJECTED -2
 int  platform_network_connect(Network*, char*, int);
 void platform_network_disconnect(Network*);
 int  platform_network_read(Network*, unsigned char*, int, int);
+/* 
+ * Read whatever the network has, at most len bytes, waiting up to
+ * timeout_ms for the first one. Returns the number of bytes read, 0 if
+ * the connection was closed or failed and a negative value only if 
+ * nothing arrived before the timeout, which the mqtt client takes for
+ * a connection that is still fine.
+ */
+int  platform_network_read_some(Network*, unsigned char*, int len, int timeout_ms);
 int  platform_network_write(Network*, unsigned char*, int, int);
+/* 
+ * TLS session resumption. Copy the session of a secured connection, its
+ * id or ticket together with the secrets needed to resume it, into buf.
+ * Called before the connection is closed. Returns the number of bytes
+ * written, 0 if there is no session or it does not fit into size.
+ */
+int  platform_network_session_save(Network*, unsigned char* buf, int size);
+/* 
+ * Offer a session saved by platform_network_session_save() on the next
+ * platform_network_connect(), falling back to a full handshake if the
+ * server does not accept it. Called after platform_network_securedinit().
+ */
+void platform_network_session_resume(Network*, const unsigned char* buf, int len);
+/* 
+ * Write the buffers in order as a single stream, e.g. with writev() or
+ * sendmsg(). Returns the number of bytes written, which may be less than
+ * the total, or a negative value on error.
+ */
+int  platform_network_writev(Network*, const platform_iovec_t* iov, int iovcnt, int timeout_ms);
+/* 
+ * Block until the network has data to read, the event is set or timeout
+ * expires, whichever comes first. Must also work on a network that is not
+ * connected, waiting for the event only. Returns 1 if data can be read,
+ * 0 otherwise and a negative value on error. A returned wait clears the event.
+ */
+int  platform_network_wait(Network*, Event*, int timeout_ms);
 
 void platform_mutex_init(Mutex*);
 void platform_mutex_deinit(Mutex*);
 int  platform_mutex_lock(Mutex*);
 int  platform_mutex_unlock(Mutex*);
+/* 
+ * A single process wide lock for state shared by all handles, usable
+ * before anything was initialized, e.g. a statically initialized mutex.
+ */
+void platform_global_lock(void);
+void platform_global_unlock(void);
 
 void platform_semaphore_init(Semaphore*);
 void platform_semaphore_deinit(Semaphore*);
 int platform_semaphore_post(Semaphore*);
 int platform_semaphore_wait(Semaphore*, int);
 
+/* 
+ * Auto-reset wakeup flag for platform_network_wait(), setting it
+ * while nobody waits must make the next wait return immediately.
+ */
+void platform_event_init(Event*);
+void platform_event_deinit(Event*);
+void platform_event_set(Event*);
+
+/* 
+ * Descriptors for the event loop of an application in poll mode: the 
+ * socket of a connected network, and one which is readable while the
+ * event is set. Return a negative value if there is none.
+ */
+int  platform_network_fd(Network*);
+int  platform_event_fd(Event*);
+
+/* 
+ * Readiness of many descriptors at once for the loops of an engine, e.g.
+ * with epoll. A descriptor is added together with a pointer, which is 
+ * handed back while it can be read from, was closed or failed.
+ */
+typedef struct platform_poller_t platform_poller_t;
+platform_poller_t* platform_poller_create(void);
+void platform_poller_destroy(platform_poller_t*);
+/* Returns 0 on success */
+int  platform_poller_add(platform_poller_t*, int fd, void* data);
+void platform_poller_remove(platform_poller_t*, int fd);
+/* 
+ * Block until a descriptor is ready, the event is set or timeout expires,
+ * whichever comes first. Stores the pointers of up to max ready 
+ * descriptors in ready and returns their number, 0 if there are none and
+ * a negative value on error. A returned wait clears the event.
+ */
+int  platform_poller_wait(platform_poller_t*, Event*, void** ready, int max, int timeout_ms);
+
 int platform_thread_create(Thread* thread, 
         int priority, 
         const char* name, 
@@ -50,6 +151,16 @@ int platform_thread_create(Thread* thread,
 int platform_thread_join(Thread*, int);
 int platform_thread_destroy(Thread*);
 
+/* 
+ * Map size bytes of persistent storage named path into memory, creating
+ * it if it does not exist. Storage that was never written reads as zeros.
+ * Returns a null pointer on error.
+ */
+void* platform_store_map(const char* path, size_t size);
+/* Write len bytes of a mapping starting at addr to the storage, returns 0 on success */
+int   platform_store_sync(void* addr, size_t len);
+void  platform_store_unmap(void* addr, size_t size);
+
 int platform_printf(const char* fmt, ...);
 
 void* platform_malloc(size_t bytes);
@@ -58,6 +169,9 @@ void  platform_free(void* memory);
 
 void platform_sleep(int ms);
 
+/* Number of processors the application may run on, at least 1 */
+int platform_cpu_count(void);
+
 int platform_rand();
 
 #endif //__MQTT_PLATFORM_
@@ -15,6 +15,13 @@ evrythng_return_t evrythng_subscribe( evrythng_handle_t handle, const char* enti
 evrythng_return_t evrythng_unsubscribe( evrythng_handle_t handle, const char* entity, 
         const char* entity_id, const char* data_type, const char* data_name);
 
+evrythng_return_t evrythng_publish_async( evrythng_handle_t handle, const char* entity, 
+        const char* entity_id, const char* data_type, const char* data_name, const char* property_json,
+        pub_callback *callback, evrythng_token_t* token);
+
+evrythng_return_t evrythng_prepare_publish( evrythng_handle_t handle, const char* entity, 
+        const char* entity_id, const char* data_type, const char* data_name, evrythng_pub_handle_t* pub);
+
 evrythng_return_t EvrythngPubThngProperty(
         evrythng_handle_t handle, 
         const char* thng_id, 
@@ -53,6 +60,19 @@ evrythng_return_t EvrythngUnsubThngProperty(
 }
 
 
+evrythng_return_t EvrythngPreparePublish(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* property_name, 
+        evrythng_pub_handle_t* pub)
+{
+    if (!thng_id || !property_name)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_prepare_publish(handle, "thngs", thng_id, "properties", property_name, pub);
+}
+
+
 evrythng_return_t EvrythngSubThngProperties(
         evrythng_handle_t handle, 
         const char* thng_id, 
@@ -411,3 +431,160 @@ evrythng_return_t EvrythngPubActions(
     return evrythng_publish(handle, "actions", NULL, NULL, "all", actions_json);
 }
 
+
+
+evrythng_return_t EvrythngPubThngPropertyAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* property_name, 
+        const char* property_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!thng_id || !property_name || !property_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "thngs", thng_id, "properties", property_name, property_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubThngPropertiesAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* properties_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!thng_id || !properties_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "thngs", thng_id, "properties", NULL, properties_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubThngActionAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* action_name, 
+        const char* action_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!thng_id || !action_name || !action_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "thngs", thng_id, "actions", action_name, action_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubThngActionsAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* actions_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!thng_id || !actions_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "thngs", thng_id, "actions", "all", actions_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubThngLocationAsync(
+        evrythng_handle_t handle, 
+        const char* thng_id, 
+        const char* location_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!thng_id || !location_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "thngs", thng_id, "location", NULL, location_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubProductPropertyAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* property_name, 
+        const char* property_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!product_id || !property_name || !property_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "products", product_id, "properties", property_name, property_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubProductPropertiesAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* properties_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!product_id || !properties_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "products", product_id, "properties", NULL, properties_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubProductActionAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* action_name, 
+        const char* action_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!product_id || !action_name || !action_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "products", product_id, "actions", action_name, action_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubProductActionsAsync(
+        evrythng_handle_t handle, 
+        const char* product_id, 
+        const char* actions_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!product_id || !actions_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "products", product_id, "actions", "all", actions_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubActionAsync(
+        evrythng_handle_t handle, 
+        const char* action_name, 
+        const char* action_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!action_name || !action_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "actions", NULL, NULL, action_name, action_json, callback, token);
+}
+
+
+evrythng_return_t EvrythngPubActionsAsync(
+        evrythng_handle_t handle, 
+        const char* actions_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
+{
+    if (!actions_json)
+        return EVRYTHNG_BAD_ARGS;
+
+    return evrythng_publish_async(handle, "actions", NULL, NULL, "all", actions_json, callback, token);
+}
@@ -11,34 +11,157 @@
 #include "evrythng/evrythng.h"
 #include "evrythng/platform.h"
 #include "evrythng_tls_certificate.h"
+#include "evrythng_store.h"
+#include "evrythng_dispatch.h"
+#include "evrythng_stats.h"
+#include "evrythng_log.h"
+#include "evrythng_engine.h"
 
 #define TOPIC_MAX_LEN 128
 #define USERNAME "authorization"
+#define OP_QUEUE_SIZE 16
+#define DEFAULT_INFLIGHT_WINDOW 8
+#define STORE_SYNC_INTERVAL_MS 1000
+#define AGG_MAX_JSON 4096
+#define RATE_CLASSES 4
+#define MAX_CALLBACK_WORKERS 16
+/* longest time mqtt_thread holds back small outbound packets while it is busy */
+#define CORK_MS 5
+/* enough for a session ticket and its secrets, and the server certificate some TLS stacks keep with them */
+#define TLS_SESSION_MAX_LEN 4096
+/* restart value of the timers measuring how long a callback takes */
+#define STATS_CLOCK_MS 0x3FFFFFFF
+/* queued actions go ahead of other ops, see op_queue_pop */
+#define OP_LANE_HIGH 0
+#define OP_LANE_LOW 1
+#define OP_LANES 2
+/* high lane ops taken in a row before a waiting low lane op gets its turn */
+#define OP_FAIR_RUN 4
+/* restart value of the timers measuring time between refills */
+#define RATE_CLOCK_MS 0x3FFFFFFF
+/* connection attempts with growing pauses before a pause of a second */
+#define CONNECT_ATTEMPTS 7
+/* loop threads of an engine, which run callbacks like mqtt_thread does */
+#define MAX_ENGINE_THREADS 256
+#define ENGINE_STACKSIZE 8192
 
 static void mqtt_thread(void* arg);
 static void message_callback(MessageData* data, void* userdata);
-static evrythng_return_t evrythng_connect_internal(evrythng_handle_t handle);
+static void publish_callback(void* context, int rc, void* userdata);
+static void request_callback(void* context, int rc, void* userdata);
+static evrythng_return_t evrythng_connect_internal(evrythng_handle_t handle, int attempts);
 static evrythng_return_t evrythng_disconnect_internal(evrythng_handle_t handle, int gracefull);
+static evrythng_return_t rm_sub_callback(evrythng_handle_t handle, const char* topic, char* deleted_topic);
+static int rate_class(const char* topic);
+static void mqtt_shutdown(evrythng_handle_t handle);
 
 typedef struct sub_callback_t {
-    char*                   topic;
+    char*                   topic;      /* as subscribed, may end with a ?pubStates= query */
     int                     qos;
     sub_callback*           callback;
     struct sub_callback_t*  next;
+    struct sub_callback_t** pprev;
+    struct sub_node_t*      node;
 } sub_callback_t;
 
 
-enum { MQTT_NOP, MQTT_CONNECT, MQTT_DISCONNECT, MQTT_PUBLISH, MQTT_SUBSCRIBE, MQTT_UNSUBSCRIBE };
+/* 
+ * Subscriptions are indexed by a trie with one node per topic level.
+ * The children of all nodes live in a single hash table keyed by
+ * (parent node, level name), so finding the next level costs the same
+ * with ten or ten thousand siblings. Wildcard children are also linked
+ * directly from the parent for dispatch.
+ */
+typedef struct sub_node_t {
+    struct sub_node_t*  parent;
+    struct sub_node_t*  hash_next;
+    struct sub_node_t*  single;     /* '+' child */
+    struct sub_node_t*  multi;      /* '#' child */
+    sub_callback_t*     sub;
+    int                 children;
+    unsigned int        hash;
+    int                 len;
+    char                name[1];
+} sub_node_t;
+
+#define SUB_HASH_INITIAL_SIZE 16
+
+
+enum { MQTT_NOP, MQTT_CONNECT, MQTT_DISCONNECT, MQTT_PUBLISH, MQTT_SUBSCRIBE, MQTT_UNSUBSCRIBE, MQTT_SUBSCRIBE_MANY };
+enum { MQTT_OP_QUEUED, MQTT_OP_RUNNING, MQTT_OP_SENT, MQTT_OP_DONE };
 typedef struct mqtt_op 
 {
     int op;
+    int state;
     const char* topic;
     MQTTMessage* message;
     sub_callback* callback;
     evrythng_return_t result;
+    Semaphore done_sem;
+    Timer timer;
+    int timeout;
+    int async;
+    pub_callback* pub_callback;
+    evrythng_token_t token;
+    struct mqtt_op* next;
+    const unsigned char* encoded_topic; /* MQTT string form of topic, optional */
+    evrythng_subscription_t* subs;
+    int count;
+    int stored;                 /* published from the offline store */
+    unsigned int store_next;    /* offset of the record after it */
+    int lane;                   /* OP_LANE_HIGH or OP_LANE_LOW */
+    int poll_wait;              /* poll mode, the caller waits for done_event along with the network */
+    Event done_event;
+    int abandoned;              /* its caller gave up waiting, whoever completes it frees it */
 } mqtt_op;
 
 
+/* 
+ * Bounded multi-producer/single-consumer queue of pending operations.
+ * Any application thread can enqueue, only mqtt_thread dequeues.
+ * The mutex only guards the ring indexes, it is never held while
+ * an operation is being executed. A handle has one queue per lane.
+ */
+typedef struct mqtt_op_queue
+{
+    mqtt_op*    ops[OP_QUEUE_SIZE];
+    int         head;
+    int         count;
+} mqtt_op_queue;
+
+
+/* single property updates of one thng or product waiting to be sent together */
+typedef struct agg_batch_t {
+    struct agg_batch_t* next;
+    char    topic[TOPIC_MAX_LEN];   /* <entity>/<id>/properties */
+    char*   json;                   /* '[' followed by the objects collected so far */
+    int     len;
+    int     count;
+    Timer   timer;                  /* expires when the batch is due */
+} agg_batch_t;
+
+
+/* 
+ * Token bucket, credit is counted in thousandths of a message so that
+ * every elapsed millisecond adds rate of them.
+ */
+typedef struct rate_bucket_t {
+    int     rate;       /* messages per second, 0 for no limit */
+    int     burst;
+    int     credit;
+    Timer   clock;      /* counts down from RATE_CLOCK_MS since the last refill */
+} rate_bucket_t;
+
+
+/* publish topic serialized once by EvrythngPreparePublish */
+struct evrythng_pub_ctx_t {
+    evrythng_handle_t   handle;
+    int                 coalesce;
+    int                 rate_class;
+    unsigned char       encoded_topic[2 + TOPIC_MAX_LEN];
+};
+
+
 struct evrythng_ctx_t {
     char*   host;
     int     port;
@@ -47,7 +170,11 @@ struct evrythng_ctx_t {
     const char* ca_buf;
     size_t  ca_size;
     int     secure_connection;
+    platform_trust_store_t* trust_store;
+    unsigned char* tls_session;     /* saved when a secured connection closes, offered on reconnect */
+    int     tls_session_len;
     int     qos;
+    int     coalesce;
     int     initialized;
     int     command_timeout_ms;
 
@@ -55,11 +182,40 @@ struct evrythng_ctx_t {
     int     mqtt_thread_stop;
     int     mqtt_thread_priority;
     int     mqtt_thread_stacksize;
+    int     mqtt_rc;    /* last result of the mqtt client, MQTT_CONNECTION_LOST starts a reconnect */
+    int     reconnecting;
+    int     reconnect_attempt;
+    Timer   reconnect_timer;    /* the next reconnect attempt is due */
+
+    /* without mqtt_thread the application drives the engine, see EvrythngSetPollMode */
+    int     poll_mode;
+    Mutex   poll_mtx;   /* held by whoever drives the engine */
+
+    /* a loop thread of a shared engine drives the handle, see EvrythngSetEngine */
+    evrythng_engine_handle_t engine;
+    engine_source_t* engine_source;
+    int     offloaded;      /* a connect worker runs a step of the handle, see offload */
+    mqtt_op* offload_op;    /* the op of that step, null for a reconnect attempt */
+    unsigned int connection_id;     /* counts connects, tells a new socket from an old one */
+
+    /* runs subscription callbacks off mqtt_thread, see EvrythngSetCallbackWorkers */
+    evrythng_dispatch_t* dispatch;
+    int     callback_workers;
+
+    /* statistics only written by mqtt_thread, the mqtt client keeps the rest */
+    unsigned int            reconnects;
+    unsigned int            expired;
+    unsigned int            dropped;
+    evrythng_histogram_t    publish_latency;
+    evrythng_histogram_t    callback_duration;
+    Timer                   callback_timer;
 
     unsigned char serialize_buffer[1024];
     unsigned char read_buffer[1024];
 
     evrythng_log_callback log_callback;
+    evrythng_log_level_t log_level;
+    evrythng_log_ring_t* log_ring;
 
     evrythng_callback on_connection_lost;
     evrythng_callback on_connection_restored;
@@ -67,14 +223,56 @@ struct evrythng_ctx_t {
     Network     mqtt_network;
     MQTTClient  mqtt_client;
     MQTTPacket_connectData  mqtt_conn_opts;
+    int         session_stale;  /* the subscriptions kept by the broker may be incomplete */
 
     sub_callback_t *sub_callbacks;
-
-    mqtt_op     next_op;
-    Mutex       async_op_mtx;
-    Mutex       next_op_mtx;
-    Semaphore   next_op_ready_sem;
-    Semaphore   next_op_result_sem;
+    sub_callback_t **sub_callbacks_tail;
+    sub_node_t      sub_root;
+    sub_node_t**    sub_hash;
+    unsigned int    sub_hash_size;
+    unsigned int    sub_hash_count;
+    int             sub_count;
+
+    mqtt_op_queue op_queue[OP_LANES];
+    int         op_high_run;    /* high lane ops taken since the last low lane one */
+    evrythng_token_t next_token;
+    Mutex       op_queue_mtx;
+    Semaphore   op_slot_sem;
+    Event       op_ready_event;
+
+    /* publishes acknowledged while the mqtt client was locked, completed by mqtt_thread */
+    mqtt_op*    done_ops;
+    mqtt_op**   done_ops_tail;
+
+    /* queued publishes replaced by later ones, guarded by op_queue_mtx */
+    mqtt_op*    superseded_ops;
+    mqtt_op**   superseded_ops_tail;
+
+    /* 
+     * Offline store. Records sent from it are tracked in send order so
+     * that they are released in order, whatever order acks come in.
+     */
+    evrythng_store_t* store;
+    unsigned int    store_read;
+    mqtt_op         store_ops[MAX_INFLIGHT_MESSAGES];
+    int             store_ops_first;
+    int             store_ops_count;
+    int             store_rewind;
+    int             store_rate;
+    int             store_budget;
+    Timer           store_rate_timer;
+    Timer           store_sync_timer;
+
+    /* property update aggregation, see EvrythngSetAggregation */
+    agg_batch_t*    agg_batches;
+    int             agg_window_ms;
+    int             agg_max_count;
+    Mutex           agg_mtx;
+
+    /* indexed by evrythng_rate_class_t */
+    rate_bucket_t   rate_buckets[RATE_CLASSES];
+    int             rate_max_wait_ms;
+    Mutex           rate_mtx;
 };
 
 
@@ -82,13 +280,70 @@ static void evrythng_log(evrythng_handle_t handle, evrythng_log_level_t level, c
 {
     va_list vl;
     va_start(vl, fmt);
-    if (handle && handle->log_callback)
+    if (handle->log_ring)
+        log_ring_put(handle->log_ring, handle->log_callback, level, fmt, vl);
+    else
         handle->log_callback(level, fmt, vl);
     va_end(vl);
 }
-#define debug(fmt, ...) evrythng_log(handle, EVRYTHNG_LOG_DEBUG, fmt,  ##__VA_ARGS__);
-#define warning(fmt, ...) evrythng_log(handle, EVRYTHNG_LOG_WARNING, fmt,  ##__VA_ARGS__);
-#define error(fmt, ...) evrythng_log(handle, EVRYTHNG_LOG_ERROR, fmt,  ##__VA_ARGS__);
+
+/* the level is checked before the arguments are evaluated */
+#define evrythng_log_at(level, fmt, ...) \
+    do { \
+        if (handle && handle->log_callback && (level) <= handle->log_level) \
+            evrythng_log(handle, level, fmt, ##__VA_ARGS__); \
+    } while (0)
+
+#if EVRYTHNG_LOG_LEVEL >= 2
+#define debug(fmt, ...) evrythng_log_at(EVRYTHNG_LOG_DEBUG, fmt,  ##__VA_ARGS__);
+#else
+#define debug(fmt, ...) do {} while (0);
+#endif
+#if EVRYTHNG_LOG_LEVEL >= 1
+#define warning(fmt, ...) evrythng_log_at(EVRYTHNG_LOG_WARNING, fmt,  ##__VA_ARGS__);
+#else
+#define warning(fmt, ...) do {} while (0);
+#endif
+#if EVRYTHNG_LOG_LEVEL >= 0
+#define error(fmt, ...) evrythng_log_at(EVRYTHNG_LOG_ERROR, fmt,  ##__VA_ARGS__);
+#else
+#define error(fmt, ...) do {} while (0);
+#endif
+
+
+/*
+ * Trust store parsed from cert_buffer by the first secured handle and
+ * shared by all of them, its reference count is guarded by the
+ * platform's global lock.
+ */
+static platform_trust_store_t* shared_trust_store;
+static int shared_trust_store_refs;
+
+static platform_trust_store_t* trust_store_acquire(void)
+{
+    platform_trust_store_t* store;
+
+    platform_global_lock();
+    if (!shared_trust_store)
+        shared_trust_store = platform_trust_store_create(cert_buffer, sizeof(cert_buffer));
+    if (shared_trust_store)
+        shared_trust_store_refs++;
+    store = shared_trust_store;
+    platform_global_unlock();
+
+    return store;
+}
+
+static void trust_store_release(void)
+{
+    platform_global_lock();
+    if (!--shared_trust_store_refs)
+    {
+        platform_trust_store_destroy(shared_trust_store);
+        shared_trust_store = 0;
+    }
+    platform_global_unlock();
+}
 
 
 evrythng_return_t EvrythngInitHandle(evrythng_handle_t* handle)
@@ -110,6 +365,7 @@ evrythng_return_t EvrythngInitHandle(evrythng_handle_t* handle)
     (*handle)->mqtt_conn_opts.willFlag = 0;
     (*handle)->mqtt_conn_opts.username.cstring = USERNAME;
     (*handle)->qos = 1;
+    (*handle)->log_level = EVRYTHNG_LOG_DEBUG;
 
     (*handle)->ca_buf = cert_buffer;
     (*handle)->ca_size = sizeof(cert_buffer);
@@ -127,52 +383,128 @@ evrythng_return_t EvrythngInitHandle(evrythng_handle_t* handle)
 
     (*handle)->mqtt_client.messageHandler = message_callback;
     (*handle)->mqtt_client.messageHandlerData = (void*)(*handle);
-
-    platform_mutex_init(&(*handle)->next_op_mtx);
-    platform_mutex_init(&(*handle)->async_op_mtx);
-    platform_semaphore_init(&(*handle)->next_op_ready_sem);
-    platform_semaphore_init(&(*handle)->next_op_result_sem);
+    (*handle)->mqtt_client.publishHandler = publish_callback;
+    (*handle)->mqtt_client.publishHandlerData = (void*)(*handle);
+    (*handle)->mqtt_client.requestHandler = request_callback;
+    (*handle)->mqtt_client.requestHandlerData = (void*)(*handle);
+    MQTTSetInflightWindow(&(*handle)->mqtt_client, DEFAULT_INFLIGHT_WINDOW);
+    MQTTSetCorking(&(*handle)->mqtt_client, CORK_MS);
+    (*handle)->done_ops_tail = &(*handle)->done_ops;
+    (*handle)->superseded_ops_tail = &(*handle)->superseded_ops;
+    (*handle)->sub_callbacks_tail = &(*handle)->sub_callbacks;
+
+    platform_mutex_init(&(*handle)->op_queue_mtx);
+    platform_semaphore_init(&(*handle)->op_slot_sem);
+    platform_event_init(&(*handle)->op_ready_event);
+    platform_mutex_init(&(*handle)->agg_mtx);
+    platform_mutex_init(&(*handle)->rate_mtx);
+    for (int i = 0; i < RATE_CLASSES; i++)
+        platform_timer_init(&(*handle)->rate_buckets[i].clock);
+    platform_timer_init(&(*handle)->callback_timer);
+    platform_mutex_init(&(*handle)->poll_mtx);
+    platform_timer_init(&(*handle)->reconnect_timer);
 
     return EVRYTHNG_SUCCESS;
 }
 
 
+static void agg_flush(evrythng_handle_t handle, int all);
+
 void EvrythngDestroyHandle(evrythng_handle_t handle)
 {
     if (!handle) return;
+
+    /* into the queue while still connected, otherwise into the offline store if there is one */
+    agg_flush(handle, 1);
     if (handle->initialized && MQTTisConnected(&handle->mqtt_client)) EvrythngDisconnect(handle);
 
-    if (handle->initialized)
+    /* from now on the engine leaves the handle alone */
+    if (handle->engine_source)
+        engine_remove(handle->engine_source);
+
+    if (handle->initialized && handle->poll_mode)
+    {
+        platform_mutex_lock(&handle->poll_mtx);
+        mqtt_shutdown(handle);
+        platform_mutex_unlock(&handle->poll_mtx);
+    }
+    else if (handle->initialized)
     {
         handle->mqtt_thread_stop = 1;
+        platform_event_set(&handle->op_ready_event);
         platform_thread_join(&handle->mqtt_thread, 0x00FFFFFF);
         platform_thread_destroy(&handle->mqtt_thread);
     }
 
+    if (handle->dispatch)
+        dispatch_stop(handle->dispatch);
+
+    if (handle->log_ring)
+        log_ring_stop(handle->log_ring);
+
     if (handle->host) platform_free(handle->host);
     if (handle->key) platform_free(handle->key);
     if (handle->client_id) platform_free(handle->client_id);
-
-    sub_callback_t **_sub_callback = &handle->sub_callbacks;
-    while (*_sub_callback) 
+    if (handle->trust_store)
+        trust_store_release();
+    if (handle->tls_session)
     {
-        sub_callback_t* _sub_callback_tmp = *_sub_callback;
-        _sub_callback = &(*_sub_callback)->next;
-        platform_free(_sub_callback_tmp->topic);
-        platform_free(_sub_callback_tmp);
+        /* holds the master secret of the last connection */
+        memset(handle->tls_session, 0, TLS_SESSION_MAX_LEN);
+        platform_free(handle->tls_session);
     }
 
+    while (handle->sub_callbacks) 
+        rm_sub_callback(handle, handle->sub_callbacks->topic, 0);
+    if (handle->sub_hash) platform_free(handle->sub_hash);
+
     MQTTClientDeinit(&handle->mqtt_client);
 
-    platform_mutex_deinit(&handle->next_op_mtx);
-    platform_mutex_deinit(&handle->async_op_mtx);
-    platform_semaphore_deinit(&handle->next_op_ready_sem);
-    platform_semaphore_deinit(&handle->next_op_result_sem);
+    platform_mutex_deinit(&handle->op_queue_mtx);
+    platform_semaphore_deinit(&handle->op_slot_sem);
+    platform_event_deinit(&handle->op_ready_event);
+    platform_mutex_deinit(&handle->agg_mtx);
+    platform_mutex_deinit(&handle->rate_mtx);
+    for (int i = 0; i < RATE_CLASSES; i++)
+        platform_timer_deinit(&handle->rate_buckets[i].clock);
+    platform_timer_deinit(&handle->callback_timer);
+    platform_mutex_deinit(&handle->poll_mtx);
+    platform_timer_deinit(&handle->reconnect_timer);
+
+    if (handle->store)
+    {
+        store_close(handle->store);
+        platform_timer_deinit(&handle->store_rate_timer);
+        platform_timer_deinit(&handle->store_sync_timer);
+    }
 
     platform_free(handle);
 }
 
 
+evrythng_return_t EvrythngInitEngine(evrythng_engine_handle_t* engine, int threads)
+{
+    if (!engine || threads < 0 || threads > MAX_ENGINE_THREADS)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (!threads)
+        threads = platform_cpu_count();
+
+    if (engine_start(engine, threads, 0, ENGINE_STACKSIZE))
+        return EVRYTHNG_MEMORY_ERROR;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngDestroyEngine(evrythng_engine_handle_t engine)
+{
+    if (!engine) return;
+
+    engine_stop(engine);
+}
+
+
 static int replace_str(char** dest, const char* src, size_t size)
 {
     if (*dest) 
@@ -247,6 +579,22 @@ evrythng_return_t EvrythngSetClientId(evrythng_handle_t handle, const char* clie
 }
 
 
+evrythng_return_t EvrythngSetPersistentSession(evrythng_handle_t handle, int enable)
+{
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (handle->initialized)
+        return EVRYTHNG_FAILURE;
+
+    /* only MQTT 3.1.1 tells whether the broker still has the session */
+    handle->mqtt_conn_opts.cleansession = !enable;
+    handle->mqtt_conn_opts.MQTTVersion = enable ? 4 : 3;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
 evrythng_return_t EvrythngSetLogCallback(evrythng_handle_t handle, evrythng_log_callback callback)
 {
     if (!handle)
@@ -258,6 +606,33 @@ evrythng_return_t EvrythngSetLogCallback(evrythng_handle_t handle, evrythng_log_
 }
 
 
+evrythng_return_t EvrythngSetLogLevel(evrythng_handle_t handle, evrythng_log_level_t level)
+{
+    if (!handle || level < EVRYTHNG_LOG_ERROR || level > EVRYTHNG_LOG_DEBUG)
+        return EVRYTHNG_BAD_ARGS;
+
+    handle->log_level = level;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+evrythng_return_t EvrythngSetLogQueue(evrythng_handle_t handle, int lines)
+{
+    if (!handle || lines < 1)
+        return EVRYTHNG_BAD_ARGS;
+
+    /* other threads may be logging once connected */
+    if (handle->initialized || handle->log_ring)
+        return EVRYTHNG_FAILURE;
+
+    if (log_ring_start(&handle->log_ring, lines, handle->mqtt_thread_priority, handle->mqtt_thread_stacksize))
+        return EVRYTHNG_MEMORY_ERROR;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
 evrythng_return_t EvrythngSetConnectionCallbacks(evrythng_handle_t handle, evrythng_callback on_connection_lost,  evrythng_callback on_connection_restored)
 {
     if (!handle) return EVRYTHNG_BAD_ARGS;
@@ -280,300 +655,1579 @@ evrythng_return_t EvrythngSetQos(evrythng_handle_t handle, int qos)
 }
 
 
-evrythng_return_t EvrythngSetThreadPriority(evrythng_handle_t handle, int priority)
+evrythng_return_t EvrythngSetInflightWindow(evrythng_handle_t handle, int window)
 {
-    if (!handle || priority < 0)
+    if (!handle || window < 1 || window > MAX_INFLIGHT_MESSAGES)
         return EVRYTHNG_BAD_ARGS;
 
-    handle->mqtt_thread_priority = priority;
+    MQTTSetInflightWindow(&handle->mqtt_client, window);
 
     return EVRYTHNG_SUCCESS;
 }
 
 
-evrythng_return_t EvrythngSetThreadStacksize(evrythng_handle_t handle, int stacksize)
+evrythng_return_t EvrythngSetOfflineStore(evrythng_handle_t handle, const char* path, size_t size)
 {
-    if (!handle || stacksize < 1024)
+    if (!handle || !path)
         return EVRYTHNG_BAD_ARGS;
 
-    handle->mqtt_thread_stacksize = stacksize;
+    /* mqtt_thread reads the store without locking */
+    if (handle->initialized || handle->store)
+        return EVRYTHNG_FAILURE;
+
+    if (size < 1024)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (store_open(&handle->store, path, size))
+    {
+        error("could not open offline store %s", path);
+        return EVRYTHNG_FAILURE;
+    }
+
+    platform_timer_init(&handle->store_rate_timer);
+    platform_timer_init(&handle->store_sync_timer);
+
+    int count = store_count(handle->store);
+    if (count)
+    {
+        debug("%d messages left in offline store", count);
+    }
 
     return EVRYTHNG_SUCCESS;
 }
 
 
-static evrythng_return_t add_sub_callback(evrythng_handle_t handle, const char* topic, int qos, sub_callback *callback)
+evrythng_return_t EvrythngSetOfflineDrainRate(evrythng_handle_t handle, int msgs_per_sec)
 {
-    evrythng_return_t ret = EVRYTHNG_SUCCESS;
-
-    char* qp_start = strstr(topic, "?pubStates=");
-    int topic_len = 
-        qp_start == NULL ? strlen(topic) : qp_start - topic;
+    if (!handle || msgs_per_sec < 0)
+        return EVRYTHNG_BAD_ARGS;
 
-    sub_callback_t **_sub_callbacks = &handle->sub_callbacks;
-    while (*_sub_callbacks) 
-    {
-        qp_start = strstr((*_sub_callbacks)->topic, "?pubStates=");
-        int saved_topic_len = 
-            qp_start == NULL ? strlen((*_sub_callbacks)->topic) : qp_start - (*_sub_callbacks)->topic;
+    handle->store_rate = msgs_per_sec;
 
-        if ((topic_len == saved_topic_len) && 
-                (strncmp((*_sub_callbacks)->topic, topic, saved_topic_len)) == 0) 
-        {
-            debug("callback for %s already exists", topic);
-            ret = EVRYTHNG_ALREADY_SUBSCRIBED;
-            goto out;
-        }
-        _sub_callbacks = &(*_sub_callbacks)->next;
-    }
+    return EVRYTHNG_SUCCESS;
+}
 
-    if ((*_sub_callbacks = (sub_callback_t*)platform_malloc(sizeof(sub_callback_t))) == NULL) 
-    {
-        ret = EVRYTHNG_MEMORY_ERROR;
-        goto out;
-    }
 
-    if (((*_sub_callbacks)->topic = (char*)platform_malloc(strlen(topic) + 1)) == NULL) 
-    {
-        platform_free(*_sub_callbacks);
-        ret = EVRYTHNG_MEMORY_ERROR;
-        goto out;
-    }
+evrythng_return_t EvrythngSetCoalescing(evrythng_handle_t handle, int enable)
+{
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
 
-    strcpy((*_sub_callbacks)->topic, topic);
-    (*_sub_callbacks)->qos = qos;
-    (*_sub_callbacks)->callback = callback;
-    (*_sub_callbacks)->next = 0;
+    handle->coalesce = enable != 0;
 
-out:
-    return ret;
+    return EVRYTHNG_SUCCESS;
 }
 
 
-static evrythng_return_t rm_sub_callback(evrythng_handle_t handle, const char* topic, char* deleted_topic)
+evrythng_return_t EvrythngSetAggregation(evrythng_handle_t handle, int window_ms, int max_count)
 {
-    evrythng_return_t ret = EVRYTHNG_NOT_SUBSCRIBED;
+    if (!handle || window_ms < 0 || max_count < 0)
+        return EVRYTHNG_BAD_ARGS;
 
-    sub_callback_t *currP, *prevP = NULL;
+    platform_mutex_lock(&handle->agg_mtx);
+    handle->agg_window_ms = window_ms;
+    handle->agg_max_count = max_count;
+    platform_mutex_unlock(&handle->agg_mtx);
 
-    for (currP = handle->sub_callbacks; currP != NULL; prevP = currP, currP = currP->next) 
-    {
-        int len;
-        char* qp = strstr(currP->topic, "?pubStates=");
-        if (qp)
-            len = qp - currP->topic;
-        else
-            len = strlen(currP->topic);
+    if (!window_ms)
+        agg_flush(handle, 1);
 
-        if (strncmp(currP->topic, topic, len) == 0) 
-        {
-            if (prevP == NULL) 
-            {
-                /* Fix beginning pointer. */
-                handle->sub_callbacks = currP->next;
-            } 
-            else 
-            {
-                /*
-                 * Fix previous node's next to
-                 * skip over the removed node.
-                 */
-                prevP->next = currP->next;
-            }
+    return EVRYTHNG_SUCCESS;
+}
 
-            if (deleted_topic)
-                strcpy(deleted_topic, currP->topic);
-            
-            /* Deallocate the node. */
-            platform_free(currP->topic);
-            platform_free(currP);
 
-            /* Done searching. */
-            ret = EVRYTHNG_SUCCESS;
-            break;
-        }
-    }
+evrythng_return_t EvrythngSetRateLimit(evrythng_handle_t handle, evrythng_rate_class_t rate_class, int msgs_per_sec, int burst)
+{
+    if (!handle || rate_class < 0 || rate_class >= RATE_CLASSES || msgs_per_sec < 0 || burst < 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    rate_bucket_t* b = &handle->rate_buckets[rate_class];
+
+    platform_mutex_lock(&handle->rate_mtx);
+    b->rate = msgs_per_sec;
+    b->burst = burst ? burst : msgs_per_sec;
+    /* start full */
+    b->credit = b->burst * 1000;
+    platform_timer_countdown(&b->clock, RATE_CLOCK_MS);
+    platform_mutex_unlock(&handle->rate_mtx);
 
-    return ret;
+    return EVRYTHNG_SUCCESS;
 }
 
 
-static sub_callback* get_sub_callback(evrythng_handle_t handle, MQTTString* topic)
+evrythng_return_t EvrythngSetRateLimitWait(evrythng_handle_t handle, int max_wait_ms)
 {
-    sub_callback* cb = 0;
+    if (!handle || max_wait_ms < 0)
+        return EVRYTHNG_BAD_ARGS;
 
-    sub_callback_t *_sub_callback = handle->sub_callbacks;
-    while (_sub_callback) 
-    {
-        if (MQTTPacket_equals(topic, _sub_callback->topic) || MQTTisTopicMatched(_sub_callback->topic, topic))
-        {
-            cb = _sub_callback->callback;
-            break;
-        }
-        _sub_callback = _sub_callback->next;
-    }
+    handle->rate_max_wait_ms = max_wait_ms;
 
-    return cb;
+    return EVRYTHNG_SUCCESS;
 }
 
 
-void message_callback(MessageData* data, void* userdata)
+evrythng_return_t EvrythngSetThreadPriority(evrythng_handle_t handle, int priority)
 {
-    evrythng_handle_t handle = (evrythng_handle_t)userdata;
-
-    //debug("received msg topic: %s", data->topicName->lenstring.data);
-    //debug("received msg, length %d, payload: %s", data->message->payloadlen, (char*)data->message->payload);
+    if (!handle || priority < 0)
+        return EVRYTHNG_BAD_ARGS;
 
-    if (data->message->payloadlen < 3) 
-    {
-        error("incorrect message lenth %d", data->message->payloadlen);
-        return;
-    }
+    handle->mqtt_thread_priority = priority;
 
-    sub_callback* cb = get_sub_callback(handle, data->topicName);
-    if (cb)
-    {
-        (*cb)(data->message->payload, data->message->payloadlen);
-    }
+    return EVRYTHNG_SUCCESS;
 }
 
 
-static evrythng_return_t evrythng_async_op(evrythng_handle_t handle, int op, const char* topic, MQTTMessage* message, sub_callback *callback)
+evrythng_return_t EvrythngSetThreadStacksize(evrythng_handle_t handle, int stacksize)
 {
-    evrythng_return_t rc = EVRYTHNG_FAILURE;
-
-    if (!handle)
+    if (!handle || stacksize < 1024)
         return EVRYTHNG_BAD_ARGS;
 
-    platform_mutex_lock(&handle->async_op_mtx);
+    handle->mqtt_thread_stacksize = stacksize;
 
-    platform_mutex_lock(&handle->next_op_mtx);
+    return EVRYTHNG_SUCCESS;
+}
 
-    handle->next_op.op = op;
-    handle->next_op.topic = topic;
-    handle->next_op.message = message;
-    handle->next_op.callback = callback;
 
-    platform_mutex_unlock(&handle->next_op_mtx);
+evrythng_return_t EvrythngSetCallbackWorkers(evrythng_handle_t handle, int workers)
+{
+    if (!handle || workers < 0 || workers > MAX_CALLBACK_WORKERS)
+        return EVRYTHNG_BAD_ARGS;
 
-    platform_semaphore_post(&handle->next_op_ready_sem);
+    /* workers are started together with mqtt_thread */
+    if (handle->initialized)
+        return EVRYTHNG_FAILURE;
 
-    int timeout = handle->command_timeout_ms * 2;
-    if (op == MQTT_CONNECT)
-        timeout = handle->command_timeout_ms * 6;
+    handle->callback_workers = workers;
 
-    if (platform_semaphore_wait(&handle->next_op_result_sem, timeout))
-    {
-        platform_mutex_lock(&handle->next_op_mtx);
-        handle->next_op.op = MQTT_NOP;
-        platform_semaphore_wait(&handle->next_op_result_sem, 0);
-        platform_semaphore_wait(&handle->next_op_ready_sem, 0);
-        platform_mutex_unlock(&handle->next_op_mtx);
-        rc = EVRYTHNG_TIMEOUT;
-    }
-    else
-    {
-        rc = handle->next_op.result;
-    }
+    return EVRYTHNG_SUCCESS;
+}
 
-    platform_mutex_unlock(&handle->async_op_mtx);
 
-    return rc;
+evrythng_return_t EvrythngSetPollMode(evrythng_handle_t handle, int enable)
+{
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    /* decides whether EvrythngConnect starts mqtt_thread */
+    if (handle->initialized)
+        return EVRYTHNG_FAILURE;
+
+    handle->poll_mode = enable ? 1 : 0;
+    handle->engine = 0;
+
+    return EVRYTHNG_SUCCESS;
 }
 
-#define MQTT_CLIENTID_LEN 23
-static const char* clientid_charset = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
-evrythng_return_t EvrythngConnect(evrythng_handle_t handle)
+evrythng_return_t EvrythngSetEngine(evrythng_handle_t handle, evrythng_engine_handle_t engine)
 {
     if (!handle)
         return EVRYTHNG_BAD_ARGS;
 
-    if (!handle->initialized)
-    {
-        if (!handle->client_id)
-        {
-            int i;
-            handle->client_id = (char*)platform_malloc(MQTT_CLIENTID_LEN+1);
-            if (!handle->client_id)
-                return EVRYTHNG_MEMORY_ERROR;
-            memset(handle->client_id, 0, MQTT_CLIENTID_LEN+1);
+    /* the handle joins the engine in EvrythngConnect */
+    if (handle->initialized)
+        return EVRYTHNG_FAILURE;
 
-            for (i = 0; i < MQTT_CLIENTID_LEN; i++)
-                handle->client_id[i] = clientid_charset[platform_rand() % strlen(clientid_charset)];
+    handle->engine = engine;
+    handle->poll_mode = engine ? 1 : 0;
 
-            handle->mqtt_conn_opts.clientID.cstring = handle->client_id;
-            debug("client ID: %s", handle->client_id);
-        }
+    return EVRYTHNG_SUCCESS;
+}
 
-        platform_thread_create(&handle->mqtt_thread, handle->mqtt_thread_priority, "mqtt_thread", mqtt_thread, handle->mqtt_thread_stacksize, (void*)handle);
 
-        handle->initialized = 1;
-    }
+evrythng_return_t EvrythngGetStats(evrythng_handle_t handle, evrythng_stats_t* stats)
+{
+    MQTTClient* c;
 
-    if (MQTTisConnected(&handle->mqtt_client))
-    {
-        warning("already connected");
-        return EVRYTHNG_SUCCESS;
-    }
+    if (!handle || !stats)
+        return EVRYTHNG_BAD_ARGS;
 
-    return evrythng_async_op(handle, MQTT_CONNECT, 0, 0, 0);
+    c = &handle->mqtt_client;
+    memset(stats, 0, sizeof(evrythng_stats_t));
+
+    /* counters are read without locking, the threads updating them never wait for this */
+    stats->publishes = c->stats.publishes;
+    stats->acks = c->stats.acks;
+    stats->subscribes = c->stats.subscribes;
+    stats->messages_in = c->stats.messages_in;
+    stats->bytes_in = c->stats.bytes_in;
+    stats->bytes_out = c->stats.bytes_out;
+    stats->reconnects = handle->reconnects;
+    stats->timeouts = c->stats.ack_timeouts + handle->expired;
+    stats->dropped = handle->dropped;
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    for (int i = 0; i < OP_LANES; i++)
+        stats->queue_depth += handle->op_queue[i].count;
+    platform_mutex_unlock(&handle->op_queue_mtx);
+    if (handle->store)
+        stats->stored = store_count(handle->store);
+    stats->inflight = c->inflight_count;
+    stats->subscriptions = handle->sub_count;
+
+    stats->publish_latency = handle->publish_latency;
+    stats->callback_duration = handle->callback_duration;
+    if (handle->dispatch)
+        dispatch_stats(handle->dispatch, &stats->callback_duration);
+
+    return EVRYTHNG_SUCCESS;
 }
 
-typedef enum _mqtt_connection_status_t {
-    MQTT_CONNECTION_ACCEPTED = 0x00,
-    MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 0x01,
-    MQTT_IDENTIFIER_REJECTED = 0x02,
-    MQTT_SERVER_UNAVAILABLE = 0x03,
-    MQTT_BAD_USER_NAME_OR_PASSWORD = 0x04,
-    MQTT_NOT_AUTHORIZED = 0x05,
-} mqtt_connection_status_t;
 
-#define max(a,b) ((a)>(b)?(a):(b))
+/* subscriptions are identified by the topic without the ?pubStates= query */
+static int sub_topic_len(const char* topic)
+{
+    const char* qp = strstr(topic, "?pubStates=");
+    return qp ? qp - topic : strlen(topic);
+}
 
-int next_sleep_time(int retry_count) 
+
+static unsigned int sub_hash(const sub_node_t* parent, const char* name, int len)
 {
-    //special case
-    if (retry_count == 0)
-        return 0;
-    /*
-     * base is 500 ms, min factor is 2 (1 sec);
-     * multiply base by a factor that is chosen 
-     * randomly within the increasing interval;
-     */
-    static const int base = 500;
-    static const int cap = 2;
-    /*
-     * adding 2 to the retry count to increase
-     * interval for random values faster;
-     */
-    int rand = platform_rand() % (1 << (retry_count + 2));
-    return base * max(cap, rand);
+    /* FNV-1a over the level name, seeded with the parent address */
+    unsigned int h = 2166136261u ^ (unsigned int)(size_t)parent;
+    while (len--)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
 }
 
-evrythng_return_t evrythng_connect_internal(evrythng_handle_t handle)
+
+static sub_node_t* sub_child(evrythng_handle_t handle, const sub_node_t* parent, const char* name, int len)
 {
-    int rc = EVRYTHNG_SUCCESS;
+    if (!handle->sub_hash)
+        return 0;
 
-    if (MQTTisConnected(&handle->mqtt_client)) {
-        warning("already connected");
-        return rc;
+    unsigned int h = sub_hash(parent, name, len);
+    sub_node_t* n = handle->sub_hash[h & (handle->sub_hash_size - 1)];
+    while (n)
+    {
+        if (n->hash == h && n->parent == parent && n->len == len && memcmp(n->name, name, len) == 0)
+            return n;
+        n = n->hash_next;
     }
+    return 0;
+}
 
-    if (handle->secure_connection)
+
+static int sub_hash_grow(evrythng_handle_t handle)
+{
+    unsigned int i, size = handle->sub_hash_size ? handle->sub_hash_size * 2 : SUB_HASH_INITIAL_SIZE;
+
+    sub_node_t** buckets = (sub_node_t**)platform_malloc(size * sizeof(sub_node_t*));
+    if (!buckets)
+        return -1;
+    memset(buckets, 0, size * sizeof(sub_node_t*));
+
+    for (i = 0; i < handle->sub_hash_size; i++)
+    {
+        sub_node_t* n = handle->sub_hash[i];
+        while (n)
+        {
+            sub_node_t* next = n->hash_next;
+            n->hash_next = buckets[n->hash & (size - 1)];
+            buckets[n->hash & (size - 1)] = n;
+            n = next;
+        }
+    }
+
+    if (handle->sub_hash) platform_free(handle->sub_hash);
+    handle->sub_hash = buckets;
+    handle->sub_hash_size = size;
+
+    return 0;
+}
+
+
+static sub_node_t* sub_add_child(evrythng_handle_t handle, sub_node_t* parent, const char* name, int len)
+{
+    if (handle->sub_hash_count >= handle->sub_hash_size && sub_hash_grow(handle))
+        return 0;
+
+    sub_node_t* n = (sub_node_t*)platform_malloc(sizeof(sub_node_t) + len);
+    if (!n)
+        return 0;
+
+    memset(n, 0, sizeof(sub_node_t));
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->len = len;
+    n->parent = parent;
+    n->hash = sub_hash(parent, name, len);
+
+    sub_node_t** bucket = &handle->sub_hash[n->hash & (handle->sub_hash_size - 1)];
+    n->hash_next = *bucket;
+    *bucket = n;
+    handle->sub_hash_count++;
+
+    parent->children++;
+    if (len == 1 && name[0] == '+')
+        parent->single = n;
+    else if (len == 1 && name[0] == '#')
+        parent->multi = n;
+
+    return n;
+}
+
+
+/* removes n and its ancestors as long as they hold neither subscriptions nor children */
+static void sub_prune(evrythng_handle_t handle, sub_node_t* n)
+{
+    while (n != &handle->sub_root && !n->sub && !n->children)
+    {
+        sub_node_t* parent = n->parent;
+        sub_node_t** p = &handle->sub_hash[n->hash & (handle->sub_hash_size - 1)];
+
+        while (*p != n)
+            p = &(*p)->hash_next;
+        *p = n->hash_next;
+        handle->sub_hash_count--;
+
+        parent->children--;
+        if (parent->single == n)
+            parent->single = 0;
+        if (parent->multi == n)
+            parent->multi = 0;
+
+        platform_free(n);
+        n = parent;
+    }
+}
+
+
+/* walks the levels of topic[0..len), creating missing nodes if requested */
+static sub_node_t* sub_find_node(evrythng_handle_t handle, const char* topic, int len, int create)
+{
+    sub_node_t* n = &handle->sub_root;
+    const char* end = topic + len;
+    const char* level = topic;
+
+    while (n)
+    {
+        const char* level_end = level;
+        while (level_end < end && *level_end != '/')
+            level_end++;
+
+        sub_node_t* child = sub_child(handle, n, level, level_end - level);
+        if (!child && create)
+        {
+            child = sub_add_child(handle, n, level, level_end - level);
+            if (!child)
+                sub_prune(handle, n);
+        }
+        n = child;
+
+        if (level_end == end)
+            break;
+        level = level_end + 1;
+    }
+
+    return n;
+}
+
+
+/* level points to the first unmatched level of the topic name, or is NULL once all levels matched */
+static sub_callback_t* sub_match(evrythng_handle_t handle, const sub_node_t* n, const char* level, const char* end)
+{
+    sub_callback_t* sub;
+
+    if (!level)
+    {
+        if (n->sub)
+            return n->sub;
+        /* "a/#" also matches "a" */
+        return n->multi ? n->multi->sub : 0;
+    }
+
+    const char* level_end = level;
+    while (level_end < end && *level_end != '/')
+        level_end++;
+    const char* next = level_end < end ? level_end + 1 : 0;
+
+    sub_node_t* child = sub_child(handle, n, level, level_end - level);
+    if (child && (sub = sub_match(handle, child, next, end)))
+        return sub;
+
+    if (n->single && (sub = sub_match(handle, n->single, next, end)))
+        return sub;
+
+    return n->multi ? n->multi->sub : 0;
+}
+
+
+static evrythng_return_t add_sub_callback(evrythng_handle_t handle, const char* topic, int qos, sub_callback *callback)
+{
+    sub_node_t* node = sub_find_node(handle, topic, sub_topic_len(topic), 1);
+    if (!node)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    if (node->sub) 
+    {
+        debug("callback for %s already exists", topic);
+        return EVRYTHNG_ALREADY_SUBSCRIBED;
+    }
+
+    sub_callback_t* sub = (sub_callback_t*)platform_malloc(sizeof(sub_callback_t));
+    if (!sub)
+    {
+        sub_prune(handle, node);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    if ((sub->topic = (char*)platform_malloc(strlen(topic) + 1)) == NULL) 
+    {
+        platform_free(sub);
+        sub_prune(handle, node);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    strcpy(sub->topic, topic);
+    sub->qos = qos;
+    sub->callback = callback;
+    sub->node = node;
+    node->sub = sub;
+
+    /* keep subscription order for resubscribing after a reconnect */
+    sub->next = 0;
+    sub->pprev = handle->sub_callbacks_tail;
+    *handle->sub_callbacks_tail = sub;
+    handle->sub_callbacks_tail = &sub->next;
+    handle->sub_count++;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static evrythng_return_t rm_sub_callback(evrythng_handle_t handle, const char* topic, char* deleted_topic)
+{
+    sub_node_t* node = sub_find_node(handle, topic, sub_topic_len(topic), 0);
+    if (!node || !node->sub)
+        return EVRYTHNG_NOT_SUBSCRIBED;
+
+    sub_callback_t* sub = node->sub;
+
+    *sub->pprev = sub->next;
+    if (sub->next)
+        sub->next->pprev = sub->pprev;
+    else
+        handle->sub_callbacks_tail = sub->pprev;
+
+    if (deleted_topic)
+        strcpy(deleted_topic, sub->topic);
+
+    node->sub = 0;
+    sub_prune(handle, node);
+
+    platform_free(sub->topic);
+    platform_free(sub);
+    handle->sub_count--;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static sub_callback* get_sub_callback(evrythng_handle_t handle, const char* name, int len)
+{
+    sub_callback_t* sub = sub_match(handle, &handle->sub_root, name, name + len);
+
+    return sub ? sub->callback : 0;
+}
+
+
+void message_callback(MessageData* data, void* userdata)
+{
+    evrythng_handle_t handle = (evrythng_handle_t)userdata;
+
+    //debug("received msg topic: %s", data->topicName->lenstring.data);
+    //debug("received msg, length %d, payload: %s", data->message->payloadlen, (char*)data->message->payload);
+
+    if (data->message->payloadlen < 3) 
+    {
+        error("incorrect message lenth %d", data->message->payloadlen);
+        return;
+    }
+
+    const char* name = data->topicName->lenstring.data;
+    int len = data->topicName->lenstring.len;
+
+    if (data->topicName->cstring)
+    {
+        name = data->topicName->cstring;
+        len = strlen(name);
+    }
+
+    sub_callback* cb = get_sub_callback(handle, name, len);
+    if (!cb)
+        return;
+
+    if (!handle->dispatch)
+    {
+        platform_timer_countdown(&handle->callback_timer, STATS_CLOCK_MS);
+        (*cb)(data->message->payload, data->message->payloadlen);
+        histogram_record(&handle->callback_duration, STATS_CLOCK_MS - platform_timer_left(&handle->callback_timer));
+    }
+    else
+    {
+        /* a loop thread of an engine doesn't wait for a worker, the other handles of the loop would */
+        int rc = dispatch_post(handle->dispatch, cb, name, len, 
+                data->message->payload, data->message->payloadlen, !handle->engine_source);
+        if (rc < 0)
+        {
+            error("no memory to dispatch message to %.*s", len, name);
+        }
+        else if (rc > 0)
+        {
+            warning("callback worker too far behind, dropping message to %.*s", len, name);
+            handle->dropped++;
+        }
+    }
+}
+
+
+/* actions are commands someone is waiting for, everything else can wait for them */
+static int op_lane(mqtt_op* op)
+{
+    if (op->op == MQTT_PUBLISH && rate_class(op->topic) == EVRYTHNG_RATE_ACTIONS)
+        return OP_LANE_HIGH;
+    return OP_LANE_LOW;
+}
+
+
+/* tells whoever drives the engine that there is new work */
+static void handle_wakeup(evrythng_handle_t handle)
+{
+    if (handle->engine_source)
+        engine_wake(handle->engine_source);
+    else
+        platform_event_set(&handle->op_ready_event);
+}
+
+
+/* called with op_queue_mtx held */
+static evrythng_token_t op_next_token(evrythng_handle_t handle)
+{
+    if (++handle->next_token <= 0)
+        handle->next_token = 1;
+    return handle->next_token;
+}
+
+
+static int op_queue_push(evrythng_handle_t handle, mqtt_op* op, Timer* timer, evrythng_token_t* token)
+{
+    mqtt_op_queue* q;
+
+    op->lane = op_lane(op);
+
+    while (1)
+    {
+        platform_mutex_lock(&handle->op_queue_mtx);
+        /* a full high lane overflows into the low one rather than waiting */
+        if (op->lane == OP_LANE_HIGH && handle->op_queue[OP_LANE_HIGH].count == OP_QUEUE_SIZE)
+            op->lane = OP_LANE_LOW;
+        q = &handle->op_queue[op->lane];
+        if (q->count < OP_QUEUE_SIZE)
+        {
+            op->state = MQTT_OP_QUEUED;
+            op->token = op_next_token(handle);
+            if (token)
+                *token = op->token;
+            q->ops[(q->head + q->count) % OP_QUEUE_SIZE] = op;
+            q->count++;
+            platform_mutex_unlock(&handle->op_queue_mtx);
+            break;
+        }
+        platform_mutex_unlock(&handle->op_queue_mtx);
+
+        if (platform_timer_isexpired(timer))
+            return -1;
+
+        /* queue is full, wait for mqtt_thread to take an op out of it */
+        platform_semaphore_wait(&handle->op_slot_sem, platform_timer_left(timer));
+    }
+
+    handle_wakeup(handle);
+
+    return 0;
+}
+
+
+/* 
+ * Last value wins: a queued asynchronous publish to the same topic is 
+ * swapped for op, which takes over its place in the queue. The replaced
+ * one is completed with EVRYTHNG_SUPERSEDED by whoever drives the engine.
+ * Returns 1 if there was one.
+ */
+static int op_queue_replace(evrythng_handle_t handle, mqtt_op* op, evrythng_token_t* token)
+{
+    mqtt_op_queue* q;
+    mqtt_op* old = 0;
+    int i;
+
+    op->lane = op_lane(op);
+    q = &handle->op_queue[op->lane];
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    for (i = q->count - 1; i >= 0; i--)
+    {
+        mqtt_op** slot = &q->ops[(q->head + i) % OP_QUEUE_SIZE];
+        if (*slot && (*slot)->async && (*slot)->op == MQTT_PUBLISH && !strcmp((*slot)->topic, op->topic))
+        {
+            old = *slot;
+            op->state = MQTT_OP_QUEUED;
+            op->token = op_next_token(handle);
+            if (token)
+                *token = op->token;
+            *slot = op;
+            old->next = 0;
+            *handle->superseded_ops_tail = old;
+            handle->superseded_ops_tail = &old->next;
+            break;
+        }
+    }
+    platform_mutex_unlock(&handle->op_queue_mtx);
+
+    if (!old)
+        return 0;
+
+    handle_wakeup(handle);
+
+    return 1;
+}
+
+
+/* 
+ * Takes the oldest op of the high lane, or of the low lane if the high 
+ * one is empty. After OP_FAIR_RUN high lane ops in a row a waiting low 
+ * lane op is taken first, so that a flood of actions cannot hold back 
+ * everything else for good.
+ */
+static mqtt_op* op_queue_pop(evrythng_handle_t handle)
+{
+    mqtt_op* op = 0;
+    int taken = 0;
+    int i, lane = OP_LANE_HIGH;
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    if (handle->op_high_run >= OP_FAIR_RUN)
+        lane = OP_LANE_LOW;
+    for (i = 0; i < OP_LANES && !op; i++, lane = (lane + 1) % OP_LANES)
+    {
+        mqtt_op_queue* q = &handle->op_queue[lane];
+        while (q->count > 0 && !op)
+        {
+            /* cancelled ops leave an empty slot behind */
+            op = q->ops[q->head];
+            q->ops[q->head] = 0;
+            q->head = (q->head + 1) % OP_QUEUE_SIZE;
+            q->count--;
+            taken = 1;
+        }
+    }
+    if (op)
+    {
+        op->state = MQTT_OP_RUNNING;
+        if (op->lane == OP_LANE_HIGH && handle->op_queue[OP_LANE_LOW].count > 0)
+            handle->op_high_run++;
+        else
+            handle->op_high_run = 0;
+    }
+    platform_mutex_unlock(&handle->op_queue_mtx);
+
+    if (taken)
+        platform_semaphore_post(&handle->op_slot_sem);
+
+    return op;
+}
+
+
+/* returns 1 if there are queued actions */
+static int op_queue_urgent(evrythng_handle_t handle)
+{
+    int urgent;
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    urgent = handle->op_queue[OP_LANE_HIGH].count > 0;
+    platform_mutex_unlock(&handle->op_queue_mtx);
+
+    return urgent;
+}
+
+
+/* frees a synchronous op, see evrythng_run_op */
+static void op_free(mqtt_op* op)
+{
+    if (op->poll_wait)
+        platform_event_deinit(&op->done_event);
+    platform_timer_deinit(&op->timer);
+    platform_semaphore_deinit(&op->done_sem);
+    platform_free(op);
+}
+
+
+/* 
+ * Called by the caller of a synchronous op whenever it wakes up. Returns 0
+ * if the op is done, or if its time is up and it was still queued and has
+ * been taken out, the caller frees it then. Returns 1 if its time is up 
+ * and it was sent, whoever completes it frees it. Returns -1 if the caller
+ * has to wait on, the op is being executed with the caller's data.
+ */
+static int op_settle(evrythng_handle_t handle, mqtt_op* op, evrythng_return_t* rc)
+{
+    mqtt_op_queue* q = &handle->op_queue[op->lane];
+    int i, fate = -1;
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    if (op->state == MQTT_OP_DONE)
+    {
+        *rc = op->result;
+        fate = 0;
+    }
+    else if (platform_timer_isexpired(&op->timer))
+    {
+        *rc = EVRYTHNG_TIMEOUT;
+        if (op->state == MQTT_OP_QUEUED)
+        {
+            for (i = 0; i < q->count; i++)
+            {
+                if (q->ops[(q->head + i) % OP_QUEUE_SIZE] == op)
+                {
+                    q->ops[(q->head + i) % OP_QUEUE_SIZE] = 0;
+                    break;
+                }
+            }
+            fate = 0;
+        }
+        else if (op->state == MQTT_OP_SENT)
+        {
+            op->abandoned = 1;
+            fate = 1;
+        }
+    }
+    platform_mutex_unlock(&handle->op_queue_mtx);
+
+    return fate;
+}
+
+
+/* 
+ * A synchronous op handed to the mqtt client waits for the cloud's answer,
+ * its caller is woken up to leave it behind if its time is up meanwhile.
+ */
+static void op_sent(evrythng_handle_t handle, mqtt_op* op)
+{
+    if (op->async)
+        return;
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    op->state = MQTT_OP_SENT;
+    if (op->poll_wait)
+        platform_event_set(&op->done_event);
+    platform_semaphore_post(&op->done_sem);
+    platform_mutex_unlock(&handle->op_queue_mtx);
+}
+
+
+static void op_complete(evrythng_handle_t handle, mqtt_op* op, evrythng_return_t result)
+{
+    int abandoned;
+
+    if (op->async)
+    {
+        if (op->pub_callback)
+            (*op->pub_callback)(op->token, result, op->timeout - platform_timer_left(&op->timer));
+        platform_timer_deinit(&op->timer);
+        platform_free(op);
+        return;
+    }
+
+    /* the caller frees the op as soon as it gets the lock, unless it left it behind */
+    platform_mutex_lock(&handle->op_queue_mtx);
+    op->result = result;
+    op->state = MQTT_OP_DONE;
+    abandoned = op->abandoned;
+    if (!abandoned)
+    {
+        /* the caller may be waiting for the network while another thread completes its op */
+        if (op->poll_wait)
+            platform_event_set(&op->done_event);
+        platform_semaphore_post(&op->done_sem);
+    }
+    platform_mutex_unlock(&handle->op_queue_mtx);
+
+    if (abandoned)
+        op_free(op);
+}
+
+
+/* 
+ * Called by the mqtt client with its mutex held, so user callbacks 
+ * can't be run from here. Only mqtt_thread drives the client, 
+ * the list is never touched by other threads.
+ */
+static void publish_callback(void* context, int rc, void* userdata)
+{
+    evrythng_handle_t handle = (evrythng_handle_t)userdata;
+    mqtt_op* op = (mqtt_op*)context;
+
+    if (rc == MQTT_SUCCESS)
+    {
+        op->result = EVRYTHNG_SUCCESS;
+        histogram_record(&handle->publish_latency, handle->mqtt_client.ack_rtt_ms);
+    }
+    else
+    {
+        error("publish to %s was not acknowledged, rc = %d", op->topic, rc);
+        op->result = EVRYTHNG_PUBLISH_ERROR;
+    }
+
+    op->next = 0;
+    *handle->done_ops_tail = op;
+    handle->done_ops_tail = &op->next;
+}
+
+
+/* completes a subscribe or unsubscribe op once the cloud answered it */
+static void request_callback(void* context, int rc, void* userdata)
+{
+    evrythng_handle_t handle = (evrythng_handle_t)userdata;
+    mqtt_op* op = (mqtt_op*)context;
+
+    if (op->op == MQTT_SUBSCRIBE)
+    {
+        if (rc >= 0) 
+        {
+            debug("successfully subscribed to %s, return code %d", op->topic, rc);
+            op->result = EVRYTHNG_SUCCESS;
+        }
+        else
+        {
+            debug("subscription failed: %d", rc);
+            op->result = EVRYTHNG_SUBSCRIPTION_ERROR;
+            rm_sub_callback(handle, op->topic, 0);
+        }
+    }
+    else
+    {
+        if (rc >= 0) 
+        {
+            debug("successfully unsubscribed from %s", op->topic);
+            op->result = EVRYTHNG_SUCCESS;
+        }
+        else
+        {
+            op->result = EVRYTHNG_UNSUBSCRIPTION_ERROR;
+        }
+    }
+
+    op->next = 0;
+    *handle->done_ops_tail = op;
+    handle->done_ops_tail = &op->next;
+}
+
+
+static void store_try_rewind(evrythng_handle_t handle)
+{
+    int i;
+
+    if (!handle->store_rewind)
+        return;
+
+    for (i = 0; i < handle->store_ops_count; i++)
+        if (handle->store_ops[(handle->store_ops_first + i) % MAX_INFLIGHT_MESSAGES].state != MQTT_OP_DONE)
+            return;
+
+    handle->store_ops_count = 0;
+    handle->store_rewind = 0;
+    store_rewind(handle->store);
+}
+
+
+/* 
+ * Releases stored records from the oldest one up to the first that is
+ * still in flight. If one of them failed everything sent after it is
+ * sent again from the store once no record is in flight any more.
+ */
+static void store_complete(evrythng_handle_t handle, mqtt_op* op, evrythng_return_t result)
+{
+    op->state = MQTT_OP_DONE;
+    op->result = result;
+    if (result != EVRYTHNG_SUCCESS)
+        handle->store_rewind = 1;
+
+    while (handle->store_ops_count)
+    {
+        mqtt_op* first = &handle->store_ops[handle->store_ops_first];
+        if (first->state != MQTT_OP_DONE || first->result != EVRYTHNG_SUCCESS)
+            break;
+        store_release(handle->store, first->store_next);
+        handle->store_ops_first = (handle->store_ops_first + 1) % MAX_INFLIGHT_MESSAGES;
+        handle->store_ops_count--;
+    }
+
+    store_try_rewind(handle);
+}
+
+
+static void complete_acked_ops(evrythng_handle_t handle)
+{
+    mqtt_op* op = handle->done_ops;
+
+    handle->done_ops = 0;
+    handle->done_ops_tail = &handle->done_ops;
+
+    while (op)
+    {
+        mqtt_op* next = op->next;
+        if (op->stored)
+            store_complete(handle, op, op->result);
+        else
+            op_complete(handle, op, op->result);
+        op = next;
+    }
+
+    platform_mutex_lock(&handle->op_queue_mtx);
+    op = handle->superseded_ops;
+    handle->superseded_ops = 0;
+    handle->superseded_ops_tail = &handle->superseded_ops;
+    platform_mutex_unlock(&handle->op_queue_mtx);
+
+    while (op)
+    {
+        mqtt_op* next = op->next;
+        op_complete(handle, op, EVRYTHNG_SUPERSEDED);
+        op = next;
+    }
+}
+
+
+/* rate class of a publish topic, see build_pub_topic */
+static int rate_class(const char* topic)
+{
+    if (!strncmp(topic, "actions/", 8) || strstr(topic, "/actions/"))
+        return EVRYTHNG_RATE_ACTIONS;
+    if (strstr(topic, "/properties"))
+        return EVRYTHNG_RATE_PROPERTIES;
+    if (strstr(topic, "/location"))
+        return EVRYTHNG_RATE_LOCATIONS;
+    return EVRYTHNG_RATE_ALL;
+}
+
+
+static void rate_refill(rate_bucket_t* b)
+{
+    int elapsed = RATE_CLOCK_MS - platform_timer_left(&b->clock);
+
+    if (elapsed <= 0)
+        return;
+    platform_timer_countdown(&b->clock, RATE_CLOCK_MS);
+
+    if (elapsed > b->burst * 1000 / b->rate + 1)
+        b->credit = b->burst * 1000;
+    else if ((b->credit += elapsed * b->rate) > b->burst * 1000)
+        b->credit = b->burst * 1000;
+}
+
+
+/* milliseconds until the buckets of the class and of all messages have a token, rate_mtx held */
+static int rate_wait_locked(evrythng_handle_t handle, int cls)
+{
+    int wait = 0;
+    rate_bucket_t* b = &handle->rate_buckets[EVRYTHNG_RATE_ALL];
+
+    while (1)
+    {
+        if (b->rate)
+        {
+            rate_refill(b);
+            if (b->credit < 1000)
+            {
+                int w = (1000 - b->credit + b->rate - 1) / b->rate;
+                if (w > wait)
+                    wait = w;
+            }
+        }
+        if (b == &handle->rate_buckets[cls])
+            break;
+        b = &handle->rate_buckets[cls];
+    }
+
+    return wait;
+}
+
+
+/* takes a token from both buckets, leaving them in debt if they are empty */
+static void rate_charge_locked(evrythng_handle_t handle, int cls)
+{
+    if (handle->rate_buckets[EVRYTHNG_RATE_ALL].rate)
+        handle->rate_buckets[EVRYTHNG_RATE_ALL].credit -= 1000;
+    if (cls != EVRYTHNG_RATE_ALL && handle->rate_buckets[cls].rate)
+        handle->rate_buckets[cls].credit -= 1000;
+}
+
+
+static int rate_wait(evrythng_handle_t handle, int cls)
+{
+    platform_mutex_lock(&handle->rate_mtx);
+    int wait = rate_wait_locked(handle, cls);
+    platform_mutex_unlock(&handle->rate_mtx);
+    return wait;
+}
+
+
+static void rate_charge(evrythng_handle_t handle, int cls)
+{
+    platform_mutex_lock(&handle->rate_mtx);
+    rate_charge_locked(handle, cls);
+    platform_mutex_unlock(&handle->rate_mtx);
+}
+
+
+/* takes a token if there is one, otherwise returns the milliseconds to wait for it */
+static int rate_take(evrythng_handle_t handle, int cls)
+{
+    platform_mutex_lock(&handle->rate_mtx);
+    int wait = rate_wait_locked(handle, cls);
+    if (!wait)
+        rate_charge_locked(handle, cls);
+    platform_mutex_unlock(&handle->rate_mtx);
+    return wait;
+}
+
+
+/* waits for the rate limit up to max_wait_ms, returns EVRYTHNG_RATE_LIMITED if that is not enough */
+static evrythng_return_t rate_admit(evrythng_handle_t handle, const char* topic, int cls, int max_wait_ms)
+{
+    int wait;
+    Timer timer;
+
+    if (!(wait = rate_take(handle, cls)))
+        return EVRYTHNG_SUCCESS;
+
+    platform_timer_init(&timer);
+    platform_timer_countdown(&timer, max_wait_ms);
+    while (wait && wait <= platform_timer_left(&timer))
+    {
+        platform_sleep(wait);
+        wait = rate_take(handle, cls);
+    }
+    platform_timer_deinit(&timer);
+
+    if (wait)
+    {
+        warning("publish to %s exceeds the rate limit", topic);
+        return EVRYTHNG_RATE_LIMITED;
+    }
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+/* appends a message to the offline store and wakes up mqtt_thread to send it */
+static evrythng_return_t store_put(evrythng_handle_t handle, const char* topic, int topic_len, const char* payload, size_t payload_len, int coalesce)
+{
+    if (store_append(handle->store, topic, topic_len, payload, payload_len, coalesce))
+    {
+        error("offline store is full, dropping message to %.*s", topic_len, topic);
+        return EVRYTHNG_QUEUE_FULL;
+    }
+
+    handle_wakeup(handle);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+/* 
+ * Messages go to the store while offline and while older ones are still 
+ * in it, to keep them in order. Actions don't queue up behind stored 
+ * messages once connected, they may overtake them instead.
+ */
+static int store_wanted(evrythng_handle_t handle, int cls)
+{
+    if (!handle->store)
+        return 0;
+    if (!MQTTisConnected(&handle->mqtt_client))
+        return 1;
+    return cls != EVRYTHNG_RATE_ACTIONS && store_count(handle->store) > 0;
+}
+
+
+/* sends stored records while the inflight window and the drain rate allow, returns an mqtt return code */
+static int store_drain(evrythng_handle_t handle)
+{
+    while (handle->store_ops_count < MAX_INFLIGHT_MESSAGES && !handle->store_rewind &&
+            MQTTInflightAvailable(&handle->mqtt_client) > 0)
+    {
+        if (handle->store_rate)
+        {
+            if (platform_timer_isexpired(&handle->store_rate_timer))
+            {
+                handle->store_budget = handle->store_rate;
+                platform_timer_countdown(&handle->store_rate_timer, 1000);
+            }
+            if (handle->store_budget <= 0)
+                break;
+        }
+
+        /* 
+         * the class of a record is only known once it is read, so only 
+         * the bucket of all messages can hold it back
+         */
+        if (rate_wait(handle, EVRYTHNG_RATE_ALL))
+            break;
+
+        store_record_t record;
+        if (!store_next(handle->store, &record))
+            break;
+        rate_charge(handle, rate_class(record.topic));
+
+        MQTTMessage msg = {
+            .qos = handle->qos, 
+            .retained = 1, 
+            .dup = 0,
+            .id = 0,
+            .payload = (void*)record.payload,
+            .payloadlen = record.payload_len
+        };
+
+        mqtt_op* op = &handle->store_ops[(handle->store_ops_first + handle->store_ops_count) % MAX_INFLIGHT_MESSAGES];
+        memset(op, 0, sizeof(mqtt_op));
+        op->op = MQTT_PUBLISH;
+        op->state = MQTT_OP_RUNNING;
+        op->topic = record.topic;
+        op->stored = 1;
+        op->store_next = record.next;
+
+        int rc = MQTTPublishEncodedAsync(&handle->mqtt_client, record.encoded_topic, &msg, op);
+        if (rc != MQTT_SUCCESS)
+        {
+            /* the record has been read already, read it again next time */
+            handle->store_rewind = 1;
+            store_try_rewind(handle);
+            if (rc == MQTT_INFLIGHT_FULL)
+                break;
+            error("could not publish stored message, rc = %d", rc);
+            return rc;
+        }
+
+        handle->store_ops_count++;
+        handle->store_budget--;
+
+        if (msg.qos == QOS0)
+            store_complete(handle, op, EVRYTHNG_SUCCESS);
+    }
+
+    return MQTT_SUCCESS;
+}
+
+
+/* writes the store in batches, at most STORE_SYNC_INTERVAL_MS after a change */
+static void store_flush(evrythng_handle_t handle)
+{
+    if (!handle->store || !store_dirty(handle->store))
+        return;
+
+    if (platform_timer_isexpired(&handle->store_sync_timer))
+    {
+        store_sync(handle->store);
+        platform_timer_countdown(&handle->store_sync_timer, STORE_SYNC_INTERVAL_MS);
+    }
+}
+
+
+/* milliseconds mqtt_thread may sleep before it has to take care of the store, -1 for no limit */
+static int store_deadline(evrythng_handle_t handle)
+{
+    int timeout = -1;
+
+    if (!handle->store)
+        return timeout;
+
+    if (store_dirty(handle->store))
+        timeout = platform_timer_left(&handle->store_sync_timer);
+
+    if (MQTTisConnected(&handle->mqtt_client) && store_pending(handle->store) > 0)
+    {
+        int left = -1;
+        if (handle->store_rate && handle->store_budget <= 0)
+            left = platform_timer_left(&handle->store_rate_timer);
+        int wait = rate_wait(handle, EVRYTHNG_RATE_ALL);
+        if (wait > left)
+            left = wait;
+        if (left >= 0 && (timeout < 0 || left < timeout))
+            timeout = left;
+    }
+
+    return timeout < 0 ? timeout : timeout > 0 ? timeout : 1;
+}
+
+
+static int poll_run_op(evrythng_handle_t handle, mqtt_op* op, evrythng_return_t* rc);
+static int engine_run(void* ctx, int readable, int* fd, unsigned int* conn);
+
+/* 
+ * Queues a copy of an op prepared by the caller and waits for mqtt_thread
+ * to execute it. The copy keeps the topic the mqtt client needs until the
+ * cloud answers, so that a caller whose time is up can leave a sent op
+ * behind rather than wait for the answer.
+ */
+static evrythng_return_t evrythng_run_op(evrythng_handle_t handle, const mqtt_op* args)
+{
+    evrythng_return_t rc = EVRYTHNG_FAILURE;
+    size_t topic_size = 0;
+    int fate;
+
+    /* the topics of a subscribe many are done with once it was executed */
+    if (args->topic && args->op != MQTT_SUBSCRIBE_MANY)
+        topic_size = strlen(args->topic) + 1;
+
+    mqtt_op* op = (mqtt_op*)platform_malloc(sizeof(mqtt_op) + topic_size);
+    if (!op)
+        return EVRYTHNG_MEMORY_ERROR;
+    memcpy(op, args, sizeof(mqtt_op));
+    if (topic_size)
+    {
+        memcpy(op + 1, args->topic, topic_size);
+        op->topic = (const char*)(op + 1);
+    }
+
+    op->result = EVRYTHNG_FAILURE;
+    platform_semaphore_init(&op->done_sem);
+
+    op->timeout = handle->command_timeout_ms * 2;
+    if (op->op == MQTT_CONNECT)
+        op->timeout = handle->command_timeout_ms * 6;
+
+    platform_timer_init(&op->timer);
+    platform_timer_countdown(&op->timer, op->timeout);
+
+    /* with an engine the op is run by a loop thread, as it is by mqtt_thread */
+    if (handle->poll_mode && !handle->engine)
+    {
+        fate = poll_run_op(handle, op, &rc);
+    }
+    else if (op_queue_push(handle, op, &op->timer, 0))
+    {
+        rc = EVRYTHNG_TIMEOUT;
+        fate = 0;
+    }
+    else
+    {
+        /* done_sem is posted once the op was sent and once it is done */
+        do
+        {
+            /* once the time is up an op being executed is waited for until it was sent */
+            int left = platform_timer_left(&op->timer);
+            platform_semaphore_wait(&op->done_sem, left > 0 ? left : handle->command_timeout_ms);
+            fate = op_settle(handle, op, &rc);
+        }
+        while (fate < 0);
+    }
+
+    if (!fate)
+        op_free(op);
+
+    return rc;
+}
+
+
+static evrythng_return_t evrythng_async_op(evrythng_handle_t handle, int op, const char* topic, MQTTMessage* message, sub_callback *callback)
+{
+    mqtt_op mop;
+
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    memset(&mop, 0, sizeof mop);
+    mop.op = op;
+    mop.topic = topic;
+    mop.message = message;
+    mop.callback = callback;
+
+    return evrythng_run_op(handle, &mop);
+}
+
+
+static evrythng_return_t evrythng_async_pub(
+        evrythng_handle_t handle, 
+        const char* topic, 
+        int topic_len, 
+        const char* payload, 
+        size_t payload_len, 
+        int coalesce,
+        pub_callback* callback, 
+        evrythng_token_t* token)
+{
+    Timer now;
+
+    /* op, message, topic and payload copies share a single allocation */
+    mqtt_op* op = (mqtt_op*)platform_malloc(sizeof(mqtt_op) + sizeof(MQTTMessage) + 2 + topic_len + 1 + payload_len + 1);
+    if (!op)
+        return EVRYTHNG_MEMORY_ERROR;
+    memset(op, 0, sizeof(mqtt_op));
+
+    MQTTMessage* message = (MQTTMessage*)(op + 1);
+    unsigned char* topic_copy = (unsigned char*)(message + 1);
+    char* payload_copy = (char*)topic_copy + 2 + topic_len + 1;
+
+    /* kept serialized so that mqtt_thread doesn't need to measure it again */
+    topic_copy[0] = (unsigned char)(topic_len >> 8);
+    topic_copy[1] = (unsigned char)topic_len;
+    memcpy(topic_copy + 2, topic, topic_len);
+    topic_copy[2 + topic_len] = '\0';
+    memcpy(payload_copy, payload, payload_len);
+    payload_copy[payload_len] = '\0';
+
+    message->qos = handle->qos;
+    message->retained = 1;
+    message->dup = 0;
+    message->id = 0;
+    message->payload = payload_copy;
+    message->payloadlen = payload_len;
+
+    op->op = MQTT_PUBLISH;
+    op->topic = (const char*)topic_copy + 2;
+    op->encoded_topic = topic_copy;
+    op->message = message;
+    op->async = 1;
+    op->pub_callback = callback;
+    op->timeout = handle->command_timeout_ms * 2;
+    platform_timer_init(&op->timer);
+    platform_timer_countdown(&op->timer, op->timeout);
+
+    if (coalesce && op_queue_replace(handle, op, token))
+        return EVRYTHNG_SUCCESS;
+
+    /* asynchronous callers never wait for a free slot */
+    platform_timer_init(&now);
+    platform_timer_countdown(&now, 0);
+    if (op_queue_push(handle, op, &now, token))
+    {
+        platform_timer_deinit(&now);
+        platform_timer_deinit(&op->timer);
+        platform_free(op);
+        if (handle->store)
+        {
+            if (token)
+                *token = 0;
+            return store_put(handle, topic, topic_len, payload, payload_len, coalesce);
+        }
+        return EVRYTHNG_QUEUE_FULL;
+    }
+    platform_timer_deinit(&now);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+/* undoes what EvrythngConnect set up before it failed, so that it can be called again */
+static void connect_abort(evrythng_handle_t handle)
+{
+    if (handle->dispatch)
+    {
+        dispatch_stop(handle->dispatch);
+        handle->dispatch = 0;
+    }
+
+    if (handle->trust_store)
+    {
+        trust_store_release();
+        handle->trust_store = 0;
+    }
+}
+
+
+#define MQTT_CLIENTID_LEN 23
+static const char* clientid_charset = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+evrythng_return_t EvrythngConnect(evrythng_handle_t handle)
+{
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (!handle->initialized)
+    {
+        if (!handle->client_id)
+        {
+            int i;
+            handle->client_id = (char*)platform_malloc(MQTT_CLIENTID_LEN+1);
+            if (!handle->client_id)
+                return EVRYTHNG_MEMORY_ERROR;
+            memset(handle->client_id, 0, MQTT_CLIENTID_LEN+1);
+
+            for (i = 0; i < MQTT_CLIENTID_LEN; i++)
+                handle->client_id[i] = clientid_charset[platform_rand() % strlen(clientid_charset)];
+
+            handle->mqtt_conn_opts.clientID.cstring = handle->client_id;
+            debug("client ID: %s", handle->client_id);
+        }
+
+        if (handle->secure_connection && !(handle->trust_store = trust_store_acquire()))
+        {
+            debug("no shared trust store, certificates are parsed on every connect");
+        }
+
+        if (handle->callback_workers && dispatch_start(&handle->dispatch, handle->callback_workers, 
+                    handle->mqtt_thread_priority, handle->mqtt_thread_stacksize))
+        {
+            error("could not start callback workers");
+            connect_abort(handle);
+            return EVRYTHNG_FAILURE;
+        }
+
+        if (handle->engine && !(handle->engine_source = engine_add(handle->engine, engine_run, handle)))
+        {
+            error("could not join the engine");
+            connect_abort(handle);
+            return EVRYTHNG_MEMORY_ERROR;
+        }
+
+        if (!handle->poll_mode)
+            platform_thread_create(&handle->mqtt_thread, handle->mqtt_thread_priority, "mqtt_thread", mqtt_thread, handle->mqtt_thread_stacksize, (void*)handle);
+
+        handle->initialized = 1;
+    }
+
+    if (MQTTisConnected(&handle->mqtt_client))
+    {
+        warning("already connected");
+        return EVRYTHNG_SUCCESS;
+    }
+
+    return evrythng_async_op(handle, MQTT_CONNECT, 0, 0, 0);
+}
+
+typedef enum _mqtt_connection_status_t {
+    MQTT_CONNECTION_ACCEPTED = 0x00,
+    MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 0x01,
+    MQTT_IDENTIFIER_REJECTED = 0x02,
+    MQTT_SERVER_UNAVAILABLE = 0x03,
+    MQTT_BAD_USER_NAME_OR_PASSWORD = 0x04,
+    MQTT_NOT_AUTHORIZED = 0x05,
+} mqtt_connection_status_t;
+
+#define max(a,b) ((a)>(b)?(a):(b))
+
+int next_sleep_time(int retry_count) 
+{
+    //special case
+    if (retry_count == 0)
+        return 0;
+    /*
+     * base is 500 ms, min factor is 2 (1 sec);
+     * multiply base by a factor that is chosen 
+     * randomly within the increasing interval;
+     */
+    static const int base = 500;
+    static const int cap = 2;
+    /*
+     * adding 2 to the retry count to increase
+     * interval for random values faster;
+     */
+    int rand = platform_rand() % (1 << (retry_count + 2));
+    return base * max(cap, rand);
+}
+
+/* restores all subscriptions, packed into as few SUBSCRIBE packets as possible */
+static void resubscribe(evrythng_handle_t handle)
+{
+    sub_callback_t* _sub_callback;
+    int count = 0, i = 0;
+
+    for (_sub_callback = handle->sub_callbacks; _sub_callback; _sub_callback = _sub_callback->next)
+        count++;
+    if (!count)
+        return;
+
+    const char** topics = (const char**)platform_malloc(count * (sizeof(char*) + sizeof(enum QoS) + sizeof(int)));
+    if (!topics)
+    {
+        error("not enough memory to resubscribe to %d topics", count);
+        return;
+    }
+    enum QoS* qos = (enum QoS*)(topics + count);
+    int* granted = (int*)(qos + count);
+
+    for (_sub_callback = handle->sub_callbacks; _sub_callback; _sub_callback = _sub_callback->next, i++)
+    {
+        topics[i] = _sub_callback->topic;
+        qos[i] = (enum QoS)_sub_callback->qos;
+    }
+
+    int ret = MQTTSubscribeMany(&handle->mqtt_client, count, topics, qos, granted);
+    handle->session_stale = ret < 0;
+    if (ret < 0)
+    {
+        error("subscription failed, ret = %d", ret);
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (granted[i] == 0x80)
+            {
+                error("subscription to %s was refused", topics[i]);
+            }
+            else
+            {
+                debug("successfully subscribed to %s", topics[i]);
+            }
+        }
+    }
+
+    platform_free(topics);
+}
+
+
+static void tls_session_save(evrythng_handle_t handle)
+{
+    if (!handle->tls_session)
+        handle->tls_session = (unsigned char*)platform_malloc(TLS_SESSION_MAX_LEN);
+    if (!handle->tls_session)
+        return;
+
+    int len = platform_network_session_save(&handle->mqtt_network, handle->tls_session, TLS_SESSION_MAX_LEN);
+    handle->tls_session_len = len > 0 ? len : 0;
+    if (handle->tls_session_len)
+    {
+        debug("saved tls session of %d bytes", handle->tls_session_len);
+    }
+}
+
+
+evrythng_return_t evrythng_connect_internal(evrythng_handle_t handle, int attempts)
+{
+    int rc = EVRYTHNG_SUCCESS;
+
+    if (MQTTisConnected(&handle->mqtt_client)) {
+        warning("already connected");
+        return rc;
+    }
+
+    if (handle->secure_connection && handle->trust_store)
+        platform_network_securedinit_shared(&handle->mqtt_network, handle->trust_store);
+    else if (handle->secure_connection)
         platform_network_securedinit(&handle->mqtt_network, handle->ca_buf, handle->ca_size);
     else
         platform_network_init(&handle->mqtt_network);
 
-    for (int retry_count = 0; retry_count < 7; ++retry_count) {
+    for (int retry_count = 0; retry_count < attempts; ++retry_count) {
 
         int sleep_time = next_sleep_time(retry_count);
         debug("sleeping %d ms before trying to connect...\n", sleep_time);
         platform_sleep(sleep_time);
 
+        if (handle->secure_connection && handle->tls_session_len)
+            platform_network_session_resume(&handle->mqtt_network, handle->tls_session, handle->tls_session_len);
+
         debug("connecting to host: %s, port: %d (%d)...", handle->host, handle->port, retry_count);
-        if (platform_network_connect(&handle->mqtt_network, handle->host, handle->port)) {
+        if ((rc = platform_network_connect(&handle->mqtt_network, handle->host, handle->port))) {
             error("Failed to establish network connection");
+            /* 
+             * a session is only dropped if the handshake failed, a link
+             * that is down keeps it for when it comes back
+             */
+            if (rc == PLATFORM_TLS_REJECTED)
+                handle->tls_session_len = 0;
             rc = EVRYTHNG_CONNECTION_FAILED;
         } else {
             debug("network connection ok, establishing mqtt connection...");
@@ -593,106 +2247,620 @@ evrythng_return_t evrythng_connect_internal(evrythng_handle_t handle)
                 }
             } else {
                 debug("mqtt connection ok");
+                handle->connection_id++;
                 rc = EVRYTHNG_SUCCESS;
                 break;
             }
         }
 
-        platform_network_disconnect(&handle->mqtt_network);
+        platform_network_disconnect(&handle->mqtt_network);
+
+    }
+
+    if (!MQTTisConnected(&handle->mqtt_client)) {
+        return rc;
+    }
+
+    if (handle->mqtt_client.sessionPresent && !handle->session_stale)
+    {
+        debug("session restored, %d subscriptions kept by the broker", handle->sub_count);
+    }
+    else
+    {
+        resubscribe(handle);
+    }
+
+    return rc;
+}
+
+
+evrythng_return_t EvrythngDisconnect(evrythng_handle_t handle)
+{
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    agg_flush(handle, 1);
+
+    if (!handle->initialized)
+        return EVRYTHNG_SUCCESS;
+
+    if (!MQTTisConnected(&handle->mqtt_client))
+        return EVRYTHNG_SUCCESS;
+
+    return evrythng_async_op(handle, MQTT_DISCONNECT, 0, 0, 0);
+}
+
+
+evrythng_return_t evrythng_disconnect_internal(evrythng_handle_t handle, int gracefull)
+{
+    int rc;
+
+    if (!MQTTisConnected(&handle->mqtt_client))
+        return EVRYTHNG_SUCCESS;
+
+    if (gracefull)
+    {
+        /* a persistent session keeps the subscriptions for the next connection */
+        sub_callback_t* _sub_callback = handle->mqtt_conn_opts.cleansession ? handle->sub_callbacks : 0;
+        while (_sub_callback) 
+        {
+            rc = MQTTUnsubscribe(&handle->mqtt_client, _sub_callback->topic);
+            if (rc >= 0) 
+            {
+                debug("successfully unsubscribed from %s", _sub_callback->topic);
+            }
+            else 
+            {
+                warning("unsubscription failed, rc = %d", rc);
+                break;
+            }
+            _sub_callback = _sub_callback->next;
+        }
+
+        rc = MQTTDisconnect(&handle->mqtt_client);
+        if (rc != MQTT_SUCCESS)
+        {
+            error("failed to disconnect mqtt: rc = %d", rc);
+        }
+    }
+    else
+    {
+        handle->mqtt_client.isconnected = 0;
+        MQTTAbortInflight(&handle->mqtt_client);
+    }
+
+    if (handle->secure_connection)
+        tls_session_save(handle);
+
+    platform_network_disconnect(&handle->mqtt_network);
+
+    debug("MQTT disconnected");
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static evrythng_return_t build_pub_topic(
+        evrythng_handle_t handle, 
+        char* pub_topic,
+        const char* entity, 
+        const char* entity_id, 
+        const char* data_type, 
+        const char* data_name)
+{
+    int rc;
+
+    if (entity_id == NULL) 
+    {
+        rc = snprintf(pub_topic, TOPIC_MAX_LEN, "%s/%s", entity, data_name);
+        if (rc < 0 || rc >= TOPIC_MAX_LEN) 
+        {
+            error("Topic overflow");
+            return EVRYTHNG_BAD_ARGS;
+        }
+    } 
+    else if (data_name == NULL) 
+    {
+        rc = snprintf(pub_topic, TOPIC_MAX_LEN, "%s/%s/%s", entity, entity_id, data_type);
+        if (rc < 0 || rc >= TOPIC_MAX_LEN) 
+        {
+            error("topic overflow");
+            return EVRYTHNG_BAD_ARGS;
+        }
+    } 
+    else 
+    {
+        rc = snprintf(pub_topic, TOPIC_MAX_LEN, "%s/%s/%s/%s", entity, entity_id, data_type, data_name);
+        if (rc < 0 || rc >= TOPIC_MAX_LEN) 
+        {
+            error("topic overflow");
+            return EVRYTHNG_BAD_ARGS;
+        }
+    }
+
+    debug("publish topic: %s", pub_topic);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+/* single property updates can be coalesced, only their latest value matters */
+static int coalescing(evrythng_handle_t handle, const char* data_type, const char* data_name)
+{
+    return handle->coalesce && data_type && data_name && !strcmp(data_type, "properties");
+}
+
+
+/* 
+ * Copies the objects of a property update such as [{"value":1},{"value":2}]
+ * to out, adding "key":"<name>" to each of them so that they can be sent
+ * in a batch of several properties. With out a null pointer only measures.
+ * Returns the length of the result or -1 if json is not an array of objects.
+ */
+static int agg_convert(char* out, const char* name, const char* json)
+{
+    const char* p = json;
+    int len = 0, objects = 0;
+
+#define AGG_PUT(c) do { char put = (c); if (out) out[len] = put; len++; } while (0)
+#define AGG_SKIP_WS() while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++
+
+    AGG_SKIP_WS();
+    if (*p++ != '[')
+        return -1;
+
+    while (1)
+    {
+        AGG_SKIP_WS();
+        if (*p != '{')
+            return -1;
+
+        if (objects++)
+            AGG_PUT(',');
+        AGG_PUT(*p++);
+
+        const char* n;
+        const char* key = "\"key\":\"";
+        while (*key)
+            AGG_PUT(*key++);
+        for (n = name; *n; n++)
+        {
+            if (*n == '"' || *n == '\\')
+                AGG_PUT('\\');
+            AGG_PUT(*n);
+        }
+        AGG_PUT('"');
+
+        AGG_SKIP_WS();
+        if (*p != '}')
+            AGG_PUT(',');
+
+        /* copy the rest of the object, braces inside strings don't count */
+        int depth = 1, in_string = 0;
+        while (depth)
+        {
+            char c = *p++;
+            if (!c)
+                return -1;
+            AGG_PUT(c);
+            if (in_string)
+            {
+                if (c == '\\' && *p)
+                    AGG_PUT(*p++);
+                else if (c == '"')
+                    in_string = 0;
+            }
+            else if (c == '"')
+                in_string = 1;
+            else if (c == '{' || c == '[')
+                depth++;
+            else if (c == '}' || c == ']')
+                depth--;
+        }
+
+        AGG_SKIP_WS();
+        if (*p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (*p++ != ']')
+            return -1;
+        break;
+    }
+
+    AGG_SKIP_WS();
+#undef AGG_PUT
+#undef AGG_SKIP_WS
+
+    return *p ? -1 : len;
+}
+
+
+/* sends a batch taken out of the list, the same way as a single asynchronous publish without callback */
+static evrythng_return_t agg_send(evrythng_handle_t handle, agg_batch_t* b)
+{
+    evrythng_return_t rc;
+    int topic_len = strlen(b->topic);
+
+    b->json[b->len++] = ']';
+
+    if (store_wanted(handle, EVRYTHNG_RATE_PROPERTIES))
+        rc = store_put(handle, b->topic, topic_len, b->json, b->len, 0);
+    else if (MQTTisConnected(&handle->mqtt_client))
+    {
+        /* batches are not held back, later messages wait for them instead */
+        rate_charge(handle, EVRYTHNG_RATE_PROPERTIES);
+        rc = evrythng_async_pub(handle, b->topic, topic_len, b->json, b->len, 0, 0, 0);
+    }
+    else
+        rc = EVRYTHNG_NOT_CONNECTED;
+
+    if (rc != EVRYTHNG_SUCCESS)
+    {
+        error("dropping %d property updates to %s, rc = %d", b->count, b->topic, rc);
+    }
+
+    platform_timer_deinit(&b->timer);
+    platform_free(b->json);
+    platform_free(b);
+
+    return rc;
+}
+
+
+/* sends the batches which are due, or all of them */
+static void agg_flush(evrythng_handle_t handle, int all)
+{
+    agg_batch_t* due = 0;
+    agg_batch_t** pb;
+
+    platform_mutex_lock(&handle->agg_mtx);
+    for (pb = &handle->agg_batches; *pb; )
+    {
+        agg_batch_t* b = *pb;
+        if (all || platform_timer_isexpired(&b->timer))
+        {
+            *pb = b->next;
+            b->next = due;
+            due = b;
+        }
+        else
+        {
+            pb = &b->next;
+        }
+    }
+    platform_mutex_unlock(&handle->agg_mtx);
+
+    while (due)
+    {
+        agg_batch_t* next = due->next;
+        agg_send(handle, due);
+        due = next;
+    }
+}
+
+
+/* milliseconds until the next batch is due, -1 if there is none */
+static int agg_deadline(evrythng_handle_t handle)
+{
+    int timeout = -1;
+    agg_batch_t* b;
+
+    platform_mutex_lock(&handle->agg_mtx);
+    for (b = handle->agg_batches; b; b = b->next)
+    {
+        int left = platform_timer_left(&b->timer);
+        if (left <= 0)
+            left = 1;
+        if (timeout < 0 || left < timeout)
+            timeout = left;
+    }
+    platform_mutex_unlock(&handle->agg_mtx);
+
+    return timeout;
+}
+
+
+/* 
+ * Adds a single property update to the batch of its thng or product.
+ * Returns 1 if it was taken, 0 if it has to be published on its own.
+ */
+static int agg_add(
+        evrythng_handle_t handle, 
+        const char* entity, 
+        const char* entity_id, 
+        const char* data_name, 
+        const char* property_json,
+        evrythng_return_t* rc)
+{
+    char topic[TOPIC_MAX_LEN];
+    agg_batch_t* full = 0;
+    agg_batch_t* b;
+    int created = 0;
+
+    if (!handle->agg_window_ms || !entity_id || !data_name)
+        return 0;
 
-    }
+    int len = agg_convert(0, data_name, property_json);
+    if (len < 0 || len + 3 > AGG_MAX_JSON)
+        return 0;
 
-    if (!MQTTisConnected(&handle->mqtt_client)) {
-        return rc;
+    if (build_pub_topic(handle, topic, entity, entity_id, "properties", 0) != EVRYTHNG_SUCCESS)
+        return 0;
+
+    platform_mutex_lock(&handle->agg_mtx);
+
+    if (!handle->agg_window_ms)
+    {
+        platform_mutex_unlock(&handle->agg_mtx);
+        return 0;
     }
 
-    sub_callback_t* _sub_callback = handle->sub_callbacks;
-    while (_sub_callback) {
-        int ret = MQTTSubscribe(
-                &handle->mqtt_client, 
-                _sub_callback->topic, 
-                _sub_callback->qos);
-        if (ret >= 0) {
-            debug("successfully subscribed to %s", _sub_callback->topic);
-        } else {
-            error("subscription failed, ret = %d", ret);
+    agg_batch_t** pb;
+    for (pb = &handle->agg_batches; *pb; pb = &(*pb)->next)
+        if (!strcmp((*pb)->topic, topic))
             break;
+    b = *pb;
+
+    /* '[', a comma and ']' around the objects */
+    if (b && b->len + 1 + len + 1 > AGG_MAX_JSON)
+    {
+        *pb = b->next;
+        full = b;
+        b = 0;
+    }
+
+    if (!b)
+    {
+        b = (agg_batch_t*)platform_malloc(sizeof(agg_batch_t));
+        char* json = (char*)platform_malloc(AGG_MAX_JSON);
+        if (!b || !json)
+        {
+            platform_mutex_unlock(&handle->agg_mtx);
+            if (b) platform_free(b);
+            if (json) platform_free(json);
+            if (full)
+                agg_send(handle, full);
+            return 0;
         }
-        _sub_callback = _sub_callback->next;
+        memset(b, 0, sizeof(agg_batch_t));
+        strcpy(b->topic, topic);
+        b->json = json;
+        b->json[b->len++] = '[';
+        platform_timer_init(&b->timer);
+        platform_timer_countdown(&b->timer, handle->agg_window_ms);
+        b->next = handle->agg_batches;
+        handle->agg_batches = b;
+        created = 1;
     }
 
-    return rc;
+    if (b->count)
+        b->json[b->len++] = ',';
+    b->len += agg_convert(b->json + b->len, data_name, property_json);
+    b->count++;
+
+    if (handle->agg_max_count && b->count >= handle->agg_max_count)
+    {
+        for (pb = &handle->agg_batches; *pb != b; pb = &(*pb)->next)
+            ;
+        *pb = b->next;
+        created = 0;
+    }
+    else
+    {
+        b = 0;
+    }
+
+    platform_mutex_unlock(&handle->agg_mtx);
+
+    *rc = EVRYTHNG_SUCCESS;
+    if (full)
+        *rc = agg_send(handle, full);
+    if (b)
+        *rc = agg_send(handle, b);
+
+    /* mqtt_thread has to wake up when the new batch is due */
+    if (created)
+        handle_wakeup(handle);
+
+    return 1;
 }
 
 
-evrythng_return_t EvrythngDisconnect(evrythng_handle_t handle)
+evrythng_return_t evrythng_publish(
+        evrythng_handle_t handle, 
+        const char* entity, 
+        const char* entity_id, 
+        const char* data_type, 
+        const char* data_name, 
+        const char* property_json)
 {
-    if (!handle)
-        return EVRYTHNG_BAD_ARGS;
+    if (!handle) return EVRYTHNG_BAD_ARGS;
 
-    if (!handle->initialized)
-        return EVRYTHNG_SUCCESS;
+    if (!handle->store && !MQTTisConnected(&handle->mqtt_client)) 
+    {
+        error("%s: client is not connected", __func__);
+        return EVRYTHNG_NOT_CONNECTED;
+    }
 
-    if (!MQTTisConnected(&handle->mqtt_client))
-        return EVRYTHNG_SUCCESS;
+    char pub_topic[TOPIC_MAX_LEN];
 
-    return evrythng_async_op(handle, MQTT_DISCONNECT, 0, 0, 0);
+    evrythng_return_t rc;
+    if (data_type && !strcmp(data_type, "properties") && 
+            agg_add(handle, entity, entity_id, data_name, property_json, &rc))
+        return rc;
+
+    rc = build_pub_topic(handle, pub_topic, entity, entity_id, data_type, data_name);
+    if (rc != EVRYTHNG_SUCCESS)
+        return rc;
+
+    if (store_wanted(handle, rate_class(pub_topic)))
+        return store_put(handle, pub_topic, strlen(pub_topic), property_json, strlen(property_json), 
+                coalescing(handle, data_type, data_name));
+
+    rc = rate_admit(handle, pub_topic, rate_class(pub_topic), handle->rate_max_wait_ms);
+    if (rc != EVRYTHNG_SUCCESS)
+        return rc;
+
+    MQTTMessage msg = {
+        .qos = handle->qos, 
+        .retained = 1, 
+        .dup = 0,
+        .id = 0,
+        .payload = (void*)property_json,
+        .payloadlen = strlen(property_json)
+    };
+
+    return evrythng_async_op(handle, MQTT_PUBLISH, pub_topic, &msg, 0);
 }
 
 
-evrythng_return_t evrythng_disconnect_internal(evrythng_handle_t handle, int gracefull)
+evrythng_return_t evrythng_publish_async(
+        evrythng_handle_t handle, 
+        const char* entity, 
+        const char* entity_id, 
+        const char* data_type, 
+        const char* data_name, 
+        const char* property_json,
+        pub_callback *callback,
+        evrythng_token_t* token)
 {
-    int rc;
-
-    if (!MQTTisConnected(&handle->mqtt_client))
-        return EVRYTHNG_SUCCESS;
+    if (!handle) return EVRYTHNG_BAD_ARGS;
 
-    if (gracefull)
+    if (!handle->store && !MQTTisConnected(&handle->mqtt_client)) 
     {
-        sub_callback_t* _sub_callback = handle->sub_callbacks;
-        while (_sub_callback) 
-        {
-            rc = MQTTUnsubscribe(&handle->mqtt_client, _sub_callback->topic);
-            if (rc >= 0) 
-            {
-                debug("successfully unsubscribed from %s", _sub_callback->topic);
-            }
-            else 
-            {
-                warning("unsubscription failed, rc = %d", rc);
-                break;
-            }
-            _sub_callback = _sub_callback->next;
-        }
-
-        rc = MQTTDisconnect(&handle->mqtt_client);
-        if (rc != MQTT_SUCCESS)
-        {
-            error("failed to disconnect mqtt: rc = %d", rc);
-        }
+        error("%s: client is not connected", __func__);
+        return EVRYTHNG_NOT_CONNECTED;
     }
-    else
+
+    char pub_topic[TOPIC_MAX_LEN];
+
+    evrythng_return_t rc;
+    if (data_type && !strcmp(data_type, "properties") && 
+            agg_add(handle, entity, entity_id, data_name, property_json, &rc))
     {
-        handle->mqtt_client.isconnected = 0;
+        if (token)
+            *token = 0;
+        return rc;
     }
 
-    platform_network_disconnect(&handle->mqtt_network);
+    rc = build_pub_topic(handle, pub_topic, entity, entity_id, data_type, data_name);
+    if (rc != EVRYTHNG_SUCCESS)
+        return rc;
 
-    debug("MQTT disconnected");
+    if (store_wanted(handle, rate_class(pub_topic)))
+    {
+        if (token)
+            *token = 0;
+        return store_put(handle, pub_topic, strlen(pub_topic), property_json, strlen(property_json), 
+                coalescing(handle, data_type, data_name));
+    }
 
-    return EVRYTHNG_SUCCESS;
+    rc = rate_admit(handle, pub_topic, rate_class(pub_topic), 0);
+    if (rc != EVRYTHNG_SUCCESS)
+        return rc;
+
+    return evrythng_async_pub(handle, pub_topic, strlen(pub_topic), property_json, strlen(property_json), 
+            coalescing(handle, data_type, data_name), callback, token);
 }
 
 
-evrythng_return_t evrythng_publish(
+evrythng_return_t evrythng_prepare_publish(
         evrythng_handle_t handle, 
         const char* entity, 
         const char* entity_id, 
         const char* data_type, 
         const char* data_name, 
-        const char* property_json)
+        evrythng_pub_handle_t* pub)
 {
-    if (!handle) return EVRYTHNG_BAD_ARGS;
+    if (!handle || !pub) return EVRYTHNG_BAD_ARGS;
+
+    *pub = (evrythng_pub_handle_t)platform_malloc(sizeof(struct evrythng_pub_ctx_t));
+    if (!*pub)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    evrythng_return_t rc = build_pub_topic(handle, (char*)(*pub)->encoded_topic + 2, entity, entity_id, data_type, data_name);
+    if (rc != EVRYTHNG_SUCCESS)
+    {
+        platform_free(*pub);
+        *pub = 0;
+        return rc;
+    }
+
+    int topic_len = strlen((char*)(*pub)->encoded_topic + 2);
+    (*pub)->encoded_topic[0] = (unsigned char)(topic_len >> 8);
+    (*pub)->encoded_topic[1] = (unsigned char)topic_len;
+    (*pub)->handle = handle;
+    (*pub)->coalesce = data_type && data_name && !strcmp(data_type, "properties");
+    (*pub)->rate_class = rate_class((char*)(*pub)->encoded_topic + 2);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+evrythng_return_t EvrythngPublishPrepared(evrythng_pub_handle_t pub, const char* property_json, size_t length)
+{
+    if (!pub || !property_json || !length)
+        return EVRYTHNG_BAD_ARGS;
+
+    evrythng_handle_t handle = pub->handle;
+
+    if (store_wanted(handle, pub->rate_class))
+        return store_put(handle, (const char*)pub->encoded_topic + 2, 
+                (pub->encoded_topic[0] << 8) | pub->encoded_topic[1], property_json, length, 
+                handle->coalesce && pub->coalesce);
+
+    if (!MQTTisConnected(&handle->mqtt_client)) 
+    {
+        error("%s: client is not connected", __func__);
+        return EVRYTHNG_NOT_CONNECTED;
+    }
+
+    evrythng_return_t rc = rate_admit(handle, (const char*)pub->encoded_topic + 2, pub->rate_class, handle->rate_max_wait_ms);
+    if (rc != EVRYTHNG_SUCCESS)
+        return rc;
+
+    MQTTMessage msg = {
+        .qos = handle->qos, 
+        .retained = 1, 
+        .dup = 0,
+        .id = 0,
+        .payload = (void*)property_json,
+        .payloadlen = length
+    };
+
+    mqtt_op mop;
+    memset(&mop, 0, sizeof mop);
+    mop.op = MQTT_PUBLISH;
+    mop.topic = (const char*)pub->encoded_topic + 2;
+    mop.encoded_topic = pub->encoded_topic;
+    mop.message = &msg;
+
+    return evrythng_run_op(handle, &mop);
+}
+
+
+evrythng_return_t EvrythngPublishPreparedAsync(
+        evrythng_pub_handle_t pub, 
+        const char* property_json, 
+        size_t length, 
+        pub_callback *callback, 
+        evrythng_token_t* token)
+{
+    if (!pub || !property_json || !length)
+        return EVRYTHNG_BAD_ARGS;
+
+    evrythng_handle_t handle = pub->handle;
+    int topic_len = (pub->encoded_topic[0] << 8) | pub->encoded_topic[1];
+
+    if (store_wanted(handle, pub->rate_class))
+    {
+        if (token)
+            *token = 0;
+        return store_put(handle, (const char*)pub->encoded_topic + 2, topic_len, property_json, length, 
+                handle->coalesce && pub->coalesce);
+    }
 
     if (!MQTTisConnected(&handle->mqtt_client)) 
     {
@@ -700,101 +2868,194 @@ evrythng_return_t evrythng_publish(
         return EVRYTHNG_NOT_CONNECTED;
     }
 
+    evrythng_return_t rc = rate_admit(handle, (const char*)pub->encoded_topic + 2, pub->rate_class, 0);
+    if (rc != EVRYTHNG_SUCCESS)
+        return rc;
+
+    return evrythng_async_pub(handle, (const char*)pub->encoded_topic + 2, topic_len, property_json, length, 
+            handle->coalesce && pub->coalesce, callback, token);
+}
+
+
+void EvrythngReleasePublish(evrythng_pub_handle_t pub)
+{
+    if (pub) platform_free(pub);
+}
+
+
+static evrythng_return_t build_sub_topic(
+        evrythng_handle_t handle, 
+        char* sub_topic,
+        const char* entity, 
+        const char* entity_id, 
+        const char* data_type, 
+        const char* data_name, 
+        int pub_states)
+{
     int rc;
-    char pub_topic[TOPIC_MAX_LEN];
 
     if (entity_id == NULL) 
     {
-        rc = snprintf(pub_topic, TOPIC_MAX_LEN, "%s/%s", entity, data_name);
+        rc = snprintf(sub_topic, TOPIC_MAX_LEN, "%s/%s?pubStates=%d", entity, data_name, pub_states);
         if (rc < 0 || rc >= TOPIC_MAX_LEN) 
         {
-            error("Topic overflow");
+            debug("topic overflow");
             return EVRYTHNG_BAD_ARGS;
         }
     } 
     else if (data_name == NULL) 
     {
-        rc = snprintf(pub_topic, TOPIC_MAX_LEN, "%s/%s/%s", entity, entity_id, data_type);
+        rc = snprintf(sub_topic, TOPIC_MAX_LEN, "%s/%s/%s?pubStates=%d", entity, entity_id, data_type, pub_states);
         if (rc < 0 || rc >= TOPIC_MAX_LEN) 
         {
-            error("topic overflow");
+            debug("topic overflow");
             return EVRYTHNG_BAD_ARGS;
         }
     } 
     else 
     {
-        rc = snprintf(pub_topic, TOPIC_MAX_LEN, "%s/%s/%s/%s", entity, entity_id, data_type, data_name);
+        rc = snprintf(sub_topic, TOPIC_MAX_LEN, "%s/%s/%s/%s?pubStates=%d", entity, entity_id, data_type, data_name, pub_states);
         if (rc < 0 || rc >= TOPIC_MAX_LEN) 
         {
-            error("topic overflow");
+            debug("topic overflow");
             return EVRYTHNG_BAD_ARGS;
         }
     }
 
-    debug("publish topic: %s", pub_topic);
+    return EVRYTHNG_SUCCESS;
+}
 
-    MQTTMessage msg = {
-        .qos = handle->qos, 
-        .retained = 1, 
-        .dup = 0,
-        .id = 0,
-        .payload = (void*)property_json,
-        .payloadlen = strlen(property_json)
-    };
 
-    return evrythng_async_op(handle, MQTT_PUBLISH, pub_topic, &msg, 0);
+evrythng_return_t evrythng_subscribe(
+        evrythng_handle_t handle, 
+        const char* entity, 
+        const char* entity_id, 
+        const char* data_type, 
+        const char* data_name, 
+        int pub_states,
+        sub_callback *callback)
+{
+    if (!MQTTisConnected(&handle->mqtt_client)) 
+    {
+        error("%s: client is not connected", __func__);
+        return EVRYTHNG_NOT_CONNECTED;
+    }
+
+    int rc;
+    char sub_topic[TOPIC_MAX_LEN] = { 0 };
+
+    if ((rc = build_sub_topic(handle, sub_topic, entity, entity_id, data_type, data_name, pub_states)) != EVRYTHNG_SUCCESS)
+        return rc;
+
+    debug("subscribing to: %s", sub_topic);
+
+    return evrythng_async_op(handle, MQTT_SUBSCRIBE, sub_topic, 0, callback);
+}
+
+
+evrythng_return_t EvrythngSubscribeMany(evrythng_handle_t handle, evrythng_subscription_t* subs, int count)
+{
+    int i;
+
+    if (!handle || !subs || count <= 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!subs[i].entity || !subs[i].callback)
+            return EVRYTHNG_BAD_ARGS;
+        subs[i].result = EVRYTHNG_FAILURE;
+    }
+
+    if (!MQTTisConnected(&handle->mqtt_client)) 
+    {
+        error("%s: client is not connected", __func__);
+        return EVRYTHNG_NOT_CONNECTED;
+    }
+
+    char* topics = (char*)platform_malloc(count * TOPIC_MAX_LEN);
+    if (!topics)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    evrythng_return_t rc = EVRYTHNG_SUCCESS;
+    for (i = 0; i < count && rc == EVRYTHNG_SUCCESS; i++)
+    {
+        rc = build_sub_topic(handle, topics + i * TOPIC_MAX_LEN, 
+                subs[i].entity, subs[i].entity_id, subs[i].data_type, subs[i].data_name, subs[i].pub_states);
+        subs[i].result = rc;
+    }
+
+    if (rc == EVRYTHNG_SUCCESS)
+    {
+        mqtt_op mop;
+
+        debug("subscribing to %d topics", count);
+
+        memset(&mop, 0, sizeof mop);
+        mop.op = MQTT_SUBSCRIBE_MANY;
+        mop.topic = topics;
+        mop.subs = subs;
+        mop.count = count;
+        rc = evrythng_run_op(handle, &mop);
+    }
+
+    platform_free(topics);
+
+    return rc;
 }
 
 
-evrythng_return_t evrythng_subscribe(
-        evrythng_handle_t handle, 
-        const char* entity, 
-        const char* entity_id, 
-        const char* data_type, 
-        const char* data_name, 
-        int pub_states,
-        sub_callback *callback)
+/* 
+ * Executed by mqtt_thread for EvrythngSubscribeMany. topics holds count 
+ * strings of TOPIC_MAX_LEN, *mqtt_rc receives the MQTT client return code.
+ */
+static evrythng_return_t subscribe_many(evrythng_handle_t handle, evrythng_subscription_t* subs, const char* topics, int count, int* mqtt_rc)
 {
-    if (!MQTTisConnected(&handle->mqtt_client)) 
-    {
-        error("%s: client is not connected", __func__);
-        return EVRYTHNG_NOT_CONNECTED;
-    }
+    evrythng_return_t result = EVRYTHNG_SUCCESS;
+    int i, n = 0;
 
-    int rc;
-    char sub_topic[TOPIC_MAX_LEN] = { 0 };
+    *mqtt_rc = MQTT_SUCCESS;
 
-    if (entity_id == NULL) 
-    {
-        rc = snprintf(sub_topic, TOPIC_MAX_LEN, "%s/%s?pubStates=%d", entity, data_name, pub_states);
-        if (rc < 0 || rc >= TOPIC_MAX_LEN) 
-        {
-            debug("topic overflow");
-            return EVRYTHNG_BAD_ARGS;
-        }
-    } 
-    else if (data_name == NULL) 
+    const char** filters = (const char**)platform_malloc(count * (sizeof(char*) + sizeof(enum QoS) + 2 * sizeof(int)));
+    if (!filters)
+        return EVRYTHNG_MEMORY_ERROR;
+    enum QoS* qos = (enum QoS*)(filters + count);
+    int* granted = (int*)(qos + count);
+    int* index = granted + count;
+
+    for (i = 0; i < count; i++)
     {
-        rc = snprintf(sub_topic, TOPIC_MAX_LEN, "%s/%s/%s?pubStates=%d", entity, entity_id, data_type, pub_states);
-        if (rc < 0 || rc >= TOPIC_MAX_LEN) 
+        const char* topic = topics + i * TOPIC_MAX_LEN;
+        subs[i].result = add_sub_callback(handle, topic, handle->qos, subs[i].callback);
+        if (subs[i].result != EVRYTHNG_SUCCESS)
         {
-            debug("topic overflow");
-            return EVRYTHNG_BAD_ARGS;
+            error("could not add sub topic %s: %d", topic, subs[i].result);
+            result = EVRYTHNG_SUBSCRIPTION_ERROR;
+            continue;
         }
-    } 
-    else 
+        filters[n] = topic;
+        qos[n] = (enum QoS)handle->qos;
+        index[n] = i;
+        n++;
+    }
+
+    if (n > 0)
+        *mqtt_rc = MQTTSubscribeMany(&handle->mqtt_client, n, filters, qos, granted);
+
+    for (i = 0; i < n; i++)
     {
-        rc = snprintf(sub_topic, TOPIC_MAX_LEN, "%s/%s/%s/%s?pubStates=%d", entity, entity_id, data_type, data_name, pub_states);
-        if (rc < 0 || rc >= TOPIC_MAX_LEN) 
+        if (*mqtt_rc < 0 || granted[i] == 0x80)
         {
-            debug("topic overflow");
-            return EVRYTHNG_BAD_ARGS;
+            debug("subscription to %s failed: %d", filters[i], *mqtt_rc < 0 ? *mqtt_rc : granted[i]);
+            subs[index[i]].result = EVRYTHNG_SUBSCRIPTION_ERROR;
+            result = EVRYTHNG_SUBSCRIPTION_ERROR;
+            rm_sub_callback(handle, filters[i], 0);
         }
     }
 
-    debug("subscribing to: %s", sub_topic);
+    platform_free(filters);
 
-    return evrythng_async_op(handle, MQTT_SUBSCRIBE, sub_topic, 0, callback);
+    return result;
 }
 
 
@@ -846,134 +3107,529 @@ evrythng_return_t evrythng_unsubscribe(
 }
 
 
-static void mqtt_thread(void* arg)
+/* tells the application that the connection was lost, after dropping what is left of it */
+static void mqtt_connection_lost(evrythng_handle_t handle)
+{
+    warning("mqtt server connection lost");
+    evrythng_disconnect_internal(handle, 0);
+
+    if (handle->on_connection_lost)
+        (*handle->on_connection_lost)();
+}
+
+
+static void mqtt_connection_restored(evrythng_handle_t handle)
+{
+    handle->mqtt_rc = MQTT_SUCCESS;
+    handle->reconnects++;
+    if (handle->on_connection_restored)
+        (*handle->on_connection_restored)();
+}
+
+
+static int mqtt_reconnect(evrythng_handle_t handle);
+static int mqtt_run_op(evrythng_handle_t handle, mqtt_op* op);
+
+
+/* runs on a connect worker while the loop thread leaves the handle alone */
+static void offload_job(void* ctx)
+{
+    evrythng_handle_t handle = (evrythng_handle_t)ctx;
+    mqtt_op* op;
+
+    platform_mutex_lock(&handle->poll_mtx);
+
+    op = handle->offload_op;
+    handle->offload_op = 0;
+    if (op)
+        handle->mqtt_rc = mqtt_run_op(handle, op);
+    else
+        mqtt_reconnect(handle);
+    handle->offloaded = 0;
+
+    platform_mutex_unlock(&handle->poll_mtx);
+}
+
+
+/* 
+ * A loop thread of an engine serves other handles too, so a step which
+ * waits for the broker, a connect or a reconnect attempt with its
+ * resubscribe, a graceful disconnect or a subscribe to many topics, is
+ * handed to a connect worker of the engine. Returns 1 if it was, the
+ * step is then taken again by offload_job.
+ */
+static int offload(evrythng_handle_t handle, mqtt_op* op)
+{
+    if (!handle->engine_source || handle->offloaded)
+        return 0;
+
+    handle->offloaded = 1;
+    handle->offload_op = op;
+    engine_offload(handle->engine_source, offload_job);
+
+    return 1;
+}
+
+
+/* executes an op taken from the queue, returns the result of the mqtt client */
+static int mqtt_run_op(evrythng_handle_t handle, mqtt_op* op)
 {
     char actual_topic[TOPIC_MAX_LEN];
+    evrythng_return_t result;
     int rc = MQTT_SUCCESS;
 
+    switch (op->op)
+    {
+        case MQTT_CONNECT:
+            if (offload(handle, op))
+                return rc;
+            /* the connect workers of an engine serve other handles too, they don't sleep between attempts */
+            result = evrythng_connect_internal(handle, handle->engine ? 1 : CONNECT_ATTEMPTS);
+            break;
+
+        case MQTT_DISCONNECT:
+            if (offload(handle, op))
+                return rc;
+            result = evrythng_disconnect_internal(handle, 1);
+            break;
+
+        case MQTT_PUBLISH:
+            if (op->async && platform_timer_isexpired(&op->timer))
+            {
+                warning("dropping expired publish to %s", op->topic);
+                handle->expired++;
+                result = EVRYTHNG_TIMEOUT;
+                break;
+            }
+            if (op->encoded_topic)
+                rc = MQTTPublishEncodedAsync(&handle->mqtt_client, 
+                        op->encoded_topic,
+                        op->message,
+                        op);
+            else
+                rc = MQTTPublishAsync(&handle->mqtt_client, 
+                        op->topic,
+                        op->message,
+                        op);
+            if (rc == MQTT_SUCCESS) 
+            {
+                debug("published message: %.*s", (int)op->message->payloadlen, (char*)op->message->payload);
+                result = EVRYTHNG_SUCCESS;
+                /* QoS1/QoS2 messages complete in publish_callback once acknowledged */
+                if (op->message->qos != QOS0)
+                {
+                    op_sent(handle, op);
+                    return rc;
+                }
+            }
+            else 
+            {
+                error("could not publish message, rc = %d", rc);
+                result = EVRYTHNG_PUBLISH_ERROR;
+            }
+            break;
+
+        case MQTT_SUBSCRIBE:
+            rc = add_sub_callback(handle, op->topic, 
+                    handle->qos, op->callback);
+
+            if (rc != EVRYTHNG_SUCCESS)
+            {
+                error("could not add sub topic: %d", rc);
+                result = rc;
+            }
+            else
+            {
+                /* completes in request_callback once the suback arrived */
+                rc = MQTTSubscribeAsync(&handle->mqtt_client, 
+                        op->topic, 
+                        handle->qos,
+                        op);
+                if (rc == MQTT_SUCCESS) 
+                {
+                    op_sent(handle, op);
+                    return rc;
+                }
+                debug("subscription failed: %d", rc);
+                result = EVRYTHNG_SUBSCRIPTION_ERROR;
+                rm_sub_callback(handle, op->topic, 0);
+            }
+            break;
+
+        case MQTT_SUBSCRIBE_MANY:
+            if (offload(handle, op))
+                return rc;
+            result = subscribe_many(handle, op->subs, op->topic, op->count, &rc);
+            break;
+
+        case MQTT_UNSUBSCRIBE:
+            rc = rm_sub_callback(handle, op->topic, actual_topic);
+            if (rc != EVRYTHNG_SUCCESS)
+            {
+                debug("could not remove callback for topic: %s", op->topic);
+                result = rc;
+            }
+            else
+            {
+                /* completes in request_callback once the unsuback arrived */
+                rc = MQTTUnsubscribeAsync(&handle->mqtt_client, actual_topic, op);
+                if (rc == MQTT_SUCCESS) 
+                {
+                    op_sent(handle, op);
+                    return rc;
+                }
+                result = EVRYTHNG_UNSUBSCRIPTION_ERROR;
+            }
+            break;
+
+        default:
+            result = EVRYTHNG_BAD_ARGS;
+            break;
+    }
+
+    op_complete(handle, op, result);
+
+    return rc;
+}
+
+
+/* 
+ * Everything the engine does short of waiting: completes acknowledged ops,
+ * sends stored and aggregated messages and runs the next queued op.
+ * Returns 1 if it should be called again right away, 0 if it is time to
+ * wait for the network.
+ */
+static int mqtt_turn(evrythng_handle_t handle)
+{
+    complete_acked_ops(handle);
+
+    /* queued actions get the next free inflight slot before stored messages do */
+    mqtt_op* op = 0;
+    if (MQTTInflightAvailable(&handle->mqtt_client) > 0 && op_queue_urgent(handle))
+        op = op_queue_pop(handle);
+
+    if (handle->store)
+    {
+        if (!op && MQTTisConnected(&handle->mqtt_client))
+        {
+            handle->mqtt_rc = store_drain(handle);
+            if (handle->mqtt_rc == MQTT_CONNECTION_LOST)
+                return 1;
+        }
+        store_flush(handle);
+    }
+
+    agg_flush(handle, 0);
+
+    /* while the inflight window is full new ops stay queued until acks arrive */
+    if (!op && MQTTInflightAvailable(&handle->mqtt_client) > 0)
+        op = op_queue_pop(handle);
+    if (!op)
+        return 0;
+
+    handle->mqtt_rc = mqtt_run_op(handle, op);
+
+    return 1;
+}
+
+
+/* 
+ * milliseconds until it is time to send a keepalive, give up waiting for 
+ * an ack, take care of the store or aggregated updates or try to 
+ * reconnect, -1 for no limit
+ */
+static int mqtt_deadline(evrythng_handle_t handle)
+{
+    int timeout = MQTTNextDeadline(&handle->mqtt_client);
+    int store_timeout = store_deadline(handle);
+    if (timeout < 0 || (store_timeout >= 0 && store_timeout < timeout))
+        timeout = store_timeout;
+    int agg_timeout = agg_deadline(handle);
+    if (timeout < 0 || (agg_timeout >= 0 && agg_timeout < timeout))
+        timeout = agg_timeout;
+    if (handle->reconnecting)
+    {
+        int reconnect_timeout = platform_timer_left(&handle->reconnect_timer);
+        if (timeout < 0 || reconnect_timeout < timeout)
+            timeout = reconnect_timeout;
+    }
+
+    return timeout;
+}
+
+
+/* disconnects and fails the ops still queued, the engine is not driven any more */
+static void mqtt_shutdown(evrythng_handle_t handle)
+{
+    evrythng_disconnect_internal(handle, 1);
+    complete_acked_ops(handle);
+
+    mqtt_op* op;
+    while ((op = op_queue_pop(handle)) != 0)
+        op_complete(handle, op, EVRYTHNG_NOT_CONNECTED);
+}
+
+
+/* 
+ * A single reconnect attempt per call, with the pauses between attempts
+ * left to whoever drives the engine, so that it stays responsive while
+ * offline. Returns 1 once connected again.
+ */
+static int mqtt_reconnect(evrythng_handle_t handle)
+{
+    if (!handle->reconnecting)
+    {
+        mqtt_connection_lost(handle);
+        handle->reconnecting = 1;
+        handle->reconnect_attempt = 0;
+        platform_timer_countdown(&handle->reconnect_timer, 0);
+    }
+
+    if (!platform_timer_isexpired(&handle->reconnect_timer))
+        return 0;
+
+    if (offload(handle, 0))
+        return 0;
+
+    if (evrythng_connect_internal(handle, 1) != EVRYTHNG_SUCCESS)
+    {
+        /* 
+         * The first attempt is made right away, the ops the mqtt client
+         * gave up on don't wait for the connection to come back after it.
+         */
+        complete_acked_ops(handle);
+        store_flush(handle);
+        handle->reconnect_attempt = (handle->reconnect_attempt + 1) % CONNECT_ATTEMPTS;
+        if (!handle->reconnect_attempt)
+            platform_printf("could not connect, retrying\n");
+        platform_timer_countdown(&handle->reconnect_timer, 
+                handle->reconnect_attempt ? next_sleep_time(handle->reconnect_attempt) : 1000);
+        return 0;
+    }
+
+    handle->reconnecting = 0;
+    mqtt_connection_restored(handle);
+
+    return 1;
+}
+
+
+static void mqtt_thread(void* arg)
+{
     evrythng_handle_t handle = (evrythng_handle_t)arg;
 
     while (!handle->mqtt_thread_stop)
     {
-        if (rc == MQTT_CONNECTION_LOST)
+        if ((handle->mqtt_rc == MQTT_CONNECTION_LOST || handle->reconnecting) && !mqtt_reconnect(handle))
         {
-            warning("mqtt server connection lost");
-            evrythng_disconnect_internal(handle, 0);
+            /* offline until the next attempt, EvrythngDestroyHandle wakes it up early */
+            platform_network_wait(&handle->mqtt_network, &handle->op_ready_event, 
+                    platform_timer_left(&handle->reconnect_timer));
+            continue;
+        }
 
-            if (handle->on_connection_lost)
-                (*handle->on_connection_lost)();
+        if (mqtt_turn(handle))
+            continue;
 
-            while (!handle->mqtt_thread_stop)
+        /* 
+         * sleep until there is something to read, a new op was queued
+         * or it is time to send a keepalive or give up waiting for an ack
+         */
+        int timeout = mqtt_deadline(handle);
+        if (timeout < 0)
+            timeout = 0x00FFFFFF;
+
+        /* packets read ahead along with an earlier one don't make the network readable */
+        int readable = MQTTPendingInput(&handle->mqtt_client);
+        if (!readable)
+        {
+            /* nothing left to do right now, write the packets held back while busy */
+            if (MQTTFlush(&handle->mqtt_client) != MQTT_SUCCESS)
             {
-                if (evrythng_connect_internal(handle) != EVRYTHNG_SUCCESS)
-                {
-                    platform_printf("could not connect, retrying\n");
-                    platform_sleep(1000);
-                    continue;
-                }
-                
-                if (handle->on_connection_restored)
-                    (*handle->on_connection_restored)();
-                break;
+                handle->mqtt_rc = MQTT_CONNECTION_LOST;
+                continue;
             }
+            readable = platform_network_wait(&handle->mqtt_network, &handle->op_ready_event, timeout);
         }
+        if (readable < 0 && MQTTisConnected(&handle->mqtt_client))
+            handle->mqtt_rc = MQTT_CONNECTION_LOST;
+        else
+            handle->mqtt_rc = MQTTProcess(&handle->mqtt_client, readable > 0);
+    }
+
+    mqtt_shutdown(handle);
+}
+
+
+/* 
+ * Poll mode: does everything that is due without waiting. readable is 
+ * positive if the network may have data, negative if waiting for it failed.
+ * Called with poll_mtx held.
+ */
+static void mqtt_poll(evrythng_handle_t handle, int readable)
+{
+    if (readable < 0 && MQTTisConnected(&handle->mqtt_client))
+        handle->mqtt_rc = MQTT_CONNECTION_LOST;
 
-        if (platform_semaphore_wait(&handle->next_op_ready_sem, 0))
+    while (1)
+    {
+        /* the rest waits until the connect worker is done */
+        if (handle->offloaded)
+            return;
+
+        if ((handle->mqtt_rc == MQTT_CONNECTION_LOST || handle->reconnecting) && !mqtt_reconnect(handle))
+            return;
+
+        if (mqtt_turn(handle))
+            continue;
+
+        if (readable > 0 || MQTTPendingInput(&handle->mqtt_client))
         {
-            rc = MQTTYield(&handle->mqtt_client, 300);
-            platform_sleep(100);
+            /* read until nothing is left, an edge triggered loop is not told again */
+            handle->mqtt_rc = MQTTProcess(&handle->mqtt_client, 1);
+            readable = handle->mqtt_rc > 0;
             continue;
         }
 
-        platform_mutex_lock(&handle->next_op_mtx);
+        handle->mqtt_rc = MQTTProcess(&handle->mqtt_client, 0);
+        if (handle->mqtt_rc != MQTT_CONNECTION_LOST && MQTTFlush(&handle->mqtt_client) != MQTT_SUCCESS)
+            handle->mqtt_rc = MQTT_CONNECTION_LOST;
 
-        switch (handle->next_op.op)
-        {
-            case MQTT_CONNECT:
-                handle->next_op.result = evrythng_connect_internal(handle);
-                break;
+        /* acks given up on have ops to complete */
+        if (handle->mqtt_rc != MQTT_CONNECTION_LOST && !handle->done_ops)
+            return;
+    }
+}
 
-            case MQTT_DISCONNECT:
-                handle->next_op.result = evrythng_disconnect_internal(handle, 1);
-                break;
 
-            case MQTT_PUBLISH:
-                rc = MQTTPublish(&handle->mqtt_client, 
-                        handle->next_op.topic,
-                        handle->next_op.message);
-                if (rc == MQTT_SUCCESS) 
-                {
-                    debug("published message: %s", handle->next_op.message->payload);
-                    handle->next_op.result = EVRYTHNG_SUCCESS;
-                }
-                else 
-                {
-                    error("could not publish message, rc = %d", rc);
-                    handle->next_op.result = EVRYTHNG_PUBLISH_ERROR;
-                }
-                break;
+/* 
+ * Run by a loop thread of the engine the handle was added to, does what
+ * EvrythngProcess does and reports what EvrythngGetPollState reports.
+ */
+static int engine_run(void* ctx, int readable, int* fd, unsigned int* conn)
+{
+    evrythng_handle_t handle = (evrythng_handle_t)ctx;
+    int timeout;
 
-            case MQTT_SUBSCRIBE:
-                rc = add_sub_callback(handle, handle->next_op.topic, 
-                        handle->qos, handle->next_op.callback);
+    platform_mutex_lock(&handle->poll_mtx);
 
-                if (rc != EVRYTHNG_SUCCESS)
-                {
-                    error("could not add sub topic: %d", rc);
-                    handle->next_op.result = rc;
-                }
-                else
-                {
-                    rc = MQTTSubscribe(&handle->mqtt_client, 
-                            handle->next_op.topic, 
-                            handle->qos);
-                    if (rc >= 0) 
-                    {
-                        debug("successfully subscribed to %s, return code %d", handle->next_op.topic, rc);
-                        handle->next_op.result = EVRYTHNG_SUCCESS;
-                    }
-                    else
-                    {
-                        debug("subscription failed: %d", rc);
-                        handle->next_op.result = EVRYTHNG_SUBSCRIPTION_ERROR;
-                        rm_sub_callback(handle, handle->next_op.topic, 0);
-                    }
-                }
-                break;
+    mqtt_poll(handle, readable);
 
-            case MQTT_UNSUBSCRIBE:
-                rc = rm_sub_callback(handle, handle->next_op.topic, actual_topic);
-                if (rc != EVRYTHNG_SUCCESS)
-                {
-                    debug("could not remove callback for topic: %s", handle->next_op.topic);
-                    handle->next_op.result = rc;
-                }
-                else
-                {
-                    rc = MQTTUnsubscribe(&handle->mqtt_client, actual_topic);
-                    if (rc >= 0) 
-                    {
-                        debug("successfully unsubscribed from %s", actual_topic);
-                        handle->next_op.result = EVRYTHNG_SUCCESS;
-                    }
-                    else
-                    {
-                        handle->next_op.result = EVRYTHNG_UNSUBSCRIPTION_ERROR;
-                    }
-                }
-                break;
+    *fd = -1;
+    if (MQTTisConnected(&handle->mqtt_client))
+        *fd = platform_network_fd(&handle->mqtt_network);
+    *conn = handle->connection_id;
+
+    timeout = mqtt_deadline(handle);
+    if (MQTTPendingInput(&handle->mqtt_client))
+        timeout = 0;
+
+    platform_mutex_unlock(&handle->poll_mtx);
+
+    return timeout;
+}
+
+
+/* 
+ * Without mqtt_thread a blocking call drives the engine itself until its
+ * op is done, taking turns with EvrythngProcess called by other threads.
+ * Whichever of them reads the answer completes the op. Returns what
+ * op_settle returns.
+ */
+static int poll_run_op(evrythng_handle_t handle, mqtt_op* op, evrythng_return_t* rc)
+{
+    Timer now;
+    int queued = 0, fate = 0, readable = 0;
+
+    platform_timer_init(&now);
+    platform_timer_countdown(&now, 0);
+    platform_event_init(&op->done_event);
+    op->poll_wait = 1;
+
+    while (1)
+    {
+        /* a full queue is emptied by the engine below */
+        if (!queued)
+            queued = !op_queue_push(handle, op, &now, 0);
 
-            default:
-                handle->next_op.result = EVRYTHNG_BAD_ARGS;
+        platform_mutex_lock(&handle->poll_mtx);
+        mqtt_poll(handle, readable);
+        int timeout = mqtt_deadline(handle);
+        platform_mutex_unlock(&handle->poll_mtx);
+
+        if (queued)
+        {
+            if ((fate = op_settle(handle, op, rc)) >= 0)
                 break;
         }
+        else if (platform_timer_isexpired(&op->timer))
+        {
+            *rc = EVRYTHNG_TIMEOUT;
+            break;
+        }
 
-        platform_semaphore_post(&handle->next_op_result_sem);
+        int left = platform_timer_left(&op->timer);
+        if (left > 0 && (timeout < 0 || left < timeout))
+            timeout = left;
+        if (timeout < 0)
+            timeout = 0x00FFFFFF;
 
-        platform_mutex_unlock(&handle->next_op_mtx);
+        readable = platform_network_wait(&handle->mqtt_network, &op->done_event, timeout);
     }
 
-    evrythng_disconnect_internal(handle, 1);
+    platform_timer_deinit(&now);
+
+    return fate;
+}
+
+
+evrythng_return_t EvrythngGetPollState(evrythng_handle_t handle, evrythng_poll_t* state)
+{
+    if (!handle || !state)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (!handle->poll_mode || handle->engine)
+        return EVRYTHNG_FAILURE;
+
+    platform_mutex_lock(&handle->poll_mtx);
+
+    state->fd = -1;
+    state->events = 0;
+    if (MQTTisConnected(&handle->mqtt_client))
+    {
+        /* writes wait for the socket themselves, bounded by the command timeout */
+        state->fd = platform_network_fd(&handle->mqtt_network);
+        state->events = EVRYTHNG_POLL_READ;
+    }
+    state->wakeup_fd = platform_event_fd(&handle->op_ready_event);
+
+    state->timeout_ms = mqtt_deadline(handle);
+    if (MQTTPendingInput(&handle->mqtt_client))
+        state->timeout_ms = 0;
+
+    platform_mutex_unlock(&handle->poll_mtx);
+
+    return EVRYTHNG_SUCCESS;
 }
 
 
+evrythng_return_t EvrythngProcess(evrythng_handle_t handle, int events)
+{
+    if (!handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (!handle->poll_mode || handle->engine || !handle->initialized)
+        return EVRYTHNG_FAILURE;
+
+    platform_mutex_lock(&handle->poll_mtx);
+
+    /* also clears the wakeup event, work queued from now on sets it again */
+    int readable = platform_network_wait(&handle->mqtt_network, &handle->op_ready_event, 0);
+    if (readable == 0 && (events & EVRYTHNG_POLL_READ))
+        readable = 1;
+    mqtt_poll(handle, readable);
+
+    platform_mutex_unlock(&handle->poll_mtx);
+
+    return EVRYTHNG_SUCCESS;
+}
@@ -0,0 +1,216 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/platform.h"
+#include "evrythng_dispatch.h"
+#include "evrythng_stats.h"
+
+/* messages a worker may fall behind before mqtt_thread waits for it */
+#define DISPATCH_QUEUE_MAX 64
+/* how long an idle worker sleeps before it checks whether it has to stop */
+#define DISPATCH_IDLE_MS 1000
+/* restart value of the timers measuring how long a callback takes */
+#define DISPATCH_CLOCK_MS 0x3FFFFFFF
+
+/* a copy of a received message, owned by the worker it was posted to */
+typedef struct dispatch_msg_t
+{
+    struct dispatch_msg_t*  next;
+    sub_callback*           callback;
+    int                     len;
+    char                    payload[1];
+} dispatch_msg_t;
+
+typedef struct dispatch_worker_t
+{
+    Thread          thread;
+    Mutex           mtx;
+    Semaphore       ready_sem;  /* posted when a message is queued or the worker has to stop */
+    Semaphore       room_sem;   /* posted when a full queue is no longer full */
+    dispatch_msg_t* first;
+    dispatch_msg_t** tail;
+    int             count;
+    int             stop;
+    Timer           clock;
+    evrythng_histogram_t callback_duration;
+} dispatch_worker_t;
+
+struct evrythng_dispatch_t
+{
+    int                 workers;
+    dispatch_worker_t   worker[1];
+};
+
+
+static void dispatch_thread(void* arg)
+{
+    dispatch_worker_t* w = (dispatch_worker_t*)arg;
+
+    while (1)
+    {
+        dispatch_msg_t* msg;
+        int stop, full = 0;
+
+        platform_mutex_lock(&w->mtx);
+        msg = w->first;
+        if (msg)
+        {
+            w->first = msg->next;
+            if (!w->first)
+                w->tail = &w->first;
+            full = w->count-- == DISPATCH_QUEUE_MAX;
+        }
+        stop = w->stop;
+        platform_mutex_unlock(&w->mtx);
+
+        if (!msg)
+        {
+            /* messages posted before stop was set are still handled */
+            if (stop)
+                break;
+            platform_semaphore_wait(&w->ready_sem, DISPATCH_IDLE_MS);
+            continue;
+        }
+
+        if (full)
+            platform_semaphore_post(&w->room_sem);
+
+        platform_timer_countdown(&w->clock, DISPATCH_CLOCK_MS);
+        (*msg->callback)(msg->payload, msg->len);
+        histogram_record(&w->callback_duration, DISPATCH_CLOCK_MS - platform_timer_left(&w->clock));
+        platform_free(msg);
+    }
+}
+
+
+int dispatch_start(evrythng_dispatch_t** dispatch, int workers, int priority, size_t stacksize)
+{
+    evrythng_dispatch_t* d;
+    int i;
+
+    d = (evrythng_dispatch_t*)platform_malloc(sizeof(evrythng_dispatch_t) + (workers - 1) * sizeof(dispatch_worker_t));
+    if (!d)
+        return -1;
+    memset(d, 0, sizeof(evrythng_dispatch_t) + (workers - 1) * sizeof(dispatch_worker_t));
+    d->workers = workers;
+
+    for (i = 0; i < workers; i++)
+    {
+        dispatch_worker_t* w = &d->worker[i];
+
+        platform_mutex_init(&w->mtx);
+        platform_semaphore_init(&w->ready_sem);
+        platform_semaphore_init(&w->room_sem);
+        platform_timer_init(&w->clock);
+        w->tail = &w->first;
+
+        if (platform_thread_create(&w->thread, priority, "dispatch_thread", dispatch_thread, stacksize, (void*)w))
+        {
+            platform_timer_deinit(&w->clock);
+            platform_semaphore_deinit(&w->room_sem);
+            platform_semaphore_deinit(&w->ready_sem);
+            platform_mutex_deinit(&w->mtx);
+            d->workers = i;
+            dispatch_stop(d);
+            return -1;
+        }
+    }
+
+    *dispatch = d;
+
+    return 0;
+}
+
+
+void dispatch_stop(evrythng_dispatch_t* dispatch)
+{
+    int i;
+
+    for (i = 0; i < dispatch->workers; i++)
+    {
+        dispatch_worker_t* w = &dispatch->worker[i];
+
+        platform_mutex_lock(&w->mtx);
+        w->stop = 1;
+        platform_mutex_unlock(&w->mtx);
+        platform_semaphore_post(&w->ready_sem);
+    }
+
+    for (i = 0; i < dispatch->workers; i++)
+    {
+        dispatch_worker_t* w = &dispatch->worker[i];
+
+        platform_thread_join(&w->thread, 0x00FFFFFF);
+        platform_thread_destroy(&w->thread);
+        platform_timer_deinit(&w->clock);
+        platform_semaphore_deinit(&w->room_sem);
+        platform_semaphore_deinit(&w->ready_sem);
+        platform_mutex_deinit(&w->mtx);
+    }
+
+    platform_free(dispatch);
+}
+
+
+int dispatch_post(evrythng_dispatch_t* dispatch, sub_callback* callback, const char* topic, int topic_len, const char* payload, int payload_len, int wait)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+
+    /* FNV-1a, the same topic always goes to the same worker */
+    for (i = 0; i < topic_len; i++)
+        hash = (hash ^ (unsigned char)topic[i]) * 16777619u;
+    dispatch_worker_t* w = &dispatch->worker[hash % dispatch->workers];
+
+    dispatch_msg_t* msg = (dispatch_msg_t*)platform_malloc(sizeof(dispatch_msg_t) + payload_len);
+    if (!msg)
+        return -1;
+    msg->next = 0;
+    msg->callback = callback;
+    msg->len = payload_len;
+    memcpy(msg->payload, payload, payload_len);
+    msg->payload[payload_len] = '\0';
+
+    while (1)
+    {
+        platform_mutex_lock(&w->mtx);
+        if (w->count < DISPATCH_QUEUE_MAX)
+        {
+            *w->tail = msg;
+            w->tail = &msg->next;
+            w->count++;
+            platform_mutex_unlock(&w->mtx);
+            break;
+        }
+        platform_mutex_unlock(&w->mtx);
+
+        if (!wait)
+        {
+            platform_free(msg);
+            return 1;
+        }
+
+        /*
+         * the worker is stuck in a slow callback, stop reading from the
+         * network rather than let the backlog grow without bound
+         */
+        platform_semaphore_wait(&w->room_sem, DISPATCH_IDLE_MS);
+    }
+
+    platform_semaphore_post(&w->ready_sem);
+
+    return 0;
+}
+
+
+void dispatch_stats(evrythng_dispatch_t* dispatch, evrythng_histogram_t* histogram)
+{
+    int i;
+
+    for (i = 0; i < dispatch->workers; i++)
+        histogram_add(histogram, &dispatch->worker[i].callback_duration);
+}
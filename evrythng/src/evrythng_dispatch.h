@@ -0,0 +1,38 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_DISPATCH_H)
+#define _EVRYTHNG_DISPATCH_H
+
+#include <stddef.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Runs subscription callbacks on worker threads instead of mqtt_thread.
+ * Every topic is bound to one worker, so messages of a topic are handed
+ * to the callback in the order they arrived while different topics are
+ * handled in parallel.
+ */
+typedef struct evrythng_dispatch_t evrythng_dispatch_t;
+
+/* starts the worker threads, returns 0 on success */
+int dispatch_start(evrythng_dispatch_t** dispatch, int workers, int priority, size_t stacksize);
+
+/* lets the workers finish the messages already posted, then stops them */
+void dispatch_stop(evrythng_dispatch_t* dispatch);
+
+/*
+ * Copies the message and queues it for the worker of its topic. Waits
+ * while that worker is too far behind, or drops the message if wait is
+ * 0. Returns 0 on success, 1 if the message was dropped and -1 if there
+ * is no memory for the copy.
+ */
+int dispatch_post(evrythng_dispatch_t* dispatch, sub_callback* callback, const char* topic, int topic_len, const char* payload, int payload_len, int wait);
+
+/* adds the callback durations measured by the workers to histogram */
+void dispatch_stats(evrythng_dispatch_t* dispatch, evrythng_histogram_t* histogram);
+
+#endif //_EVRYTHNG_DISPATCH_H
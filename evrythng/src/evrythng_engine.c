@@ -0,0 +1,617 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/platform.h"
+#include "evrythng_engine.h"
+
+/* ready descriptors taken from the poller at a time */
+#define ENGINE_EVENTS_MAX 64
+/* how long a loop waits before it tries again after running out of memory */
+#define ENGINE_RETRY_MS 100
+/* restart value of the clock of a loop, deadlines are rebased once half of it is used up */
+#define ENGINE_CLOCK_MS 0x3FFFFFFF
+/* connect workers per loop, so that a burst of reconnects isn't handled one by one */
+#define ENGINE_WORKERS_PER_LOOP 2
+/* how long an idle connect worker sleeps before it looks for jobs again */
+#define ENGINE_IDLE_MS 1000
+
+enum { SOURCE_IDLE, SOURCE_ADDED, SOURCE_READY };
+
+typedef struct engine_loop_t engine_loop_t;
+
+struct engine_source_t
+{
+    engine_loop_t*      loop;
+    engine_fn*          fn;
+    void*               ctx;
+    int                 fd;         /* registered with the poller, -1 for none */
+    unsigned int        conn;
+    int                 due;        /* loop clock time the source is due at */
+    int                 heap_index; /* -1 without a deadline */
+    engine_job_fn*      job;        /* set by fn through engine_offload */
+    int                 away;       /* the job is running, the loop leaves the source alone */
+    int                 gone;       /* removed while away, posted once back */
+
+    /* guarded by the mutex of the engine */
+    engine_source_t*    job_next;
+
+    /* guarded by the mutex of the loop */
+    int                 state;      /* SOURCE_ADDED and SOURCE_READY are linked through next */
+    int                 removing;
+    engine_source_t*    next;
+    engine_source_t*    remove_next;
+    engine_source_t*    back_next;
+    Semaphore           removed_sem;
+};
+
+struct engine_loop_t
+{
+    evrythng_engine_handle_t engine;
+    Thread              thread;
+    Mutex               mtx;        /* guards the lists, the source count and stop */
+    Event               wake_event;
+    platform_poller_t*  poller;
+    engine_source_t*    added;
+    engine_source_t*    ready;
+    engine_source_t*    removed;
+    engine_source_t*    back;       /* sources whose job is done */
+    int                 sources;    /* bound to the loop, for balancing */
+    int                 stop;
+
+    /* only used by the loop thread */
+    Timer               clock;
+    engine_source_t**   heap;
+    int                 heap_count;
+    int                 heap_size;
+};
+
+struct evrythng_engine_ctx_t
+{
+    Mutex           mtx;        /* guards the jobs and stop */
+    Semaphore       job_sem;
+    engine_source_t* jobs;
+    engine_source_t** jobs_tail;
+    int             stop;
+    Thread*         worker;
+    int             workers;
+    int             loops;
+    engine_loop_t   loop[1];
+};
+
+
+static int loop_now(engine_loop_t* l)
+{
+    return ENGINE_CLOCK_MS - platform_timer_left(&l->clock);
+}
+
+
+/* keeps the clock from running out by turning it and all deadlines back */
+static void loop_rebase(engine_loop_t* l)
+{
+    int i, shift = loop_now(l);
+
+    if (shift < ENGINE_CLOCK_MS / 2)
+        return;
+
+    platform_timer_countdown(&l->clock, ENGINE_CLOCK_MS);
+    for (i = 0; i < l->heap_count; i++)
+        l->heap[i]->due -= shift;
+}
+
+
+static void heap_place(engine_loop_t* l, engine_source_t* s, int i)
+{
+    l->heap[i] = s;
+    s->heap_index = i;
+}
+
+
+/* moves the source at i up or down to where its deadline belongs */
+static void heap_sift(engine_loop_t* l, int i)
+{
+    engine_source_t* s = l->heap[i];
+
+    while (i > 0 && s->due < l->heap[(i - 1) / 2]->due)
+    {
+        heap_place(l, l->heap[(i - 1) / 2], i);
+        i = (i - 1) / 2;
+    }
+
+    while (2 * i + 1 < l->heap_count)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < l->heap_count && l->heap[child + 1]->due < l->heap[child]->due)
+            child++;
+        if (s->due <= l->heap[child]->due)
+            break;
+        heap_place(l, l->heap[child], i);
+        i = child;
+    }
+
+    heap_place(l, s, i);
+}
+
+
+/* the heap has room for every source of the loop, see heap_reserve */
+static void heap_set(engine_loop_t* l, engine_source_t* s, int due)
+{
+    s->due = due;
+    if (s->heap_index < 0)
+        heap_place(l, s, l->heap_count++);
+    heap_sift(l, s->heap_index);
+}
+
+
+static void heap_remove(engine_loop_t* l, engine_source_t* s)
+{
+    int i = s->heap_index;
+
+    if (i < 0)
+        return;
+
+    s->heap_index = -1;
+    if (i == --l->heap_count)
+        return;
+    heap_place(l, l->heap[l->heap_count], i);
+    heap_sift(l, i);
+}
+
+
+static int heap_reserve(engine_loop_t* l, int count)
+{
+    engine_source_t** heap;
+    int size = l->heap_size ? l->heap_size : 64;
+
+    if (count <= l->heap_size)
+        return 0;
+
+    while (size < count)
+        size *= 2;
+    heap = (engine_source_t**)platform_realloc(l->heap, size * sizeof(engine_source_t*));
+    if (!heap)
+        return -1;
+    l->heap = heap;
+    l->heap_size = size;
+
+    return 0;
+}
+
+
+/* takes the first source off a list taken from the loop, skipping those being removed */
+static engine_source_t* loop_take(engine_loop_t* l, engine_source_t** list)
+{
+    engine_source_t* s;
+
+    platform_mutex_lock(&l->mtx);
+    while ((s = *list) != 0)
+    {
+        *list = s->next;
+        s->next = 0;
+        s->state = SOURCE_IDLE;
+        if (!s->removing)
+            break;
+    }
+    platform_mutex_unlock(&l->mtx);
+
+    return s;
+}
+
+
+static void loop_unlink(engine_source_t** list, engine_source_t* s)
+{
+    while (*list && *list != s)
+        list = &(*list)->next;
+    if (*list)
+        *list = s->next;
+}
+
+
+/* takes the source off its loop and queues its job for the connect workers */
+static void loop_send_away(engine_loop_t* l, engine_source_t* s)
+{
+    evrythng_engine_handle_t e = l->engine;
+
+    if (s->fd >= 0)
+        platform_poller_remove(l->poller, s->fd);
+    s->fd = -1;
+    heap_remove(l, s);
+    s->away = 1;
+
+    platform_mutex_lock(&e->mtx);
+    s->job_next = 0;
+    *e->jobs_tail = s;
+    e->jobs_tail = &s->job_next;
+    platform_mutex_unlock(&e->mtx);
+
+    platform_semaphore_post(&e->job_sem);
+}
+
+
+static void loop_run(engine_loop_t* l, engine_source_t* s, int readable)
+{
+    int fd = s->fd;
+    unsigned int conn = s->conn;
+    int timeout;
+
+    if (s->away)
+        return;
+
+    timeout = (*s->fn)(s->ctx, readable, &fd, &conn);
+    if (s->job)
+    {
+        loop_send_away(l, s);
+        return;
+    }
+
+    if (fd != s->fd || conn != s->conn)
+    {
+        /* a closed descriptor may already be gone from the poller */
+        if (s->fd >= 0)
+            platform_poller_remove(l->poller, s->fd);
+        s->fd = -1;
+        s->conn = conn;
+        if (fd >= 0 && platform_poller_add(l->poller, fd, s) == 0)
+            s->fd = fd;
+        else if (fd >= 0 && (timeout < 0 || timeout > ENGINE_RETRY_MS))
+            timeout = ENGINE_RETRY_MS;
+    }
+
+    if (timeout < 0)
+        heap_remove(l, s);
+    else
+        heap_set(l, s, loop_now(l) + timeout);
+}
+
+
+static void engine_thread(void* arg)
+{
+    engine_loop_t* l = (engine_loop_t*)arg;
+    void* ready[ENGINE_EVENTS_MAX];
+    int retry = 0;
+
+    while (1)
+    {
+        engine_source_t *added, *woken, *removed, *back, *s;
+        int stop, count, due, timeout, i, n;
+
+        platform_mutex_lock(&l->mtx);
+        removed = l->removed;
+        l->removed = 0;
+        for (s = removed; s; s = s->remove_next)
+        {
+            if (s->state == SOURCE_ADDED)
+                loop_unlink(&l->added, s);
+            else if (s->state == SOURCE_READY)
+                loop_unlink(&l->ready, s);
+            s->state = SOURCE_IDLE;
+            l->sources--;
+        }
+        added = l->added;
+        l->added = 0;
+        woken = l->ready;
+        l->ready = 0;
+        back = l->back;
+        l->back = 0;
+        count = l->sources;
+        stop = l->stop;
+        platform_mutex_unlock(&l->mtx);
+
+        while (removed)
+        {
+            s = removed;
+            removed = s->remove_next;
+            if (s->away)
+            {
+                /* its job still uses it, see below */
+                s->gone = 1;
+                continue;
+            }
+            if (s->fd >= 0)
+                platform_poller_remove(l->poller, s->fd);
+            heap_remove(l, s);
+            /* the source is freed once posted */
+            platform_semaphore_post(&s->removed_sem);
+        }
+
+        while (back)
+        {
+            s = back;
+            back = s->back_next;
+            s->away = 0;
+            s->job = 0;
+            if (s->gone)
+                platform_semaphore_post(&s->removed_sem);
+            else
+                loop_run(l, s, 0);
+        }
+
+        if (stop)
+            break;
+
+        retry = 0;
+        if (added && heap_reserve(l, count))
+        {
+            platform_mutex_lock(&l->mtx);
+            for (s = added; s->next; s = s->next)
+                ;
+            s->next = l->added;
+            l->added = added;
+            platform_mutex_unlock(&l->mtx);
+            added = 0;
+            retry = 1;
+        }
+
+        while ((s = loop_take(l, &added)) != 0)
+            loop_run(l, s, 0);
+        while ((s = loop_take(l, &woken)) != 0)
+            loop_run(l, s, 0);
+
+        /* a source due again right away waits for the next round */
+        loop_rebase(l);
+        due = loop_now(l);
+        for (n = l->heap_count; n > 0 && l->heap_count && l->heap[0]->due <= due; n--)
+            loop_run(l, l->heap[0], 0);
+
+        timeout = -1;
+        if (l->heap_count)
+        {
+            timeout = l->heap[0]->due - loop_now(l);
+            if (timeout < 0)
+                timeout = 0;
+        }
+        if (retry && (timeout < 0 || timeout > ENGINE_RETRY_MS))
+            timeout = ENGINE_RETRY_MS;
+        if (timeout < 0)
+            timeout = 0x00FFFFFF;
+
+        n = platform_poller_wait(l->poller, &l->wake_event, ready, ENGINE_EVENTS_MAX, timeout);
+        if (n < 0)
+        {
+            platform_sleep(ENGINE_RETRY_MS);
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            loop_run(l, (engine_source_t*)ready[i], 1);
+    }
+}
+
+
+static void engine_worker(void* arg)
+{
+    evrythng_engine_handle_t e = (evrythng_engine_handle_t)arg;
+
+    while (1)
+    {
+        engine_source_t* s;
+        engine_loop_t* l;
+        int stop, more;
+
+        platform_mutex_lock(&e->mtx);
+        s = e->jobs;
+        if (s)
+        {
+            e->jobs = s->job_next;
+            if (!e->jobs)
+                e->jobs_tail = &e->jobs;
+        }
+        more = e->jobs != 0;
+        stop = e->stop;
+        platform_mutex_unlock(&e->mtx);
+
+        /* the semaphore doesn't count, pass the rest on to another worker */
+        if (more || (!s && stop))
+            platform_semaphore_post(&e->job_sem);
+
+        if (!s)
+        {
+            if (stop)
+                break;
+            platform_semaphore_wait(&e->job_sem, ENGINE_IDLE_MS);
+            continue;
+        }
+
+        (*s->job)(s->ctx);
+
+        l = s->loop;
+        platform_mutex_lock(&l->mtx);
+        s->back_next = l->back;
+        l->back = s;
+        platform_mutex_unlock(&l->mtx);
+        platform_event_set(&l->wake_event);
+    }
+}
+
+
+static void loop_deinit(engine_loop_t* l)
+{
+    if (l->poller)
+        platform_poller_destroy(l->poller);
+    if (l->heap)
+        platform_free(l->heap);
+    platform_timer_deinit(&l->clock);
+    platform_event_deinit(&l->wake_event);
+    platform_mutex_deinit(&l->mtx);
+}
+
+
+int engine_start(evrythng_engine_handle_t* engine, int loops, int priority, size_t stacksize)
+{
+    evrythng_engine_handle_t e;
+    int i;
+
+    e = (evrythng_engine_handle_t)platform_malloc(sizeof(struct evrythng_engine_ctx_t) + (loops - 1) * sizeof(engine_loop_t));
+    if (!e)
+        return -1;
+    memset(e, 0, sizeof(struct evrythng_engine_ctx_t) + (loops - 1) * sizeof(engine_loop_t));
+    platform_mutex_init(&e->mtx);
+    platform_semaphore_init(&e->job_sem);
+    e->jobs_tail = &e->jobs;
+    e->loops = loops;
+
+    for (i = 0; i < loops; i++)
+    {
+        engine_loop_t* l = &e->loop[i];
+
+        l->engine = e;
+        platform_mutex_init(&l->mtx);
+        platform_event_init(&l->wake_event);
+        platform_timer_init(&l->clock);
+        platform_timer_countdown(&l->clock, ENGINE_CLOCK_MS);
+        l->poller = platform_poller_create();
+
+        if (!l->poller || platform_thread_create(&l->thread, priority, "engine_thread", engine_thread, stacksize, (void*)l))
+        {
+            loop_deinit(l);
+            e->loops = i;
+            engine_stop(e);
+            return -1;
+        }
+    }
+
+    e->worker = (Thread*)platform_malloc(loops * ENGINE_WORKERS_PER_LOOP * sizeof(Thread));
+    if (!e->worker)
+    {
+        engine_stop(e);
+        return -1;
+    }
+    for (i = 0; i < loops * ENGINE_WORKERS_PER_LOOP; i++)
+    {
+        if (platform_thread_create(&e->worker[i], priority, "engine_worker", engine_worker, stacksize, (void*)e))
+        {
+            engine_stop(e);
+            return -1;
+        }
+        e->workers++;
+    }
+
+    *engine = e;
+
+    return 0;
+}
+
+
+void engine_stop(evrythng_engine_handle_t engine)
+{
+    int i;
+
+    for (i = 0; i < engine->loops; i++)
+    {
+        engine_loop_t* l = &engine->loop[i];
+
+        platform_mutex_lock(&l->mtx);
+        l->stop = 1;
+        platform_mutex_unlock(&l->mtx);
+        platform_event_set(&l->wake_event);
+    }
+
+    for (i = 0; i < engine->loops; i++)
+    {
+        engine_loop_t* l = &engine->loop[i];
+
+        platform_thread_join(&l->thread, 0x00FFFFFF);
+        platform_thread_destroy(&l->thread);
+        loop_deinit(l);
+    }
+
+    platform_mutex_lock(&engine->mtx);
+    engine->stop = 1;
+    platform_mutex_unlock(&engine->mtx);
+    platform_semaphore_post(&engine->job_sem);
+
+    for (i = 0; i < engine->workers; i++)
+    {
+        platform_thread_join(&engine->worker[i], 0x00FFFFFF);
+        platform_thread_destroy(&engine->worker[i]);
+    }
+    if (engine->worker)
+        platform_free(engine->worker);
+    platform_semaphore_deinit(&engine->job_sem);
+    platform_mutex_deinit(&engine->mtx);
+
+    platform_free(engine);
+}
+
+
+engine_source_t* engine_add(evrythng_engine_handle_t engine, engine_fn* fn, void* ctx)
+{
+    engine_loop_t* l = &engine->loop[0];
+    engine_source_t* s;
+    int i;
+
+    /* counts are read without locking, the balance doesn't have to be exact */
+    for (i = 1; i < engine->loops; i++)
+    {
+        if (engine->loop[i].sources < l->sources)
+            l = &engine->loop[i];
+    }
+
+    s = (engine_source_t*)platform_malloc(sizeof(engine_source_t));
+    if (!s)
+        return 0;
+    memset(s, 0, sizeof(engine_source_t));
+    s->loop = l;
+    s->fn = fn;
+    s->ctx = ctx;
+    s->fd = -1;
+    s->heap_index = -1;
+    platform_semaphore_init(&s->removed_sem);
+
+    platform_mutex_lock(&l->mtx);
+    s->state = SOURCE_ADDED;
+    s->next = l->added;
+    l->added = s;
+    l->sources++;
+    platform_mutex_unlock(&l->mtx);
+
+    platform_event_set(&l->wake_event);
+
+    return s;
+}
+
+
+void engine_remove(engine_source_t* source)
+{
+    engine_loop_t* l = source->loop;
+
+    platform_mutex_lock(&l->mtx);
+    source->removing = 1;
+    source->remove_next = l->removed;
+    l->removed = source;
+    platform_mutex_unlock(&l->mtx);
+
+    platform_event_set(&l->wake_event);
+    platform_semaphore_wait(&source->removed_sem, 0x00FFFFFF);
+
+    platform_semaphore_deinit(&source->removed_sem);
+    platform_free(source);
+}
+
+
+void engine_wake(engine_source_t* source)
+{
+    engine_loop_t* l = source->loop;
+    int wake = 0;
+
+    platform_mutex_lock(&l->mtx);
+    if (source->state == SOURCE_IDLE && !source->removing)
+    {
+        source->state = SOURCE_READY;
+        source->next = l->ready;
+        l->ready = source;
+        wake = 1;
+    }
+    platform_mutex_unlock(&l->mtx);
+
+    if (wake)
+        platform_event_set(&l->wake_event);
+}
+
+
+void engine_offload(engine_source_t* source, engine_job_fn* job)
+{
+    source->job = job;
+}
@@ -0,0 +1,60 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_ENGINE_H)
+#define _EVRYTHNG_ENGINE_H
+
+#include <stddef.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * A few loop threads shared by any number of handles in poll mode. Each
+ * handle is a source bound to one loop, which waits for the sockets of
+ * all its sources at once and keeps their deadlines in a heap, so the
+ * number of threads doesn't grow with the number of connections.
+ */
+typedef struct engine_source_t engine_source_t;
+
+/*
+ * Runs a source: does what is due, readable is set if its descriptor was
+ * reported ready. *fd receives the descriptor to watch, -1 for none, and
+ * *conn a value which changes whenever the descriptor is replaced, even
+ * by one with the same number. Both hold the values of the last run and
+ * may be left alone. Returns the milliseconds until the source is due
+ * again, -1 for no deadline.
+ */
+typedef int engine_fn(void* ctx, int readable, int* fd, unsigned int* conn);
+
+/* a blocking step of a source, see engine_offload */
+typedef void engine_job_fn(void* ctx);
+
+/* starts the loop threads and the connect workers, returns 0 on success */
+int engine_start(evrythng_engine_handle_t* engine, int loops, int priority, size_t stacksize);
+
+/* stops the threads, all sources must have been removed */
+void engine_stop(evrythng_engine_handle_t engine);
+
+/*
+ * Binds a source to the loop with the fewest of them, which runs it right
+ * away. Returns a null pointer if there is no memory.
+ */
+engine_source_t* engine_add(evrythng_engine_handle_t engine, engine_fn* fn, void* ctx);
+
+/* unbinds a source, once it returns fn is not running and won't be called again */
+void engine_remove(engine_source_t* source);
+
+/* has the loop run the source as soon as possible, can be called from any thread */
+void engine_wake(engine_source_t* source);
+
+/*
+ * Called by fn for a step which waits for the network, like a connect.
+ * Once fn returns the source is taken off its loop, which goes on with
+ * the others, and job runs on one of the engine's connect workers. The
+ * source is run again once job is done, its descriptor is watched anew.
+ */
+void engine_offload(engine_source_t* source, engine_job_fn* job);
+
+#endif //_EVRYTHNG_ENGINE_H
@@ -0,0 +1,166 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "evrythng/platform.h"
+#include "evrythng_log.h"
+
+/* longer lines are cut */
+#define LOG_LINE_MAX 160
+/* how long an idle thread sleeps before it checks whether it has to stop */
+#define LOG_IDLE_MS 1000
+
+typedef struct log_line_t
+{
+    evrythng_log_callback   callback;
+    evrythng_log_level_t    level;
+    int                     ready;  /* formatted, set with the mutex held */
+    char                    text[LOG_LINE_MAX];
+} log_line_t;
+
+/*
+ * The mutex is only held to claim or release a slot, formatting and 
+ * delivery happen outside of it.
+ */
+struct evrythng_log_ring_t
+{
+    Thread          thread;
+    Mutex           mtx;
+    Semaphore       ready_sem;
+    int             lines;
+    int             head;       /* oldest line */
+    int             count;      /* lines claimed, formatted or not */
+    unsigned int    dropped;
+    int             stop;
+    log_line_t      line[1];
+};
+
+
+/* calls the log callback with a line that is already formatted */
+static void log_deliver(evrythng_log_callback callback, evrythng_log_level_t level, const char* fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    callback(level, fmt, vl);
+    va_end(vl);
+}
+
+
+static void log_thread(void* arg)
+{
+    evrythng_log_ring_t* r = (evrythng_log_ring_t*)arg;
+
+    while (1)
+    {
+        log_line_t* line = 0;
+        unsigned int dropped = 0;
+        int stop;
+
+        platform_mutex_lock(&r->mtx);
+        /* a line still being formatted holds back the ones after it */
+        if (r->count > 0 && r->line[r->head].ready)
+        {
+            line = &r->line[r->head];
+            dropped = r->dropped;
+            r->dropped = 0;
+        }
+        stop = r->stop;
+        platform_mutex_unlock(&r->mtx);
+
+        if (dropped)
+            log_deliver(line->callback, EVRYTHNG_LOG_WARNING, "%u log messages dropped", dropped);
+
+        if (!line)
+        {
+            if (stop)
+                break;
+            platform_semaphore_wait(&r->ready_sem, LOG_IDLE_MS);
+            continue;
+        }
+
+        log_deliver(line->callback, line->level, "%s", line->text);
+
+        platform_mutex_lock(&r->mtx);
+        line->ready = 0;
+        r->head = (r->head + 1) % r->lines;
+        r->count--;
+        platform_mutex_unlock(&r->mtx);
+    }
+}
+
+
+int log_ring_start(evrythng_log_ring_t** ring, int lines, int priority, size_t stacksize)
+{
+    size_t size = sizeof(evrythng_log_ring_t) + (lines - 1) * sizeof(log_line_t);
+    evrythng_log_ring_t* r = (evrythng_log_ring_t*)platform_malloc(size);
+
+    if (!r)
+        return -1;
+    memset(r, 0, size);
+    r->lines = lines;
+
+    platform_mutex_init(&r->mtx);
+    platform_semaphore_init(&r->ready_sem);
+
+    if (platform_thread_create(&r->thread, priority, "log_thread", log_thread, stacksize, (void*)r))
+    {
+        platform_semaphore_deinit(&r->ready_sem);
+        platform_mutex_deinit(&r->mtx);
+        platform_free(r);
+        return -1;
+    }
+
+    *ring = r;
+
+    return 0;
+}
+
+
+void log_ring_stop(evrythng_log_ring_t* ring)
+{
+    platform_mutex_lock(&ring->mtx);
+    ring->stop = 1;
+    platform_mutex_unlock(&ring->mtx);
+    platform_semaphore_post(&ring->ready_sem);
+
+    platform_thread_join(&ring->thread, 0x00FFFFFF);
+    platform_thread_destroy(&ring->thread);
+    platform_semaphore_deinit(&ring->ready_sem);
+    platform_mutex_deinit(&ring->mtx);
+    platform_free(ring);
+}
+
+
+void log_ring_put(evrythng_log_ring_t* ring, evrythng_log_callback callback, evrythng_log_level_t level, const char* fmt, va_list vl)
+{
+    log_line_t* line = 0;
+
+    platform_mutex_lock(&ring->mtx);
+    if (ring->count < ring->lines)
+    {
+        line = &ring->line[(ring->head + ring->count) % ring->lines];
+        ring->count++;
+    }
+    else
+    {
+        ring->dropped++;
+    }
+    platform_mutex_unlock(&ring->mtx);
+
+    if (!line)
+        return;
+
+    line->callback = callback;
+    line->level = level;
+    vsnprintf(line->text, sizeof(line->text), fmt, vl);
+
+    platform_mutex_lock(&ring->mtx);
+    line->ready = 1;
+    platform_mutex_unlock(&ring->mtx);
+
+    platform_semaphore_post(&ring->ready_sem);
+}
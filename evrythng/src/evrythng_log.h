@@ -0,0 +1,30 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_LOG_H)
+#define _EVRYTHNG_LOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Queue of formatted log lines handed to the log callback by a thread
+ * of its own, so that a slow callback doesn't hold up the thread that
+ * logs. Lines which don't fit are dropped and counted.
+ */
+typedef struct evrythng_log_ring_t evrythng_log_ring_t;
+
+/* starts the thread delivering lines, returns 0 on success */
+int log_ring_start(evrythng_log_ring_t** ring, int lines, int priority, size_t stacksize);
+
+/* delivers the lines left and stops the thread */
+void log_ring_stop(evrythng_log_ring_t* ring);
+
+/* formats a line for callback, never waits for the callback */
+void log_ring_put(evrythng_log_ring_t* ring, evrythng_log_callback callback, evrythng_log_level_t level, const char* fmt, va_list vl);
+
+#endif //_EVRYTHNG_LOG_H
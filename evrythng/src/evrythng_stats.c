@@ -0,0 +1,89 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include "evrythng_stats.h"
+
+
+static int histogram_bucket(unsigned int value)
+{
+    int e = 2, bucket;
+
+    if (value < 4)
+        return value;
+
+    /* e = log2(value), the two bits below the top one pick the bucket */
+    while (value >> (e + 1))
+        e++;
+    bucket = 4 * (e - 1) + ((value >> (e - 2)) & 3);
+
+    return bucket < EVRYTHNG_HISTOGRAM_BUCKETS ? bucket : EVRYTHNG_HISTOGRAM_BUCKETS - 1;
+}
+
+
+/* largest value counted in a bucket, the last one aside */
+static unsigned int histogram_bucket_max(int bucket)
+{
+    int e = bucket / 4 + 1;
+
+    if (bucket < 4)
+        return bucket;
+
+    return ((unsigned int)(5 + bucket % 4) << (e - 2)) - 1;
+}
+
+
+void histogram_record(evrythng_histogram_t* h, int ms)
+{
+    unsigned int value = ms > 0 ? ms : 0;
+
+    h->buckets[histogram_bucket(value)]++;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+}
+
+
+void histogram_add(evrythng_histogram_t* dst, const evrythng_histogram_t* src)
+{
+    int i;
+
+    for (i = 0; i < EVRYTHNG_HISTOGRAM_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+}
+
+
+int EvrythngHistogramPercentile(const evrythng_histogram_t* histogram, int percent)
+{
+    unsigned long long total = 0, seen = 0, rank;
+    int i;
+
+    if (!histogram || percent < 0 || percent > 100)
+        return 0;
+
+    /* count may lag behind the buckets in a snapshot, go by the buckets */
+    for (i = 0; i < EVRYTHNG_HISTOGRAM_BUCKETS; i++)
+        total += histogram->buckets[i];
+    if (!total)
+        return 0;
+
+    rank = (total * percent + 99) / 100;
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < EVRYTHNG_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+
+    if (i == EVRYTHNG_HISTOGRAM_BUCKETS - 1 || histogram_bucket_max(i) > histogram->max)
+        return histogram->max;
+
+    return histogram_bucket_max(i);
+}
@@ -0,0 +1,21 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_STATS_H)
+#define _EVRYTHNG_STATS_H
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Histograms are not locked, each one must only be recorded into by 
+ * a single thread. Readers may see a value counted in a bucket but 
+ * not yet in count.
+ */
+void histogram_record(evrythng_histogram_t* histogram, int ms);
+
+/* adds the values of src to dst */
+void histogram_add(evrythng_histogram_t* dst, const evrythng_histogram_t* src);
+
+#endif //_EVRYTHNG_STATS_H
@@ -0,0 +1,523 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/platform.h"
+#include "evrythng_store.h"
+
+#define STORE_MAGIC 0x51545645 /* "EVTQ" */
+#define STORE_VERSION 1
+#define STORE_WRAP 0xFFFFFFFF
+#define STORE_REPLACED 0x80000000
+/* appends written to memory but not to storage before a group commit is forced */
+#define STORE_SYNC_BATCH 32
+/* topic hash buckets remembered for coalescing, a power of 2 */
+#define STORE_INDEX_SIZE 1024
+
+/*
+ * Storage layout: a header followed by a ring of records
+ *
+ *   [u32 length][u32 checksum][u16 topic length, big endian][topic]['\0'][payload]
+ *
+ * length counts the bytes after the checksum, every record starts on
+ * a 4 byte boundary. A record never wraps, the rest of the ring is
+ * skipped instead, marked by a STORE_WRAP length when there is room
+ * for one. The topic is stored in MQTT string form, so a record can
+ * be handed to MQTTPublishEncodedAsync() as it is. A record replaced
+ * by a newer one for the same topic keeps its place in the ring with
+ * STORE_REPLACED set in its length and is skipped when read.
+ */
+typedef struct store_header_t
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int used;      /* bytes from head to tail, skipped ones included */
+    unsigned int count;     /* records from head to tail, replaced ones included */
+    unsigned int reserved;
+} store_header_t;
+
+#define STORE_RECORD_HDR 8
+#define STORE_ALIGN(n) (((n) + 3) & ~3u)
+
+struct evrythng_store_t
+{
+    unsigned char*  map;
+    size_t          map_size;
+    unsigned char*  data;
+    unsigned int    size;
+
+    /*
+     * Live state, copied to the mapped header only after the records it
+     * describes are on storage. Space freed by store_release() is not
+     * reused until the header that frees it has been written, otherwise
+     * a crash could leave the stored head pointing into new records.
+     */
+    store_header_t  hdr;
+    unsigned int    reclaim;
+    int             dirty;
+
+    /* records between head and read have been handed out and must not change */
+    unsigned int    read;
+    int             live;
+    int             pending;
+
+    /* offset + 1 of the newest record whose topic hashes to the bucket */
+    unsigned int    index[STORE_INDEX_SIZE];
+
+    Mutex           mtx;
+    Mutex           sync_mtx;
+};
+
+
+static unsigned int get32(const unsigned char* p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+
+static void put32(unsigned char* p, unsigned int v)
+{
+    memcpy(p, &v, sizeof v);
+}
+
+
+static unsigned int checksum(const unsigned char* p, unsigned int len)
+{
+    unsigned int h = 2166136261u;
+    while (len--)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+
+static unsigned int bucket(const unsigned char* topic, int len)
+{
+    return checksum(topic, len) & (STORE_INDEX_SIZE - 1);
+}
+
+
+/* offset where the record at or after off really starts */
+static unsigned int store_skip_wrap(const evrythng_store_t* s, unsigned int off)
+{
+    if (s->size - off < STORE_RECORD_HDR || get32(s->data + off) == STORE_WRAP)
+        return 0;
+    return off;
+}
+
+
+/* offset following the record which starts at off */
+static unsigned int store_after(const evrythng_store_t* s, unsigned int off)
+{
+    unsigned int len = get32(s->data + off) & ~STORE_REPLACED;
+    off += STORE_ALIGN(STORE_RECORD_HDR + len);
+    return off >= s->size ? 0 : off;
+}
+
+
+/* bytes of the ring from one offset to another */
+static unsigned int store_span(const evrythng_store_t* s, unsigned int from, unsigned int to)
+{
+    return to > from ? to - from : s->size - from + to;
+}
+
+
+/* a record which has not been handed out yet */
+static int store_is_pending(const evrythng_store_t* s, unsigned int off)
+{
+    unsigned int d = (off + s->size - s->hdr.head) % s->size;
+    return d >= (s->read + s->size - s->hdr.head) % s->size && d < s->hdr.used;
+}
+
+
+static int store_topic_len(const evrythng_store_t* s, unsigned int off)
+{
+    return (s->data[off + STORE_RECORD_HDR] << 8) | s->data[off + STORE_RECORD_HDR + 1];
+}
+
+
+/* 
+ * Walks the records left by a previous run. The ring is cut at the first
+ * record which can't be parsed. A record which parses but fails its
+ * checksum was being replaced in place at the time of a crash, it is
+ * dropped alone.
+ */
+static void store_recover(evrythng_store_t* s)
+{
+    store_header_t* h = &s->hdr;
+    unsigned int off = h->head, used = 0, i;
+
+    for (i = 0; i < h->count; i++)
+    {
+        unsigned int start = store_skip_wrap(s, off);
+        if (start != off)
+        {
+            used += s->size - off;
+            off = start;
+        }
+
+        unsigned int len = get32(s->data + off);
+        unsigned int replaced = len & STORE_REPLACED;
+        len &= ~STORE_REPLACED;
+        if (len < 3 || len > s->size - off - STORE_RECORD_HDR)
+            break;
+        unsigned int topic_len = store_topic_len(s, off);
+        if (topic_len + 3 > len)
+            break;
+
+        if (!replaced)
+        {
+            if (s->data[off + STORE_RECORD_HDR + 2 + topic_len] != '\0' ||
+                    checksum(s->data + off + STORE_RECORD_HDR, len) != get32(s->data + off + 4))
+            {
+                put32(s->data + off, len | STORE_REPLACED);
+                s->dirty = 1;
+            }
+            else
+            {
+                s->index[bucket(s->data + off + STORE_RECORD_HDR + 2, topic_len)] = off + 1;
+                s->live++;
+            }
+        }
+
+        used += STORE_ALIGN(STORE_RECORD_HDR + len);
+        off = store_after(s, off);
+    }
+
+    if (i != h->count || used != h->used || off != h->tail)
+    {
+        h->count = i;
+        h->tail = off;
+        h->used = used;
+        s->dirty = 1;
+    }
+    if (!h->count)
+    {
+        h->head = h->tail = h->used = 0;
+    }
+    s->read = h->head;
+    s->pending = s->live;
+}
+
+
+int store_open(evrythng_store_t** store, const char* path, size_t size)
+{
+    if (size < sizeof(store_header_t) + 64)
+        return -1;
+
+    evrythng_store_t* s = (evrythng_store_t*)platform_malloc(sizeof(evrythng_store_t));
+    if (!s)
+        return -1;
+    memset(s, 0, sizeof(evrythng_store_t));
+
+    s->map = (unsigned char*)platform_store_map(path, size);
+    if (!s->map)
+    {
+        platform_free(s);
+        return -1;
+    }
+    s->map_size = size;
+    s->data = s->map + sizeof(store_header_t);
+    s->size = (unsigned int)(size - sizeof(store_header_t)) & ~3u;
+
+    memcpy(&s->hdr, s->map, sizeof(store_header_t));
+    if (s->hdr.magic != STORE_MAGIC || s->hdr.version != STORE_VERSION || s->hdr.size != s->size ||
+            s->hdr.head >= s->size || s->hdr.tail >= s->size || s->hdr.used > s->size)
+    {
+        memset(&s->hdr, 0, sizeof(store_header_t));
+        s->hdr.magic = STORE_MAGIC;
+        s->hdr.version = STORE_VERSION;
+        s->hdr.size = s->size;
+        s->dirty = 1;
+    }
+    else
+    {
+        store_recover(s);
+    }
+
+    platform_mutex_init(&s->mtx);
+    platform_mutex_init(&s->sync_mtx);
+
+    *store = s;
+
+    store_sync(s);
+
+    return 0;
+}
+
+
+void store_close(evrythng_store_t* store)
+{
+    if (!store)
+        return;
+
+    store_sync(store);
+
+    platform_store_unmap(store->map, store->map_size);
+    platform_mutex_deinit(&store->mtx);
+    platform_mutex_deinit(&store->sync_mtx);
+    platform_free(store);
+}
+
+
+/*
+ * Group commit: records written since the last call go to storage
+ * with one sync of the ring, then the header describing them is
+ * written with a second one.
+ */
+void store_sync(evrythng_store_t* store)
+{
+    store_header_t hdr;
+    unsigned int reclaim;
+
+    platform_mutex_lock(&store->sync_mtx);
+
+    platform_mutex_lock(&store->mtx);
+    if (!store->dirty)
+    {
+        platform_mutex_unlock(&store->mtx);
+        platform_mutex_unlock(&store->sync_mtx);
+        return;
+    }
+    hdr = store->hdr;
+    reclaim = store->reclaim;
+    store->dirty = 0;
+    platform_mutex_unlock(&store->mtx);
+
+    /* the mapped header still holds the previous state here, so syncing it again is harmless */
+    platform_store_sync(store->map, sizeof(store_header_t) + store->size);
+    memcpy(store->map, &hdr, sizeof(store_header_t));
+    platform_store_sync(store->map, sizeof(store_header_t));
+
+    platform_mutex_lock(&store->mtx);
+    store->reclaim -= reclaim;
+    platform_mutex_unlock(&store->mtx);
+
+    platform_mutex_unlock(&store->sync_mtx);
+}
+
+
+/* newest unread record with this topic, -1 if there is none */
+static int store_find(evrythng_store_t* s, unsigned int b, const char* topic, int topic_len)
+{
+    if (!s->index[b])
+        return -1;
+
+    unsigned int off = s->index[b] - 1;
+    if (!store_is_pending(s, off) || (get32(s->data + off) & STORE_REPLACED))
+        return -1;
+    if (store_topic_len(s, off) != topic_len || memcmp(s->data + off + STORE_RECORD_HDR + 2, topic, topic_len))
+        return -1;
+
+    return (int)off;
+}
+
+
+int store_append(evrythng_store_t* store, const char* topic, int topic_len, const char* payload, int payload_len, int coalesce)
+{
+    unsigned int len = 2 + topic_len + 1 + payload_len;
+    unsigned int need = STORE_ALIGN(STORE_RECORD_HDR + len);
+    unsigned int b = bucket((const unsigned char*)topic, topic_len);
+    int synced = 0;
+
+    if (topic_len < 0 || payload_len < 0 || need > store->size)
+        return -1;
+
+    while (1)
+    {
+        platform_mutex_lock(&store->mtx);
+
+        store_header_t* h = &store->hdr;
+        if (!h->count && !store->reclaim)
+            h->head = h->tail = store->read = 0;
+
+        int old = coalesce ? store_find(store, b, topic, topic_len) : -1;
+        if (old >= 0 && STORE_ALIGN(STORE_RECORD_HDR + (get32(store->data + old) & ~STORE_REPLACED)) == need)
+        {
+            /* same room needed, overwrite in place; a torn write fails the checksum and only drops this record */
+            unsigned char* r = store->data + old;
+            memcpy(r + STORE_RECORD_HDR + 3 + topic_len, payload, payload_len);
+            put32(r, len);
+            put32(r + 4, checksum(r + STORE_RECORD_HDR, len));
+            int dirty = ++store->dirty;
+
+            platform_mutex_unlock(&store->mtx);
+
+            if (dirty >= STORE_SYNC_BATCH)
+                store_sync(store);
+            return 0;
+        }
+
+        unsigned int skip = store->size - h->tail < need ? store->size - h->tail : 0;
+        if (h->used + store->reclaim + skip + need <= store->size)
+        {
+            if (old >= 0)
+            {
+                put32(store->data + old, get32(store->data + old) | STORE_REPLACED);
+                store->live--;
+                store->pending--;
+            }
+
+            unsigned int off = h->tail;
+            if (skip)
+            {
+                if (skip >= STORE_RECORD_HDR)
+                    put32(store->data + off, STORE_WRAP);
+                off = 0;
+            }
+
+            unsigned char* r = store->data + off;
+            r[STORE_RECORD_HDR] = (unsigned char)(topic_len >> 8);
+            r[STORE_RECORD_HDR + 1] = (unsigned char)topic_len;
+            memcpy(r + STORE_RECORD_HDR + 2, topic, topic_len);
+            r[STORE_RECORD_HDR + 2 + topic_len] = '\0';
+            memcpy(r + STORE_RECORD_HDR + 3 + topic_len, payload, payload_len);
+            put32(r, len);
+            put32(r + 4, checksum(r + STORE_RECORD_HDR, len));
+            store->index[b] = off + 1;
+
+            h->tail = off + need;
+            if (h->tail >= store->size)
+                h->tail = 0;
+            h->used += skip + need;
+            h->count++;
+            store->live++;
+            store->pending++;
+            int dirty = ++store->dirty;
+
+            platform_mutex_unlock(&store->mtx);
+
+            if (dirty >= STORE_SYNC_BATCH)
+                store_sync(store);
+            return 0;
+        }
+
+        int reclaimable = store->reclaim != 0;
+        platform_mutex_unlock(&store->mtx);
+
+        /* released space becomes usable once the new head is on storage */
+        if (!reclaimable || synced)
+            return -1;
+        store_sync(store);
+        synced = 1;
+    }
+}
+
+
+/* drops the record at head, it must have been read */
+static void store_drop_head(evrythng_store_t* s)
+{
+    store_header_t* h = &s->hdr;
+    unsigned int off = store_skip_wrap(s, h->head);
+    unsigned int next = store_after(s, off);
+
+    if (!(get32(s->data + off) & STORE_REPLACED))
+    {
+        unsigned int b = bucket(s->data + off + STORE_RECORD_HDR + 2, store_topic_len(s, off));
+        if (s->index[b] == off + 1)
+            s->index[b] = 0;
+        s->live--;
+    }
+
+    unsigned int freed = store_span(s, h->head, next);
+    h->head = next;
+    h->used -= freed;
+    h->count--;
+    s->reclaim += freed;
+    s->dirty++;
+}
+
+
+int store_next(evrythng_store_t* store, store_record_t* record)
+{
+    platform_mutex_lock(&store->mtx);
+
+    while (store->pending > 0)
+    {
+        unsigned int off = store_skip_wrap(store, store->read);
+        unsigned int next = store_after(store, off);
+
+        if (get32(store->data + off) & STORE_REPLACED)
+        {
+            /* nothing to wait for before it can go */
+            if (store->read == store->hdr.head)
+                store_drop_head(store);
+            store->read = next;
+            continue;
+        }
+
+        const unsigned char* r = store->data + off;
+        int topic_len = store_topic_len(store, off);
+
+        record->encoded_topic = r + STORE_RECORD_HDR;
+        record->topic = (const char*)r + STORE_RECORD_HDR + 2;
+        record->payload = (const char*)r + STORE_RECORD_HDR + 3 + topic_len;
+        record->payload_len = get32(r) - 3 - topic_len;
+        record->next = next;
+
+        store->read = next;
+        store->pending--;
+
+        platform_mutex_unlock(&store->mtx);
+        return 1;
+    }
+
+    platform_mutex_unlock(&store->mtx);
+    return 0;
+}
+
+
+void store_rewind(evrythng_store_t* store)
+{
+    platform_mutex_lock(&store->mtx);
+    store->read = store->hdr.head;
+    store->pending = store->live;
+    platform_mutex_unlock(&store->mtx);
+}
+
+
+void store_release(evrythng_store_t* store, unsigned int next)
+{
+    platform_mutex_lock(&store->mtx);
+    while (store->hdr.count)
+    {
+        store_drop_head(store);
+        if (store->hdr.head == next)
+            break;
+    }
+    platform_mutex_unlock(&store->mtx);
+}
+
+
+int store_count(evrythng_store_t* store)
+{
+    platform_mutex_lock(&store->mtx);
+    int count = store->live;
+    platform_mutex_unlock(&store->mtx);
+    return count;
+}
+
+
+int store_pending(evrythng_store_t* store)
+{
+    platform_mutex_lock(&store->mtx);
+    int pending = store->pending;
+    platform_mutex_unlock(&store->mtx);
+    return pending;
+}
+
+
+int store_dirty(evrythng_store_t* store)
+{
+    platform_mutex_lock(&store->mtx);
+    int dirty = store->dirty;
+    platform_mutex_unlock(&store->mtx);
+    return dirty;
+}
@@ -0,0 +1,59 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_STORE_H)
+#define _EVRYTHNG_STORE_H
+
+#include <stddef.h>
+
+/*
+ * Persistent FIFO of outbound publish messages kept in a ring inside
+ * storage mapped with platform_store_map(). Records are appended by any
+ * thread and consumed in order by mqtt_thread. A record stays valid until
+ * it is released, so it can be published straight from the mapping.
+ */
+typedef struct evrythng_store_t evrythng_store_t;
+
+typedef struct store_record_t
+{
+    const unsigned char*    encoded_topic;  /* two byte length followed by the topic name */
+    const char*             topic;          /* same name, null terminated */
+    const char*             payload;
+    int                     payload_len;
+    unsigned int            next;           /* offset of the following record */
+} store_record_t;
+
+/* maps the storage and recovers records left from a previous run, returns 0 on success */
+int store_open(evrythng_store_t** store, const char* path, size_t size);
+void store_close(evrythng_store_t* store);
+
+/*
+ * Returns 0 on success, -1 if there is no room left. With coalesce set
+ * a record for the same topic which has not been read yet is replaced
+ * by the new one.
+ */
+int store_append(evrythng_store_t* store, const char* topic, int topic_len, const char* payload, int payload_len, int coalesce);
+
+/* reads the next record to send, returns 0 if there is none */
+int store_next(evrythng_store_t* store, store_record_t* record);
+
+/* makes the records read but not released yet readable again */
+void store_rewind(evrythng_store_t* store);
+
+/* drops the records read up to offset next */
+void store_release(evrythng_store_t* store, unsigned int next);
+
+/* records not released yet */
+int store_count(evrythng_store_t* store);
+
+/* records not read yet */
+int store_pending(evrythng_store_t* store);
+
+/* number of changes not yet written to storage */
+int store_dirty(evrythng_store_t* store);
+
+void store_sync(evrythng_store_t* store);
+
+#endif //_EVRYTHNG_STORE_H
@@ -0,0 +1,1081 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "evrythng/platform.h"
+
+/* platform_network_connect() has no timeout of its own */
+#define CONNECT_TIMEOUT_MS 10000
+/* stack sizes asked for by the library suit small devices, a TLS handshake on Linux needs more */
+#define THREAD_STACK_MIN (256 * 1024)
+/* buffers of a vectored write at a time, and bytes gathered into one TLS record */
+#define WRITEV_MAX 16
+#define TLS_GATHER_MAX 4096
+/* ready descriptors taken from epoll at a time */
+#define POLLER_EVENTS_MAX 64
+
+/* returned by a network read or write which has to wait for the socket */
+#define NETWORK_AGAIN -1
+
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/* rounded up, so that waiting for the time left never ends before the deadline */
+static int ms_until(int64_t end_ns)
+{
+    int64_t left = end_ns - monotonic_ns();
+
+    if (left <= 0)
+        return 0;
+    if (left >= (int64_t)INT_MAX * 1000000)
+        return INT_MAX;
+
+    return (int)((left + 999999) / 1000000);
+}
+
+
+void platform_timer_init(Timer* t)
+{
+    t->end_ns = 0;
+}
+
+
+void platform_timer_deinit(Timer* t)
+{
+    (void)t;
+}
+
+
+char platform_timer_isexpired(Timer* t)
+{
+    return monotonic_ns() >= t->end_ns;
+}
+
+
+void platform_timer_countdown(Timer* t, unsigned int ms)
+{
+    t->end_ns = monotonic_ns() + (int64_t)ms * 1000000;
+}
+
+
+int platform_timer_left(Timer* t)
+{
+    return ms_until(t->end_ns);
+}
+
+
+/* waits for events of a descriptor, returns a positive value once they occurred, 0 on timeout */
+static int wait_fd(int fd, short events, int timeout_ms)
+{
+    struct pollfd p = { fd, events, 0 };
+    int rc;
+
+    while ((rc = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR)
+        ;
+
+    return rc;
+}
+
+
+/*
+ * OpenSSL writes to its sockets with write(), which raises SIGPIPE on a
+ * connection closed by the peer. This BIO sends with MSG_NOSIGNAL instead,
+ * so the library needn't touch the signal handling of the application.
+ */
+static BIO_METHOD* bio_method;
+static pthread_once_t bio_method_once = PTHREAD_ONCE_INIT;
+
+static int bio_write(BIO* bio, const char* buf, int len)
+{
+    int rc = send((int)(intptr_t)BIO_get_data(bio), buf, len, MSG_NOSIGNAL);
+
+    BIO_clear_retry_flags(bio);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        BIO_set_retry_write(bio);
+
+    return rc;
+}
+
+
+static int bio_read(BIO* bio, char* buf, int len)
+{
+    int rc = recv((int)(intptr_t)BIO_get_data(bio), buf, len, 0);
+
+    BIO_clear_retry_flags(bio);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        BIO_set_retry_read(bio);
+
+    return rc;
+}
+
+
+static long bio_ctrl(BIO* bio, int cmd, long num, void* ptr)
+{
+    (void)bio;
+    (void)num;
+    (void)ptr;
+
+    /* writes are not buffered */
+    return cmd == BIO_CTRL_FLUSH;
+}
+
+
+static int bio_create(BIO* bio)
+{
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+
+static void bio_method_create(void)
+{
+    bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "evrythng socket");
+    if (!bio_method)
+        return;
+
+    BIO_meth_set_write(bio_method, bio_write);
+    BIO_meth_set_read(bio_method, bio_read);
+    BIO_meth_set_ctrl(bio_method, bio_ctrl);
+    BIO_meth_set_create(bio_method, bio_create);
+}
+
+
+struct platform_trust_store_t
+{
+    SSL_CTX* ctx;
+};
+
+
+/*
+ * Keeps a copy of every new session of a connection, including the
+ * tickets of TLS 1.3 which arrive after the handshake. OpenSSL stops
+ * resuming the session of a connection which failed, yet a failed
+ * connection is just when a device wants to resume it.
+ */
+static int tls_new_session(SSL* tls, SSL_SESSION* session)
+{
+    Network* n = (Network*)SSL_get_app_data(tls);
+    SSL_SESSION* copy = SSL_SESSION_dup(session);
+
+    if (copy)
+    {
+        if (n->tls_session)
+            SSL_SESSION_free(n->tls_session);
+        n->tls_session = copy;
+    }
+
+    return 0;
+}
+
+
+/* a context verifying servers against the PEM certificates in ca_buf */
+static SSL_CTX* tls_context(const char* ca_buf, size_t ca_size)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    BIO* bio;
+    X509* cert;
+    int count = 0;
+
+    if (!ctx)
+        return 0;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, 0);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+
+    bio = BIO_new_mem_buf(ca_buf, (int)ca_size);
+    while (bio && (cert = PEM_read_bio_X509(bio, 0, 0, 0)) != 0)
+    {
+        if (X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), cert) == 1)
+            count++;
+        X509_free(cert);
+    }
+    BIO_free(bio);
+
+    /* reading stops with an error at the end of the certificates */
+    ERR_clear_error();
+
+    if (!count)
+    {
+        SSL_CTX_free(ctx);
+        return 0;
+    }
+
+    return ctx;
+}
+
+
+platform_trust_store_t* platform_trust_store_create(const char* ca_buf, size_t ca_size)
+{
+    platform_trust_store_t* t = (platform_trust_store_t*)malloc(sizeof(platform_trust_store_t));
+
+    if (!t)
+        return 0;
+
+    if (!(t->ctx = tls_context(ca_buf, ca_size)))
+    {
+        free(t);
+        return 0;
+    }
+
+    return t;
+}
+
+
+void platform_trust_store_destroy(platform_trust_store_t* t)
+{
+    SSL_CTX_free(t->ctx);
+    free(t);
+}
+
+
+void platform_network_init(Network* n)
+{
+    n->socket = -1;
+    n->secure = 0;
+    n->ca_buf = 0;
+    n->ca_size = 0;
+    n->trust_store = 0;
+    n->tls_ctx = 0;
+    n->tls = 0;
+    n->tls_session = 0;
+}
+
+
+void platform_network_securedinit(Network* n, const char* ca_buf, size_t ca_size)
+{
+    platform_network_init(n);
+    n->secure = 1;
+    n->ca_buf = ca_buf;
+    n->ca_size = ca_size;
+}
+
+
+void platform_network_securedinit_shared(Network* n, platform_trust_store_t* t)
+{
+    platform_network_init(n);
+    n->secure = 1;
+    n->trust_store = t;
+}
+
+
+/* returns a connected non-blocking socket or -1 */
+static int tcp_connect(struct addrinfo* ai, int64_t end_ns)
+{
+    int fd, one = 1, err = 0;
+    socklen_t len = sizeof(err);
+
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+        return -1;
+
+    /* the client gathers small packets itself, Nagle's algorithm would only hold them back */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        return fd;
+
+    if (errno != EINPROGRESS || wait_fd(fd, POLLOUT, ms_until(end_ns)) <= 0
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static int tls_connect(Network* n, const char* host, int64_t end_ns)
+{
+    SSL_CTX* ctx = n->trust_store ? n->trust_store->ctx : (n->tls_ctx = tls_context(n->ca_buf, n->ca_size));
+    unsigned char addr[sizeof(struct in6_addr)];
+    BIO* bio;
+
+    pthread_once(&bio_method_once, bio_method_create);
+
+    if (!ctx || !bio_method || !(n->tls = SSL_new(ctx)))
+        return -1;
+
+    if (!(bio = BIO_new(bio_method)))
+        return -1;
+    BIO_set_data(bio, (void*)(intptr_t)n->socket);
+    SSL_set_bio(n->tls, bio, bio);
+    SSL_set_app_data(n->tls, n);
+
+    /* the certificate has to be issued for the host connected to */
+    if (inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1)
+    {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(n->tls), host);
+    }
+    else
+    {
+        SSL_set_tlsext_host_name(n->tls, host);
+        SSL_set1_host(n->tls, host);
+    }
+
+    if (n->tls_session)
+    {
+        SSL_set_session(n->tls, n->tls_session);
+        SSL_SESSION_free(n->tls_session);
+        n->tls_session = 0;
+    }
+
+    while (1)
+    {
+        int rc;
+
+        ERR_clear_error();
+        rc = SSL_connect(n->tls);
+        if (rc == 1)
+            return 0;
+
+        switch (SSL_get_error(n->tls, rc))
+        {
+            case SSL_ERROR_WANT_READ:
+                rc = wait_fd(n->socket, POLLIN, ms_until(end_ns));
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                rc = wait_fd(n->socket, POLLOUT, ms_until(end_ns));
+                break;
+            case SSL_ERROR_SSL:
+                return PLATFORM_TLS_REJECTED;
+            default:
+                rc = -1;
+                break;
+        }
+        if (rc <= 0)
+            return -1;
+    }
+}
+
+
+int platform_network_connect(Network* n, char* host, int port)
+{
+    struct addrinfo hints, *list, *ai;
+    char service[8];
+    int64_t end_ns = monotonic_ns() + (int64_t)CONNECT_TIMEOUT_MS * 1000000;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &list))
+        return -1;
+
+    for (ai = list; ai && n->socket < 0; ai = ai->ai_next)
+        n->socket = tcp_connect(ai, end_ns);
+    freeaddrinfo(list);
+
+    if (n->socket < 0)
+        return -1;
+
+    if (n->secure && (rc = tls_connect(n, host, end_ns)))
+    {
+        platform_network_disconnect(n);
+        return rc;
+    }
+
+    return 0;
+}
+
+
+void platform_network_disconnect(Network* n)
+{
+    if (n->tls)
+    {
+        /* sends close_notify if the socket takes it, without waiting for the answer */
+        ERR_clear_error();
+        SSL_shutdown(n->tls);
+        SSL_free(n->tls);
+        n->tls = 0;
+    }
+
+    if (n->tls_ctx)
+    {
+        SSL_CTX_free(n->tls_ctx);
+        n->tls_ctx = 0;
+    }
+
+    if (n->tls_session)
+    {
+        SSL_SESSION_free(n->tls_session);
+        n->tls_session = 0;
+    }
+
+    if (n->socket >= 0)
+    {
+        close(n->socket);
+        n->socket = -1;
+    }
+}
+
+
+/* the outcome of an SSL_read() or SSL_write() like that of recv() or send() */
+static int tls_result(Network* n, int rc, short* events)
+{
+    if (rc > 0)
+        return rc;
+
+    switch (SSL_get_error(n->tls, rc))
+    {
+        case SSL_ERROR_WANT_READ:
+            *events = POLLIN;
+            return NETWORK_AGAIN;
+        case SSL_ERROR_WANT_WRITE:
+            *events = POLLOUT;
+            return NETWORK_AGAIN;
+        default:
+            return 0;
+    }
+}
+
+
+/*
+ * A single read without waiting. Returns the number of bytes read, 0 if
+ * the connection was closed or failed and NETWORK_AGAIN if the socket has
+ * to be waited for with events first.
+ */
+static int network_recv(Network* n, unsigned char* buf, int len, short* events)
+{
+    int rc;
+
+    if (n->tls)
+    {
+        ERR_clear_error();
+        return tls_result(n, SSL_read(n->tls, buf, len), events);
+    }
+
+    while ((rc = recv(n->socket, buf, len, 0)) < 0 && errno == EINTR)
+        ;
+    if (rc >= 0)
+        return rc;
+
+    *events = POLLIN;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? NETWORK_AGAIN : 0;
+}
+
+
+/* like network_recv(), for a single write */
+static int network_send(Network* n, const unsigned char* buf, int len, short* events)
+{
+    int rc;
+
+    if (n->tls)
+    {
+        ERR_clear_error();
+        return tls_result(n, SSL_write(n->tls, buf, len), events);
+    }
+
+    while ((rc = send(n->socket, buf, len, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (rc >= 0)
+        return rc;
+
+    *events = POLLOUT;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? NETWORK_AGAIN : 0;
+}
+
+
+/*
+ * A failed connection reads like a closed one, the client then notices it
+ * right away instead of taking it for a timeout.
+ */
+int platform_network_read_some(Network* n, unsigned char* buf, int len, int timeout_ms)
+{
+    int64_t end_ns = monotonic_ns() + (int64_t)timeout_ms * 1000000;
+    short events = POLLIN;
+    int rc, left;
+
+    while ((rc = network_recv(n, buf, len, &events)) == NETWORK_AGAIN)
+    {
+        /* nothing to wait for without a timeout */
+        if (!(left = ms_until(end_ns)))
+            return -1;
+        /* a failed wait is a failed connection, not a timeout */
+        if ((rc = wait_fd(n->socket, events, left)) <= 0)
+            return rc < 0 ? 0 : -1;
+    }
+
+    return rc;
+}
+
+
+int platform_network_read(Network* n, unsigned char* buf, int len, int timeout_ms)
+{
+    int64_t end_ns = monotonic_ns() + (int64_t)timeout_ms * 1000000;
+    int got = 0;
+
+    while (got < len)
+    {
+        int rc = platform_network_read_some(n, buf + got, len - got, ms_until(end_ns));
+        if (rc == 0)
+            return 0;
+        if (rc < 0)
+            break;
+        got += rc;
+    }
+
+    return got ? got : -1;
+}
+
+
+/* returns 0 if nothing could be written before the timeout */
+int platform_network_write(Network* n, unsigned char* buf, int len, int timeout_ms)
+{
+    int64_t end_ns = monotonic_ns() + (int64_t)timeout_ms * 1000000;
+    short events = POLLOUT;
+    int rc, left;
+
+    while ((rc = network_send(n, buf, len, &events)) == NETWORK_AGAIN)
+    {
+        if (!(left = ms_until(end_ns)) || wait_fd(n->socket, events, left) <= 0)
+            return 0;
+    }
+
+    return rc > 0 ? rc : -1;
+}
+
+
+int platform_network_writev(Network* n, const platform_iovec_t* iov, int iovcnt, int timeout_ms)
+{
+    int64_t end_ns = monotonic_ns() + (int64_t)timeout_ms * 1000000;
+    struct iovec v[WRITEV_MAX];
+    struct msghdr msg;
+    int i, rc, left;
+
+    if (n->tls)
+    {
+        /* TLS has no vectored write, small buffers are gathered into one record */
+        unsigned char buf[TLS_GATHER_MAX];
+        int len = 0;
+
+        for (i = 0; i < iovcnt && len + iov[i].len <= (int)sizeof(buf); i++)
+        {
+            memcpy(buf + len, iov[i].base, iov[i].len);
+            len += iov[i].len;
+        }
+        if (i == 0)
+            return platform_network_write(n, (unsigned char*)iov[0].base, iov[0].len, timeout_ms);
+
+        return platform_network_write(n, buf, len, timeout_ms);
+    }
+
+    if (iovcnt > WRITEV_MAX)
+        iovcnt = WRITEV_MAX;
+    for (i = 0; i < iovcnt; i++)
+    {
+        v[i].iov_base = (void*)iov[i].base;
+        v[i].iov_len = iov[i].len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = iovcnt;
+
+    while ((rc = sendmsg(n->socket, &msg, MSG_NOSIGNAL)) < 0)
+    {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (!(left = ms_until(end_ns)) || wait_fd(n->socket, POLLOUT, left) <= 0)
+            return 0;
+    }
+
+    return rc;
+}
+
+
+/* the latest session kept by tls_new_session() */
+int platform_network_session_save(Network* n, unsigned char* buf, int size)
+{
+    int len;
+
+    if (!n->tls || !n->tls_session || !SSL_SESSION_is_resumable(n->tls_session))
+        return 0;
+
+    len = i2d_SSL_SESSION(n->tls_session, 0);
+    if (len <= 0 || len > size)
+        return 0;
+
+    return i2d_SSL_SESSION(n->tls_session, &buf);
+}
+
+
+void platform_network_session_resume(Network* n, const unsigned char* buf, int len)
+{
+    if (n->tls_session)
+        SSL_SESSION_free(n->tls_session);
+
+    n->tls_session = d2i_SSL_SESSION(0, &buf, len);
+}
+
+
+static void event_clear(Event* e)
+{
+    uint64_t count;
+
+    while (read(e->fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+}
+
+
+int platform_network_wait(Network* n, Event* e, int timeout_ms)
+{
+    struct pollfd p[2] = { { e->fd, POLLIN, 0 }, { n->socket, POLLIN, 0 } };
+    int count = n->socket >= 0 ? 2 : 1;
+    int rc;
+
+    /* records already taken from the socket don't make it readable */
+    if (n->tls && SSL_has_pending(n->tls))
+    {
+        event_clear(e);
+        return 1;
+    }
+
+    rc = poll(p, count, timeout_ms);
+    if (rc < 0)
+        return errno == EINTR ? 0 : -1;
+
+    if (p[0].revents)
+        event_clear(e);
+
+    return count == 2 && p[1].revents ? 1 : 0;
+}
+
+
+int platform_network_fd(Network* n)
+{
+    return n->socket;
+}
+
+
+void platform_event_init(Event* e)
+{
+    e->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+
+void platform_event_deinit(Event* e)
+{
+    if (e->fd >= 0)
+        close(e->fd);
+}
+
+
+void platform_event_set(Event* e)
+{
+    uint64_t one = 1;
+
+    while (write(e->fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+
+int platform_event_fd(Event* e)
+{
+    return e->fd;
+}
+
+
+struct platform_poller_t
+{
+    int epoll_fd;
+    int event_fd;   /* of the event last waited for, watched with the poller itself as data */
+};
+
+
+platform_poller_t* platform_poller_create(void)
+{
+    platform_poller_t* p = (platform_poller_t*)malloc(sizeof(platform_poller_t));
+
+    if (!p)
+        return 0;
+
+    if ((p->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(p);
+        return 0;
+    }
+    p->event_fd = -1;
+
+    return p;
+}
+
+
+void platform_poller_destroy(platform_poller_t* p)
+{
+    close(p->epoll_fd);
+    free(p);
+}
+
+
+int platform_poller_add(platform_poller_t* p, int fd, void* data)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = data;
+
+    return epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, fd, &ev) ? -1 : 0;
+}
+
+
+void platform_poller_remove(platform_poller_t* p, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+
+int platform_poller_wait(platform_poller_t* p, Event* e, void** ready, int max, int timeout_ms)
+{
+    struct epoll_event events[POLLER_EVENTS_MAX];
+    int i, rc, count = 0;
+
+    if (p->event_fd != e->fd)
+    {
+        if (platform_poller_add(p, e->fd, p))
+            return -1;
+        p->event_fd = e->fd;
+    }
+
+    if (max > POLLER_EVENTS_MAX)
+        max = POLLER_EVENTS_MAX;
+
+    rc = epoll_wait(p->epoll_fd, events, max, timeout_ms);
+    if (rc < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < rc; i++)
+    {
+        if (events[i].data.ptr == p)
+            event_clear(e);
+        else
+            ready[count++] = events[i].data.ptr;
+    }
+
+    return count;
+}
+
+
+void platform_mutex_init(Mutex* m)
+{
+    pthread_mutex_init(&m->mutex, 0);
+}
+
+
+void platform_mutex_deinit(Mutex* m)
+{
+    pthread_mutex_destroy(&m->mutex);
+}
+
+
+int platform_mutex_lock(Mutex* m)
+{
+    return pthread_mutex_lock(&m->mutex);
+}
+
+
+int platform_mutex_unlock(Mutex* m)
+{
+    return pthread_mutex_unlock(&m->mutex);
+}
+
+
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void platform_global_lock(void)
+{
+    pthread_mutex_lock(&global_mutex);
+}
+
+
+void platform_global_unlock(void)
+{
+    pthread_mutex_unlock(&global_mutex);
+}
+
+
+static long futex(int* addr, int op, int value, const struct timespec* timeout)
+{
+    return syscall(SYS_futex, addr, op, value, timeout, 0, 0);
+}
+
+
+void platform_semaphore_init(Semaphore* s)
+{
+    s->state = 0;
+}
+
+
+void platform_semaphore_deinit(Semaphore* s)
+{
+    (void)s;
+}
+
+
+/*
+ * The semaphore is not touched after the post but for the wakeup, so the
+ * woken thread may free it right away, e.g. together with a completed op.
+ */
+int platform_semaphore_post(Semaphore* s)
+{
+    if (__atomic_fetch_or(&s->state, 1, __ATOMIC_SEQ_CST) >> 1)
+        futex(&s->state, FUTEX_WAKE_PRIVATE, 1, 0);
+
+    return 0;
+}
+
+
+int platform_semaphore_wait(Semaphore* s, int timeout_ms)
+{
+    int64_t end_ns = monotonic_ns() + (int64_t)timeout_ms * 1000000;
+
+    while (1)
+    {
+        struct timespec timeout;
+        int64_t left;
+        int state = __atomic_load_n(&s->state, __ATOMIC_SEQ_CST);
+
+        if ((state & 1) && __atomic_compare_exchange_n(&s->state, &state, state & ~1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 0;
+        if (state & 1)
+            continue;
+
+        if ((left = end_ns - monotonic_ns()) <= 0)
+            return -1;
+        timeout.tv_sec = left / 1000000000;
+        timeout.tv_nsec = left % 1000000000;
+
+        /* sleeps unless a post came in between */
+        state = __atomic_add_fetch(&s->state, 2, __ATOMIC_SEQ_CST);
+        if (!(state & 1))
+            futex(&s->state, FUTEX_WAIT_PRIVATE, state, &timeout);
+        __atomic_sub_fetch(&s->state, 2, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+static void* thread_main(void* arg)
+{
+    Thread* t = (Thread*)arg;
+
+    t->func(t->arg);
+
+    return 0;
+}
+
+
+int platform_thread_create(Thread* t, int priority, const char* name, void (*func)(void*), size_t stack_size, void* arg)
+{
+    pthread_attr_t attr;
+    char thread_name[16];
+    int rc;
+
+    /* the real-time policies need privileges, threads keep the default policy and priority */
+    (void)priority;
+
+    t->func = func;
+    t->arg = arg;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size < THREAD_STACK_MIN ? THREAD_STACK_MIN : stack_size);
+    rc = pthread_create(&t->thread, &attr, thread_main, t);
+    pthread_attr_destroy(&attr);
+    if (rc)
+        return -1;
+
+    if (name)
+    {
+        /* shown by top and gdb, at most 15 characters */
+        snprintf(thread_name, sizeof(thread_name), "%s", name);
+        pthread_setname_np(t->thread, thread_name);
+    }
+
+    return 0;
+}
+
+
+int platform_thread_join(Thread* t, int timeout_ms)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_REALTIME, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (end.tv_nsec >= 1000000000)
+    {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
+    }
+
+    return pthread_timedjoin_np(t->thread, 0, &end) ? -1 : 0;
+}
+
+
+int platform_thread_destroy(Thread* t)
+{
+    (void)t;
+    return 0;
+}
+
+
+void* platform_store_map(const char* path, size_t size)
+{
+    struct stat st;
+    void* addr;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd < 0)
+        return 0;
+
+    /* a new or shorter file is extended with zeros */
+    if (fstat(fd, &st) || ((size_t)st.st_size < size && ftruncate(fd, size)))
+    {
+        close(fd);
+        return 0;
+    }
+
+    addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return addr == MAP_FAILED ? 0 : addr;
+}
+
+
+int platform_store_sync(void* addr, size_t len)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+
+    return msync((void*)start, len + ((uintptr_t)addr - start), MS_SYNC);
+}
+
+
+void platform_store_unmap(void* addr, size_t size)
+{
+    munmap(addr, size);
+}
+
+
+int platform_printf(const char* fmt, ...)
+{
+    va_list args;
+    int rc;
+
+    va_start(args, fmt);
+    rc = vprintf(fmt, args);
+    va_end(args);
+
+    return rc;
+}
+
+
+void* platform_malloc(size_t bytes)
+{
+    return malloc(bytes);
+}
+
+
+void* platform_realloc(void* ptr, size_t bytes)
+{
+    return realloc(ptr, bytes);
+}
+
+
+void platform_free(void* memory)
+{
+    free(memory);
+}
+
+
+void platform_sleep(int ms)
+{
+    struct timespec left;
+
+    left.tv_sec = ms / 1000;
+    left.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&left, &left) < 0 && errno == EINTR)
+        ;
+}
+
+
+int platform_cpu_count(void)
+{
+    cpu_set_t set;
+    long count;
+
+    /* containers and taskset narrow down the processors a process may use */
+    if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+}
+
+
+/* client ids are made of these, so they must differ between devices and restarts */
+int platform_rand()
+{
+    static unsigned int seed;
+    unsigned int value;
+
+    if (getrandom(&value, sizeof(value), GRND_NONBLOCK) == sizeof(value))
+        return (int)(value & RAND_MAX);
+
+    /* the entropy pool of a device that has just booted may not be ready yet */
+    if (!seed)
+        seed = (unsigned int)monotonic_ns() ^ ((unsigned int)getpid() << 16);
+
+    return rand_r(&seed);
+}
@@ -0,0 +1,70 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_PLATFORM_TYPES_H)
+#define _EVRYTHNG_PLATFORM_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Linux platform: non-blocking sockets with TLS from OpenSSL, eventfd
+ * events, epoll pollers, futex semaphores and CLOCK_MONOTONIC timers.
+ */
+
+struct ssl_ctx_st;
+struct ssl_st;
+struct ssl_session_st;
+
+/* deadline on CLOCK_MONOTONIC, unaffected by changes to the wall clock */
+typedef struct Timer
+{
+    int64_t end_ns;
+} Timer;
+
+struct platform_trust_store_t;
+
+typedef struct Network
+{
+    int socket;
+
+    /* certificates of a secured network, either raw or from a shared trust store */
+    int secure;
+    const char* ca_buf;
+    size_t ca_size;
+    struct platform_trust_store_t* trust_store;
+
+    /* TLS state of the current connection */
+    struct ssl_ctx_st* tls_ctx;     /* made from ca_buf, without a trust store */
+    struct ssl_st* tls;
+    struct ssl_session_st* tls_session;    /* offered by the next connect, then the latest of the connection */
+} Network;
+
+typedef struct Mutex
+{
+    pthread_mutex_t mutex;
+} Mutex;
+
+/* binary semaphore on a futex, posts while it is already set are lost */
+typedef struct Semaphore
+{
+    int state;  /* bit 0 is set by a post, the other bits count waiters */
+} Semaphore;
+
+typedef struct Thread
+{
+    pthread_t thread;
+    void (*func)(void*);
+    void* arg;
+} Thread;
+
+/* an eventfd, readable while the event is set */
+typedef struct Event
+{
+    int fd;
+} Event;
+
+#endif //_EVRYTHNG_PLATFORM_TYPES_H
@@ -3,6 +3,7 @@
  * www.evrythng.com
  */
 
+#include <stdio.h>
 #include <string.h>
 
 #include "evrythng/evrythng.h"
@@ -156,6 +157,205 @@ void test_set_qos_fail(CuTest* tc)
     EvrythngDestroyHandle(h);
 }
 
+void test_set_inflight_window_ok(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetInflightWindow(h, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetInflightWindow(h, 16));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_inflight_window_fail(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetInflightWindow(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetInflightWindow(h, 17));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetInflightWindow(0, 4));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_offline_store_fail(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetOfflineStore(h, 0, 4096));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetOfflineStore(h, "offline_store.bin", 16));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetOfflineStore(0, "offline_store.bin", 4096));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetOfflineDrainRate(h, -1));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetOfflineDrainRate(0, 10));
+    EvrythngDestroyHandle(h);
+}
+
+/* the store file is kept out of the working directory */
+#ifndef P_tmpdir
+#define P_tmpdir "."
+#endif
+#define OFFLINE_STORE_PATH P_tmpdir "/evrythng_test_offline_store.bin"
+
+void test_offline_store_pub(CuTest* tc)
+{
+    evrythng_handle_t h;
+    evrythng_token_t token = 1;
+    remove(OFFLINE_STORE_PATH);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetOfflineStore(h, OFFLINE_STORE_PATH, 4096));
+    CuAssertIntEquals(tc, EVRYTHNG_FAILURE, EvrythngSetOfflineStore(h, OFFLINE_STORE_PATH, 4096));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetOfflineDrainRate(h, 10));
+
+    /* not connected, messages are kept in the store */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h, THNG_1, PROPERTY_1, "[{\"value\": 1}]"));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngPropertyAsync(h, THNG_1, PROPERTY_1, "[{\"value\": 2}]", 0, &token));
+    CuAssertIntEquals(tc, 0, token);
+    EvrythngDestroyHandle(h);
+    remove(OFFLINE_STORE_PATH);
+}
+
+void test_set_coalescing(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetCoalescing(h, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetCoalescing(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetCoalescing(0, 1));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_aggregation(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetAggregation(h, 100, 30));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetAggregation(h, 0, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetAggregation(h, -1, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetAggregation(h, 100, -1));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetAggregation(0, 100, 0));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_rate_limit(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimit(h, EVRYTHNG_RATE_ALL, 100, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimit(h, EVRYTHNG_RATE_PROPERTIES, 10, 20));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimit(h, EVRYTHNG_RATE_ACTIONS, 5, 5));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimit(h, EVRYTHNG_RATE_LOCATIONS, 0, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetRateLimit(h, 4, 10, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetRateLimit(h, EVRYTHNG_RATE_ALL, -1, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetRateLimit(h, EVRYTHNG_RATE_ALL, 10, -1));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetRateLimit(0, EVRYTHNG_RATE_ALL, 10, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimitWait(h, 500));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetRateLimitWait(h, -1));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetRateLimitWait(0, 500));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_callback_workers(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetCallbackWorkers(h, 4));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetCallbackWorkers(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetCallbackWorkers(h, -1));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetCallbackWorkers(h, 17));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetCallbackWorkers(0, 4));
+    EvrythngDestroyHandle(h);
+}
+
+void test_get_stats(CuTest* tc)
+{
+    evrythng_handle_t h;
+    evrythng_stats_t stats;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGetStats(h, &stats));
+    CuAssertIntEquals(tc, 0, stats.publishes);
+    CuAssertIntEquals(tc, 0, stats.queue_depth);
+    CuAssertIntEquals(tc, 0, stats.subscriptions);
+    CuAssertIntEquals(tc, 0, stats.publish_latency.count);
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngGetStats(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngGetStats(0, &stats));
+    EvrythngDestroyHandle(h);
+}
+
+void test_histogram_percentile(CuTest* tc)
+{
+    evrythng_histogram_t hist;
+    memset(&hist, 0, sizeof hist);
+    CuAssertIntEquals(tc, 0, EvrythngHistogramPercentile(&hist, 50));
+    hist.buckets[2] = 50;   /* 2 ms */
+    hist.buckets[8] = 50;   /* 8 or 9 ms */
+    hist.count = 100;
+    hist.max = 9;
+    CuAssertIntEquals(tc, 2, EvrythngHistogramPercentile(&hist, 50));
+    CuAssertIntEquals(tc, 9, EvrythngHistogramPercentile(&hist, 99));
+    CuAssertIntEquals(tc, 2, EvrythngHistogramPercentile(&hist, 0));
+    CuAssertIntEquals(tc, 0, EvrythngHistogramPercentile(&hist, 101));
+    CuAssertIntEquals(tc, 0, EvrythngHistogramPercentile(0, 50));
+}
+
+void test_set_log_level(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetLogLevel(h, EVRYTHNG_LOG_ERROR));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetLogLevel(h, EVRYTHNG_LOG_DEBUG));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetLogLevel(h, (evrythng_log_level_t)3));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetLogLevel(0, EVRYTHNG_LOG_ERROR));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_log_queue(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetLogQueue(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetLogQueue(0, 16));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetLogQueue(h, 16));
+    CuAssertIntEquals(tc, EVRYTHNG_FAILURE, EvrythngSetLogQueue(h, 16));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_persistent_session(CuTest* tc)
+{
+    evrythng_handle_t h;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetPersistentSession(h, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetPersistentSession(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetPersistentSession(0, 1));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_poll_mode(CuTest* tc)
+{
+    evrythng_handle_t h;
+    evrythng_poll_t state;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_FAILURE, EvrythngGetPollState(h, &state));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetPollMode(h, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGetPollState(h, &state));
+    CuAssertIntEquals(tc, -1, state.fd);
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngGetPollState(h, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetPollMode(0, 1));
+    EvrythngDestroyHandle(h);
+}
+
+void test_set_engine(CuTest* tc)
+{
+    evrythng_handle_t h;
+    evrythng_engine_handle_t e;
+    evrythng_poll_t state;
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngInitEngine(&e, -1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitEngine(&e, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitHandle(&h));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetEngine(h, e));
+    CuAssertIntEquals(tc, EVRYTHNG_FAILURE, EvrythngGetPollState(h, &state));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSetEngine(0, e));
+    EvrythngDestroyHandle(h);
+    EvrythngDestroyEngine(e);
+}
+
 void test_set_callback_ok(CuTest* tc)
 {
     evrythng_handle_t h;
@@ -281,6 +481,37 @@ void test_subunsub_thng(CuTest* tc)
     PRINT_END_MEM_STATS
 }
 
+void test_subunsub_many(CuTest* tc)
+{
+    PRINT_START_MEM_STATS 
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+
+    evrythng_subscription_t subs[] = {
+        { "thngs", THNG_1, "properties", PROPERTY_1, 0, test_sub_callback, EVRYTHNG_FAILURE },
+        { "thngs", THNG_1, "properties", PROPERTY_2, 0, test_sub_callback, EVRYTHNG_FAILURE },
+        { "thngs", THNG_1, "actions", ACTION_1, 0, test_sub_callback, EVRYTHNG_FAILURE },
+        { "thngs", "thng", "properties", PROPERTY_1, 0, test_sub_callback, EVRYTHNG_FAILURE },
+    };
+
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngSubscribeMany(h1, subs, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubscribeMany(h1, subs, 3));
+    CuAssertIntEquals(tc, EVRYTHNG_ALREADY_SUBSCRIBED, EvrythngSubThngProperty(h1, THNG_1, PROPERTY_2, 0, test_sub_callback));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngUnsubThngProperty(h1, THNG_1, PROPERTY_1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngUnsubThngProperty(h1, THNG_1, PROPERTY_2));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngUnsubThngAction(h1, THNG_1, ACTION_1));
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUBSCRIPTION_ERROR, EvrythngSubscribeMany(h1, subs, 4));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, subs[0].result);
+    CuAssertIntEquals(tc, EVRYTHNG_SUBSCRIPTION_ERROR, subs[3].result);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
 void test_subunsub_prod(CuTest* tc)
 {
     PRINT_START_MEM_STATS 
@@ -316,6 +547,340 @@ void test_pubsub_thng_prop(CuTest* tc)
     END_SINGLE_CONNECTION
 }
 
+static void test_pub_callback(evrythng_token_t token, evrythng_return_t result, int latency_ms)
+{
+    platform_printf("%s: token %d, result %d, latency %d ms\n\r", __func__, token, result, latency_ms);
+}
+
+void test_pubsub_thng_prop_async(CuTest* tc)
+{
+    evrythng_token_t token = 0;
+    START_SINGLE_CONNECTION
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperty(h1, THNG_1, PROPERTY_1, 0, test_sub_callback));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON, test_pub_callback, &token));
+    CuAssertTrue(tc, token > 0);
+    END_SINGLE_CONNECTION
+}
+
+static evrythng_token_t done_tokens[32];
+static evrythng_return_t done_results[32];
+static int done_count;
+
+static void test_order_callback(evrythng_token_t token, evrythng_return_t result, int latency_ms)
+{
+    if (done_count < 32)
+    {
+        done_tokens[done_count] = token;
+        done_results[done_count] = result;
+    }
+    done_count++;
+}
+
+void test_pub_async_queue(CuTest* tc)
+{
+    evrythng_token_t props[16], actions[16], token;
+    int i, n;
+
+    PRINT_START_MEM_STATS
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+    /* nothing takes ops out of the queue until EvrythngProcess is called */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetPollMode(h1, 1));
+    /* QoS0 publishes complete in the order they are taken out of the queue */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetQos(h1, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+
+    done_count = 0;
+    for (i = 0; i < 16; i++)
+        CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON, test_order_callback, &props[i]));
+    CuAssertIntEquals(tc, EVRYTHNG_QUEUE_FULL, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON, test_order_callback, &token));
+    for (i = 0; i < 16; i++)
+        CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngActionAsync(h1, THNG_1, ACTION_1, ACTION_JSON, test_order_callback, &actions[i]));
+    /* a full action lane overflows into the property lane, which is full too */
+    CuAssertIntEquals(tc, EVRYTHNG_QUEUE_FULL, EvrythngPubThngActionAsync(h1, THNG_1, ACTION_1, ACTION_JSON, test_order_callback, &token));
+
+    for (i = 0; i < 100 && done_count < 32; i++)
+        CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngProcess(h1, 0));
+    CuAssertIntEquals(tc, 32, done_count);
+
+    /* actions go first, a property gets its turn after every 4 of them */
+    for (i = 0, n = 0; i < 16; i++)
+    {
+        CuAssertIntEquals(tc, actions[i], done_tokens[n++]);
+        if (i % 4 == 3)
+            CuAssertIntEquals(tc, props[i / 4], done_tokens[n++]);
+    }
+    for (i = 4; i < 16; i++)
+        CuAssertIntEquals(tc, props[i], done_tokens[n++]);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
+void test_pub_async_coalesced(CuTest* tc)
+{
+    evrythng_token_t first, second;
+    int i;
+
+    PRINT_START_MEM_STATS
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+    /* nothing takes ops out of the queue until EvrythngProcess is called */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetPollMode(h1, 1));
+    /* QoS0 publishes complete once they are sent */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetQos(h1, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetCoalescing(h1, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+
+    done_count = 0;
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, "[{\"value\": 1}]", test_order_callback, &first));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, "[{\"value\": 2}]", test_order_callback, &second));
+    CuAssertTrue(tc, first != second);
+
+    for (i = 0; i < 100 && done_count < 2; i++)
+        CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngProcess(h1, 0));
+    CuAssertIntEquals(tc, 2, done_count);
+
+    /* the replaced update is never sent, it completes first */
+    CuAssertIntEquals(tc, first, done_tokens[0]);
+    CuAssertIntEquals(tc, EVRYTHNG_SUPERSEDED, done_results[0]);
+    CuAssertIntEquals(tc, second, done_tokens[1]);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, done_results[1]);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
+static char agg_msg[512];
+
+static void test_agg_callback(const char* str_json, size_t len)
+{
+    snprintf(agg_msg, sizeof agg_msg, "%.*s", (int)len, str_json);
+    platform_printf("%s: %s\n\r", __func__, agg_msg);
+    platform_semaphore_post(&sub_sem);
+}
+
+void test_pub_aggregated(CuTest* tc)
+{
+    PRINT_START_MEM_STATS
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+    /* only max_count sends the batch within the test */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetAggregation(h1, 10000, 3));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperties(h1, THNG_1, 0, test_agg_callback));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperty(h1, THNG_1, PROPERTY_1, 0, test_agg_callback));
+
+    /* values which are not arrays of objects are sent on their own */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, "{\"value\": 5}"));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+    CuAssertStrEquals(tc, "{\"value\": 5}", agg_msg);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, "[1, 2]"));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+    CuAssertStrEquals(tc, "[1, 2]", agg_msg);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, "[{\"value\": 1}]"));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_2, " [ {\"value\": \"a}b\\\"{\"} ,{ } ] "));
+    CuAssertTrue(tc, platform_semaphore_wait(&sub_sem, 500) != 0);
+
+    /* the third update fills the batch */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, "a\"b\\c", "[{\"value\": true}]"));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+    CuAssertStrEquals(tc,
+            "[{\"key\":\"" PROPERTY_1 "\",\"value\": 1},"
+            "{\"key\":\"" PROPERTY_2 "\",\"value\": \"a}b\\\"{\"},"
+            "{\"key\":\"" PROPERTY_2 "\"},"
+            "{\"key\":\"a\\\"b\\\\c\",\"value\": true}]",
+            agg_msg);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
+void test_pub_rate_limited(CuTest* tc)
+{
+    evrythng_token_t token = 1;
+    Timer timer;
+
+    PRINT_START_MEM_STATS
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimit(h1, EVRYTHNG_RATE_PROPERTIES, 1, 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimitWait(h1, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON));
+    CuAssertIntEquals(tc, EVRYTHNG_RATE_LIMITED, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON));
+    /* other classes have their own buckets */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngAction(h1, THNG_1, ACTION_1, ACTION_JSON));
+
+    /* the next token comes after a second */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetRateLimitWait(h1, 1500));
+    platform_timer_init(&timer);
+    platform_timer_countdown(&timer, 10000);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON));
+    CuAssertIntInterval(tc, 500, 1500, 10000 - platform_timer_left(&timer));
+    platform_timer_deinit(&timer);
+
+    /* asynchronous publishes never wait */
+    CuAssertIntEquals(tc, EVRYTHNG_RATE_LIMITED, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON, 0, &token));
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
+static int seq_values[16];
+static int seq_count;
+
+static void test_seq_callback(const char* str_json, size_t len)
+{
+    char msg[len+1]; snprintf(msg, sizeof msg, "%s", str_json);
+    int value = -1;
+    sscanf(msg, "[{\"value\": %d", &value);
+    /* a slow callback lets the messages pile up at its worker */
+    platform_sleep(5);
+    if (seq_count < 16)
+        seq_values[seq_count] = value;
+    if (++seq_count == 16)
+        platform_semaphore_post(&sub_sem);
+}
+
+void test_pubsub_callback_workers(CuTest* tc)
+{
+    char json[32];
+    evrythng_token_t token;
+    int i;
+
+    PRINT_START_MEM_STATS
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetCallbackWorkers(h1, 4));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperty(h1, THNG_1, PROPERTY_1, 0, test_seq_callback));
+
+    seq_count = 0;
+    for (i = 0; i < 16; i++)
+    {
+        snprintf(json, sizeof json, "[{\"value\": %d}]", i);
+        CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngPropertyAsync(h1, THNG_1, PROPERTY_1, json, 0, &token));
+    }
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+
+    /* one worker takes all the messages of a topic, one after another */
+    for (i = 0; i < 16; i++)
+        CuAssertIntEquals(tc, i, seq_values[i]);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
+/* the smallest store, it takes a dozen or so of the property updates below */
+#define OFFLINE_STORE_SMALL 1024
+
+static evrythng_return_t store_fill(evrythng_handle_t h, int first, int* n)
+{
+    char json[32];
+    evrythng_return_t rc = EVRYTHNG_SUCCESS;
+
+    for (*n = 0; *n < 64; (*n)++)
+    {
+        snprintf(json, sizeof json, "[{\"value\": %d}]", first + *n);
+        if ((rc = EvrythngPubThngProperty(h, THNG_1, PROPERTY_1, json)) != EVRYTHNG_SUCCESS)
+            break;
+    }
+    return rc;
+}
+
+static unsigned int stored_count(const char* path)
+{
+    evrythng_handle_t h;
+    evrythng_stats_t stats;
+    stats.stored = -1;
+    EvrythngInitHandle(&h);
+    EvrythngSetOfflineStore(h, path, OFFLINE_STORE_SMALL);
+    EvrythngGetStats(h, &stats);
+    EvrythngDestroyHandle(h);
+    return stats.stored;
+}
+
+void test_offline_store_recover(CuTest* tc)
+{
+    evrythng_stats_t stats;
+    unsigned char data[OFFLINE_STORE_SMALL];
+    const char* value = "\"value\": 500}";
+    int i, n, added, kept;
+
+    PRINT_START_MEM_STATS
+    evrythng_handle_t h1;
+    remove(OFFLINE_STORE_PATH);
+    common_tcp_init_handle(&h1);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetOfflineStore(h1, OFFLINE_STORE_PATH, OFFLINE_STORE_SMALL));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetOfflineDrainRate(h1, 4));
+
+    CuAssertIntEquals(tc, EVRYTHNG_QUEUE_FULL, store_fill(h1, 100, &n));
+    CuAssertTrue(tc, n > 4);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGetStats(h1, &stats));
+    CuAssertIntEquals(tc, n, stats.stored);
+
+    /* the first second's worth is sent, the rest stays */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+    for (i = 0; i < 200 && stats.stored > n - 4; i++)
+    {
+        platform_sleep(10);
+        EvrythngGetStats(h1, &stats);
+    }
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    EvrythngGetStats(h1, &stats);
+    kept = stats.stored;
+    CuAssertTrue(tc, kept <= n - 4);
+
+    /* the space sent from the start of the ring is filled again from the end of it */
+    CuAssertIntEquals(tc, EVRYTHNG_QUEUE_FULL, store_fill(h1, 500, &added));
+    CuAssertTrue(tc, added >= 4);
+    EvrythngGetStats(h1, &stats);
+    CuAssertIntEquals(tc, kept + added, stats.stored);
+    EvrythngDestroyHandle(h1);
+
+    CuAssertIntEquals(tc, kept + added, stored_count(OFFLINE_STORE_PATH));
+
+    /* a damaged record is dropped on its own */
+    FILE* f = fopen(OFFLINE_STORE_PATH, "r+b");
+    CuAssertPtrNotNull(tc, f);
+    if (f)
+    {
+        CuAssertIntEquals(tc, sizeof data, fread(data, 1, sizeof data, f));
+        for (i = 0; i + strlen(value) <= sizeof data && memcmp(data + i, value, strlen(value)); i++)
+            ;
+        CuAssertTrue(tc, i + strlen(value) <= sizeof data);
+        /* 500 becomes 600 */
+        fseek(f, i + strlen(value) - 4, SEEK_SET);
+        fputc('6', f);
+        fclose(f);
+    }
+
+    CuAssertIntEquals(tc, kept + added - 1, stored_count(OFFLINE_STORE_PATH));
+
+    remove(OFFLINE_STORE_PATH);
+    PRINT_END_MEM_STATS
+}
+
+void test_pubsub_thng_prop_prepared(CuTest* tc)
+{
+    evrythng_pub_handle_t pub;
+    START_SINGLE_CONNECTION
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngPreparePublish(h1, THNG_1, 0, &pub));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPreparePublish(h1, THNG_1, PROPERTY_1, &pub));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperty(h1, THNG_1, PROPERTY_1, 0, test_sub_callback));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPublishPrepared(pub, PROPERTY_VALUE_JSON, strlen(PROPERTY_VALUE_JSON)));
+    EvrythngReleasePublish(pub);
+    END_SINGLE_CONNECTION
+}
+
 void test_pubsuball_thng_prop(CuTest* tc)
 {
     START_SINGLE_CONNECTION
@@ -491,6 +1056,66 @@ void test_publish_bad_entity(CuTest* tc)
     PRINT_END_MEM_STATS
 }
 
+void test_publish_connection_lost(CuTest* tc)
+{
+    PRINT_START_MEM_STATS 
+    evrythng_handle_t h1;
+    common_tcp_init_handle(&h1);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+    /* the cloud drops the connection while the publish is in flight and won't take the client back */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetKey(h1, "123"));
+    CuAssertIntEquals(tc, EVRYTHNG_PUBLISH_ERROR, EvrythngPubThngProperty(h1, "rt", PROPERTY_1, PROPERTY_VALUE_JSON));
+    EvrythngDestroyHandle(h1);
+    PRINT_END_MEM_STATS
+}
+
+void test_engine_handles(CuTest* tc)
+{
+    evrythng_engine_handle_t e;
+    evrythng_handle_t h1, h2, h3;
+
+    PRINT_START_MEM_STATS
+    /* a single loop drives all the handles */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngInitEngine(&e, 1));
+    common_tcp_init_handle(&h1);
+    common_tcp_init_handle(&h2);
+    common_tcp_init_handle(&h3);
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetEngine(h1, e));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetEngine(h2, e));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetEngine(h3, e));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h2));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngConnect(h3));
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperty(h1, THNG_1, PROPERTY_1, 0, test_sub_callback));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSubThngProperty(h2, THNG_1, PROPERTY_2, 0, test_sub_callback));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h2, THNG_1, PROPERTY_2, PROPERTY_VALUE_JSON));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+
+    /*
+     * The lost connection is taken back by a connect worker while the loop
+     * goes on without the handle, which is destroyed in the meantime.
+     */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngSetKey(h3, "123"));
+    CuAssertIntEquals(tc, EVRYTHNG_PUBLISH_ERROR, EvrythngPubThngProperty(h3, "rt", PROPERTY_1, PROPERTY_VALUE_JSON));
+    EvrythngDestroyHandle(h3);
+
+    /* the loop still serves the other handles */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h1, THNG_1, PROPERTY_1, PROPERTY_VALUE_JSON));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPubThngProperty(h2, THNG_1, PROPERTY_2, PROPERTY_VALUE_JSON));
+    CuAssertIntEquals(tc, 0, platform_semaphore_wait(&sub_sem, 10000));
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDisconnect(h2));
+    EvrythngDestroyHandle(h1);
+    EvrythngDestroyHandle(h2);
+    EvrythngDestroyEngine(e);
+    PRINT_END_MEM_STATS
+}
+
 
 extern int next_sleep_time(int);
 
@@ -539,6 +1164,8 @@ CuSuite* CuGetSuite(void)
 
 	SUITE_ADD_TEST(suite, test_publish_bad_thngid);
 	SUITE_ADD_TEST(suite, test_publish_bad_entity);
+	SUITE_ADD_TEST(suite, test_publish_connection_lost);
+	SUITE_ADD_TEST(suite, test_engine_handles);
     
 	SUITE_ADD_TEST(suite, test_init_handle_ok);
 	SUITE_ADD_TEST(suite, test_init_handle_fail);
@@ -548,6 +1175,21 @@ CuSuite* CuGetSuite(void)
 	SUITE_ADD_TEST(suite, test_set_client_id_ok);
 	SUITE_ADD_TEST(suite, test_set_qos_ok);
 	SUITE_ADD_TEST(suite, test_set_qos_fail);
+	SUITE_ADD_TEST(suite, test_set_inflight_window_ok);
+	SUITE_ADD_TEST(suite, test_set_inflight_window_fail);
+	SUITE_ADD_TEST(suite, test_set_offline_store_fail);
+	SUITE_ADD_TEST(suite, test_offline_store_pub);
+	SUITE_ADD_TEST(suite, test_set_coalescing);
+	SUITE_ADD_TEST(suite, test_set_aggregation);
+	SUITE_ADD_TEST(suite, test_set_rate_limit);
+	SUITE_ADD_TEST(suite, test_set_callback_workers);
+	SUITE_ADD_TEST(suite, test_get_stats);
+	SUITE_ADD_TEST(suite, test_histogram_percentile);
+	SUITE_ADD_TEST(suite, test_set_log_level);
+	SUITE_ADD_TEST(suite, test_set_log_queue);
+	SUITE_ADD_TEST(suite, test_set_persistent_session);
+	SUITE_ADD_TEST(suite, test_set_poll_mode);
+	SUITE_ADD_TEST(suite, test_set_engine);
 	SUITE_ADD_TEST(suite, test_set_callback_ok);
 	SUITE_ADD_TEST(suite, test_set_callback_fail);
 	SUITE_ADD_TEST(suite, test_tcp_connect_ok1);
@@ -559,8 +1201,17 @@ CuSuite* CuGetSuite(void)
 
 	SUITE_ADD_TEST(suite, test_subunsub_thng);
 	SUITE_ADD_TEST(suite, test_subunsub_prod);
+	SUITE_ADD_TEST(suite, test_subunsub_many);
 
 	SUITE_ADD_TEST(suite, test_pubsub_thng_prop);
+	SUITE_ADD_TEST(suite, test_pubsub_thng_prop_async);
+	SUITE_ADD_TEST(suite, test_pub_async_queue);
+	SUITE_ADD_TEST(suite, test_pub_async_coalesced);
+	SUITE_ADD_TEST(suite, test_pub_aggregated);
+	SUITE_ADD_TEST(suite, test_pub_rate_limited);
+	SUITE_ADD_TEST(suite, test_pubsub_callback_workers);
+	SUITE_ADD_TEST(suite, test_offline_store_recover);
+	SUITE_ADD_TEST(suite, test_pubsub_thng_prop_prepared);
 	SUITE_ADD_TEST(suite, test_pubsuball_thng_prop);
 
 	SUITE_ADD_TEST(suite, test_pubsub_thng_action);